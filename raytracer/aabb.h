@@ -4,21 +4,22 @@
 
 #include "raytracer.h"
 
-class aabb {
+template <typename T>
+class aabb_t {
 
     public:
-        aabb() {}
-        aabb(const point3& a, const point3& b) { minimum = a; maximum = b; }
+        aabb_t() {}
+        aabb_t(const vec3_t<T>& a, const vec3_t<T>& b) { minimum = a; maximum = b; }
 
-        point3 min() const { return minimum; }
-        point3 max() const { return maximum; }
+        vec3_t<T> min() const { return minimum; }
+        vec3_t<T> max() const { return maximum; }
 
-        bool hit(const ray& r, double tmin, double tmax) const {
+        bool hit(const ray_t<T>& r, T tmin, T tmax) const {
             for (int a = 0; a < 3; a++) {
-                auto invD = 1.0f / r.direction()[a];
+                auto invD = 1 / r.direction()[a];
                 auto t0 = (min()[a] - r.origin()[a]) * invD;
                 auto t1 = (max()[a] - r.origin()[a]) * invD;
-                if (invD < 0.0f)
+                if (invD < 0)
                     std::swap(t0, t1);
                 tmin = t0 > tmin ? t0 : tmin;
                 tmax = t1 < tmax ? t1 : tmax;
@@ -28,20 +29,28 @@ class aabb {
             return true;
         }
 
-        point3 minimum;
-        point3 maximum;
+        T surface_area() const {
+            auto d = maximum - minimum;
+            return 2 * (d.x()*d.y() + d.y()*d.z() + d.z()*d.x());
+        }
+
+        vec3_t<T> minimum;
+        vec3_t<T> maximum;
 };
 
-aabb surrounding_box(aabb box0, aabb box1) {
-    point3 small(fmin(box0.min().x(), box1.min().x()),
-                 fmin(box0.min().y(), box1.min().y()),
-                 fmin(box0.min().z(), box1.min().z()));
+using aabb = aabb_t<real>;
+
+template <typename T>
+aabb_t<T> surrounding_box(aabb_t<T> box0, aabb_t<T> box1) {
+    vec3_t<T> small(fmin(box0.min().x(), box1.min().x()),
+                    fmin(box0.min().y(), box1.min().y()),
+                    fmin(box0.min().z(), box1.min().z()));
 
-    point3 big(fmax(box0.max().x(), box1.max().x()),
-               fmax(box0.max().y(), box1.max().y()),
-               fmax(box0.max().z(), box1.max().z()));
+    vec3_t<T> big(fmax(box0.max().x(), box1.max().x()),
+                  fmax(box0.max().y(), box1.max().y()),
+                  fmax(box0.max().z(), box1.max().z()));
 
-    return aabb(small,big);
+    return aabb_t<T>(small,big);
 }
 
 
@@ -4,6 +4,8 @@
 
 #include "raytracer.h"
 #include "hittable.h"
+#include "material.h"
+#include "simd.h"
 
 class xy_rect : public hittable {
     public:
@@ -11,7 +13,19 @@ class xy_rect : public hittable {
 
         xy_rect(double _x0, double _x1, double _y0, double _y1, double _k, shared_ptr<material> mat) : x0(_x0), x1(_x1), y0(_y0), y1(_y1), k(_k), mp(mat) {};
 
-        virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+        virtual bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const override;
+        virtual int hit_packet(
+            const ray_packet& packet, int mask, real t_min, real* t_max, hit_record* recs
+        ) const override;
+
+        void set_hit_record(const ray& r, double t, hit_record& rec) const;
+
+        virtual double pdf_value(const point3& origin, const vec3& v) const override;
+        virtual vec3 random_direction(const point3& origin, pcg32& rng) const override;
+        virtual void collect_lights(std::vector<const hittable*>& lights) const override {
+            if (mp->kind() == material_kind::diffuse_light)
+                lights.push_back(this);
+        }
 
         virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
             // The bounding box must have non-zero width in each dimension, so pad the Z
@@ -31,7 +45,19 @@ class xz_rect : public hittable {
 
         xz_rect(double _x0, double _x1, double _z0, double _z1, double _k, shared_ptr<material> mat) : x0(_x0), x1(_x1), z0(_z0), z1(_z1), k(_k), mp(mat) {};
 
-        virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+        virtual bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const override;
+        virtual int hit_packet(
+            const ray_packet& packet, int mask, real t_min, real* t_max, hit_record* recs
+        ) const override;
+
+        void set_hit_record(const ray& r, double t, hit_record& rec) const;
+
+        virtual double pdf_value(const point3& origin, const vec3& v) const override;
+        virtual vec3 random_direction(const point3& origin, pcg32& rng) const override;
+        virtual void collect_lights(std::vector<const hittable*>& lights) const override {
+            if (mp->kind() == material_kind::diffuse_light)
+                lights.push_back(this);
+        }
 
         virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
             // The bounding box must have non-zero width in each dimension, so pad the Y
@@ -51,7 +77,19 @@ class yz_rect : public hittable {
 
         yz_rect(double _y0, double _y1, double _z0, double _z1, double _k, shared_ptr<material> mat) : y0(_y0), y1(_y1), z0(_z0), z1(_z1), k(_k), mp(mat) {};
 
-        virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+        virtual bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const override;
+        virtual int hit_packet(
+            const ray_packet& packet, int mask, real t_min, real* t_max, hit_record* recs
+        ) const override;
+
+        void set_hit_record(const ray& r, double t, hit_record& rec) const;
+
+        virtual double pdf_value(const point3& origin, const vec3& v) const override;
+        virtual vec3 random_direction(const point3& origin, pcg32& rng) const override;
+        virtual void collect_lights(std::vector<const hittable*>& lights) const override {
+            if (mp->kind() == material_kind::diffuse_light)
+                lights.push_back(this);
+        }
 
         virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
             // The bounding box must have non-zero width in each dimension, so pad the X
@@ -65,7 +103,71 @@ class yz_rect : public hittable {
         double y0, y1, z0, z1, k;
 };
 
-bool xy_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+// packet test shared by the three rectangles: the rectangle spans [a0,a1] x [b0,b1] along axes a and b and
+// lies in the plane at k along the third axis
+#ifdef RAYTRACER_X86_SIMD
+
+// the same arithmetic as the hit() functions for four rays at a time, so packets find exactly the hits
+// single rays do; writes t for the rays selected by mask that hit and returns their mask
+RAYTRACER_TARGET_AVX2
+inline int aarect_hit_packet_avx2(
+    const ray_packet& packet, int mask, real t_min, const real* t_max,
+    int a, int b, int axis, double a0, double a1, double b0, double b1, double k, double* t_hit
+) {
+    int hits = 0;
+
+    for (int base = 0; base < packet_size; base += 4) {
+        int lanes = (mask >> base) & 0xf;
+        if (!lanes)
+            continue;
+
+        __m256d t = _mm256_div_pd(_mm256_sub_pd(_mm256_set1_pd(k), load4_pd(packet.origin[axis] + base)),
+                                  load4_pd(packet.direction[axis] + base));
+        __m256d pa = _mm256_add_pd(load4_pd(packet.origin[a] + base),
+                                   _mm256_mul_pd(t, load4_pd(packet.direction[a] + base)));
+        __m256d pb = _mm256_add_pd(load4_pd(packet.origin[b] + base),
+                                   _mm256_mul_pd(t, load4_pd(packet.direction[b] + base)));
+
+        __m256d miss = _mm256_or_pd(
+            _mm256_cmp_pd(t, _mm256_set1_pd(t_min), _CMP_LT_OQ),
+            _mm256_cmp_pd(t, load4_pd(t_max + base), _CMP_GT_OQ));
+        miss = _mm256_or_pd(miss, _mm256_or_pd(
+            _mm256_cmp_pd(pa, _mm256_set1_pd(a0), _CMP_LT_OQ), _mm256_cmp_pd(pa, _mm256_set1_pd(a1), _CMP_GT_OQ)));
+        miss = _mm256_or_pd(miss, _mm256_or_pd(
+            _mm256_cmp_pd(pb, _mm256_set1_pd(b0), _CMP_LT_OQ), _mm256_cmp_pd(pb, _mm256_set1_pd(b1), _CMP_GT_OQ)));
+
+        lanes &= ~_mm256_movemask_pd(miss);
+        _mm256_storeu_pd(t_hit + base, t);
+        hits |= lanes << base;
+    }
+
+    return hits;
+}
+
+#endif // RAYTRACER_X86_SIMD
+
+template <typename rect>
+int aarect_hit_packet(
+    const rect& object, const ray_packet& packet, int mask, real t_min, real* t_max, hit_record* recs,
+    int a, int b, int axis, double a0, double a1, double b0, double b1, double k
+) {
+#ifdef RAYTRACER_X86_SIMD
+    if (active_simd_isa() == simd_isa::avx2) {
+        double t[packet_size];
+        int hits = aarect_hit_packet_avx2(packet, mask, t_min, t_max, a, b, axis, a0, a1, b0, b1, k, t);
+        for (int i = 0; i < packet_size; i++) {
+            if (hits & (1 << i)) {
+                object.set_hit_record(packet.lane(i), t[i], recs[i]);
+                t_max[i] = t[i];
+            }
+        }
+        return hits;
+    }
+#endif
+    return object.hittable::hit_packet(packet, mask, t_min, t_max, recs);
+}
+
+bool xy_rect::hit(const ray& r, real t_min, real t_max, hit_record& rec) const {
     auto t = (k - r.origin().z()) / r.direction().z();
 
     if (t < t_min || t > t_max)
@@ -77,19 +179,34 @@ bool xy_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) con
     if (x < x0 || x > x1 || y < y0 || y > y1)
         return false;
 
+    set_hit_record(r, t, rec);
+    return true;
+}
+
+void xy_rect::set_hit_record(const ray& r, double t, hit_record& rec) const {
+    auto x = r.origin().x() + t*r.direction().x();
+    auto y = r.origin().y() + t*r.direction().y();
+
     rec.u = (x-x0) / (x1-x0);
     rec.v = (y-y0) / (y1-y0);
     rec.t = t;
 
     auto outward_normal = vec3(0, 0, 1);
     rec.set_face_normal(r, outward_normal);
-    rec.mat_ptr = mp;
+    rec.mat_ptr = mp.get();
     rec.p = r.at(t);
+    // exactly on the plane, the rounding is left in the coordinates along it
+    rec.p[2] = k;
+    rec.error = hit_error(max_magnitude(rec.p));
+}
 
-    return true;
+int xy_rect::hit_packet(
+    const ray_packet& packet, int mask, real t_min, real* t_max, hit_record* recs
+) const {
+    return aarect_hit_packet(*this, packet, mask, t_min, t_max, recs, 0, 1, 2, x0, x1, y0, y1, k);
 }
 
-bool xz_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+bool xz_rect::hit(const ray& r, real t_min, real t_max, hit_record& rec) const {
     auto t = (k - r.origin().y()) / r.direction().y();
 
     if (t < t_min || t > t_max)
@@ -101,19 +218,33 @@ bool xz_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) con
     if (x < x0 || x > x1 || z < z0 || z > z1)
         return false;
 
+    set_hit_record(r, t, rec);
+    return true;
+}
+
+void xz_rect::set_hit_record(const ray& r, double t, hit_record& rec) const {
+    auto x = r.origin().x() + t*r.direction().x();
+    auto z = r.origin().z() + t*r.direction().z();
+
     rec.u = (x-x0) / (x1-x0);
     rec.v = (z-z0) / (z1-z0);
     rec.t = t;
 
     auto outward_normal = vec3(0, 1, 0);
     rec.set_face_normal(r, outward_normal);
-    rec.mat_ptr = mp;
+    rec.mat_ptr = mp.get();
     rec.p = r.at(t);
+    rec.p[1] = k;
+    rec.error = hit_error(max_magnitude(rec.p));
+}
 
-    return true;
+int xz_rect::hit_packet(
+    const ray_packet& packet, int mask, real t_min, real* t_max, hit_record* recs
+) const {
+    return aarect_hit_packet(*this, packet, mask, t_min, t_max, recs, 0, 2, 1, x0, x1, z0, z1, k);
 }
 
-bool yz_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+bool yz_rect::hit(const ray& r, real t_min, real t_max, hit_record& rec) const {
     auto t = (k - r.origin().x()) / r.direction().x();
 
     if (t < t_min || t > t_max)
@@ -125,16 +256,66 @@ bool yz_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) con
     if (y < y0 || y > y1 || z < z0 || z > z1)
         return false;
 
+    set_hit_record(r, t, rec);
+    return true;
+}
+
+void yz_rect::set_hit_record(const ray& r, double t, hit_record& rec) const {
+    auto y = r.origin().y() + t*r.direction().y();
+    auto z = r.origin().z() + t*r.direction().z();
+
     rec.u = (y-y0) / (y1-y0);
     rec.v = (z-z0) / (z1-z0);
     rec.t = t;
 
     auto outward_normal = vec3(1, 0, 0);
     rec.set_face_normal(r, outward_normal);
-    rec.mat_ptr = mp;
+    rec.mat_ptr = mp.get();
     rec.p = r.at(t);
+    rec.p[0] = k;
+    rec.error = hit_error(max_magnitude(rec.p));
+}
 
-    return true;
+int yz_rect::hit_packet(
+    const ray_packet& packet, int mask, real t_min, real* t_max, hit_record* recs
+) const {
+    return aarect_hit_packet(*this, packet, mask, t_min, t_max, recs, 1, 2, 0, y0, y1, z0, z1, k);
+}
+
+// light sampling: a uniformly random point on the rectangle, whose density over the area, 1 / area, is
+// turned into a density over solid angle by the distance squared over the cosine at the rectangle
+inline double aarect_pdf_value(const hittable& rect, double area, const point3& origin, const vec3& v) {
+    hit_record rec;
+    if (!rect.hit(ray(origin, v), 0, infinity, rec))
+        return 0;
+
+    auto distance_squared = rec.t * rec.t * v.length_squared();
+    auto cosine = fabs(dot(v, rec.normal) / v.length());
+    return distance_squared / (cosine * area);
+}
+
+double xy_rect::pdf_value(const point3& origin, const vec3& v) const {
+    return aarect_pdf_value(*this, (x1-x0)*(y1-y0), origin, v);
+}
+
+vec3 xy_rect::random_direction(const point3& origin, pcg32& rng) const {
+    return point3(random_double(rng, x0, x1), random_double(rng, y0, y1), k) - origin;
+}
+
+double xz_rect::pdf_value(const point3& origin, const vec3& v) const {
+    return aarect_pdf_value(*this, (x1-x0)*(z1-z0), origin, v);
+}
+
+vec3 xz_rect::random_direction(const point3& origin, pcg32& rng) const {
+    return point3(random_double(rng, x0, x1), k, random_double(rng, z0, z1)) - origin;
+}
+
+double yz_rect::pdf_value(const point3& origin, const vec3& v) const {
+    return aarect_pdf_value(*this, (y1-y0)*(z1-z0), origin, v);
+}
+
+vec3 yz_rect::random_direction(const point3& origin, pcg32& rng) const {
+    return point3(k, random_double(rng, y0, y1), random_double(rng, z0, z1)) - origin;
 }
 
 #endif // AARECT_H
@@ -1,17 +1,27 @@
-
 #ifndef BOX_H
 #define BOX_H
 
 #include "raytracer.h"
-#include "hittable_list.h"
-#include "aarect.h"
+#include "hittable.h"
+#include "material.h"
+
+#include <utility>
+
+// axis aligned box, intersected as a whole with one slab test rather than as six rectangles
+// the ray is inside the box between the largest of its distances to the three near faces and the smallest of
+// its distances to the three far faces; the axis that gives the distance tells which face is hit, and the
+// face's normal and texture coordinates follow from it (u and v along the face's other two axes, in order,
+// like the rectangles)
+// boxes are not sampled as lights: a box made of diffuse_light is still found by scattered rays
 
 class box : public hittable {
     public:
         box() {}
-        box(const point3& p0, const point3& p1, shared_ptr<material> ptr);
+        box(const point3& p0, const point3& p1, shared_ptr<material> ptr)
+            : box_min(p0), box_max(p1), mp(ptr)
+        {}
 
-        virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+        virtual bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const override;
 
         virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
             output_box = aabb(box_min, box_max);
@@ -21,25 +31,69 @@ class box : public hittable {
     public:
         point3 box_min;
         point3 box_max;
-        hittable_list sides;
+        shared_ptr<material> mp;
 };
 
-box::box(const point3& p0, const point3& p1, shared_ptr<material> ptr) {
-    box_min = p0;
-    box_max = p1;
+bool box::hit(const ray& r, real t_min, real t_max, hit_record& rec) const {
+    auto t_enter = -infinity;
+    auto t_exit = infinity;
+    int enter_axis = 0;
+    int exit_axis = 0;
+
+    for (int a = 0; a < 3; a++) {
+        auto inv_d = 1 / r.direction()[a];
+        auto t0 = (box_min[a] - r.origin()[a]) * inv_d;
+        auto t1 = (box_max[a] - r.origin()[a]) * inv_d;
+        if (inv_d < 0)
+            std::swap(t0, t1);
+        if (t0 > t_enter) {
+            t_enter = t0;
+            enter_axis = a;
+        }
+        if (t1 < t_exit) {
+            t_exit = t1;
+            exit_axis = a;
+        }
+    }
+
+    if (t_enter > t_exit)
+        return false;
 
-    sides.add(make_shared<xy_rect>(p0.x(), p1.x(), p0.y(), p1.y(), p1.z(), ptr));
-    sides.add(make_shared<xy_rect>(p0.x(), p1.x(), p0.y(), p1.y(), p0.z(), ptr));
+    // a ray that starts inside the box (e.g. after refracting into it) hits the face it leaves through
+    double t;
+    int axis;
+    bool entering;
+    if (t_enter >= t_min && t_enter <= t_max) {
+        t = t_enter;
+        axis = enter_axis;
+        entering = true;
+    } else if (t_exit >= t_min && t_exit <= t_max) {
+        t = t_exit;
+        axis = exit_axis;
+        entering = false;
+    } else {
+        return false;
+    }
 
-    sides.add(make_shared<xz_rect>(p0.x(), p1.x(), p0.z(), p1.z(), p1.y(), ptr));
-    sides.add(make_shared<xz_rect>(p0.x(), p1.x(), p0.z(), p1.z(), p0.y(), ptr));
+    rec.t = t;
+    rec.p = r.at(t);
 
-    sides.add(make_shared<yz_rect>(p0.y(), p1.y(), p0.z(), p1.z(), p1.x(), ptr));
-    sides.add(make_shared<yz_rect>(p0.y(), p1.y(), p0.z(), p1.z(), p0.x(), ptr));
-}
+    int a = axis == 0 ? 1 : 0;
+    int b = axis == 2 ? 1 : 2;
+    rec.u = (rec.p[a] - box_min[a]) / (box_max[a] - box_min[a]);
+    rec.v = (rec.p[b] - box_min[b]) / (box_max[b] - box_min[b]);
+
+    // the face the ray enters through faces against it, the one it leaves through faces along it
+    vec3 outward_normal(0, 0, 0);
+    outward_normal[axis] = (r.direction()[axis] < 0) == entering ? 1 : -1;
+    rec.set_face_normal(r, outward_normal);
+    rec.mat_ptr = mp.get();
+
+    // exactly on the face, as for the rectangles
+    rec.p[axis] = outward_normal[axis] > 0 ? box_max[axis] : box_min[axis];
+    rec.error = hit_error(max_magnitude(rec.p));
 
-bool box::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
-    return sides.hit(r, t_min, t_max, rec);
+    return true;
 }
 
 #endif // BOX_H
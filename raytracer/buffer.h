@@ -0,0 +1,90 @@
+#ifndef BUFFER_H
+#define BUFFER_H
+
+#include <cstddef>
+#include <memory>
+#include <utility>
+#include <vector>
+
+// an array that either owns its elements (and grows like a vector) or refers to elements stored elsewhere,
+// e.g. in a memory mapped file (see scene_file.h), which it keeps alive through a shared owner
+// either way the elements are read through one pointer, so code that reads a buffer does not care which it is
+// a buffer that refers to elements is read only
+
+template <typename T>
+class buffer {
+    public:
+        buffer() {}
+        buffer(std::vector<T> elements) : owned(std::move(elements)) { sync(); }
+
+        // count elements at first, which stay valid as long as owner is alive
+        static buffer view(const T* first, size_t count, std::shared_ptr<const void> owner) {
+            buffer b;
+            b.storage = std::move(owner);
+            b.first = first;
+            b.count = count;
+            return b;
+        }
+
+        buffer(const buffer& other) : owned(other.owned), storage(other.storage), first(other.first), count(other.count) {
+            sync();
+        }
+        buffer(buffer&& other) noexcept
+            : owned(std::move(other.owned)), storage(std::move(other.storage)), first(other.first), count(other.count) {
+            other.clear();
+        }
+        buffer& operator=(buffer other) {
+            owned.swap(other.owned);
+            storage.swap(other.storage);
+            first = other.first;
+            count = other.count;
+            return *this;
+        }
+
+        size_t size() const { return count; }
+        bool empty() const { return count == 0; }
+        const T* data() const { return first; }
+        const T* begin() const { return first; }
+        const T* end() const { return first + count; }
+
+        const T& operator[](size_t i) const { return first[i]; }
+
+        // changing the elements makes the buffer own them
+        T& operator[](size_t i) { own(); return owned[i]; }
+        void reserve(size_t n) { own(); owned.reserve(n); sync(); }
+        void resize(size_t n) { own(); owned.resize(n); sync(); }
+        void push_back(const T& value) { own(); owned.push_back(value); sync(); }
+        template <typename... Args>
+        void emplace_back(Args&&... args) { own(); owned.emplace_back(std::forward<Args>(args)...); sync(); }
+        void clear() {
+            owned.clear();
+            storage.reset();
+            sync();
+        }
+
+    private:
+        bool is_view() const { return storage != nullptr; }
+
+        void own() {
+            if (is_view()) {
+                owned.assign(first, first + count);
+                storage.reset();
+                sync();
+            }
+        }
+
+        void sync() {
+            if (!is_view()) {
+                first = owned.data();
+                count = owned.size();
+            }
+        }
+
+    private:
+        std::vector<T> owned;
+        std::shared_ptr<const void> storage; // set for buffers that refer to elements stored elsewhere
+        const T* first = nullptr;
+        size_t count = 0;
+};
+
+#endif // BUFFER_H
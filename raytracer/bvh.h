@@ -1,120 +1,1114 @@
-
 #ifndef BVH_H
 #define BVH_H
 
 #include "raytracer.h"
 #include "hittable.h"
 #include "hittable_list.h"
+#include "thread_pool.h"
+#include "bvh_wide.h"
+#include "simd.h"
+#include "buffer.h"
 
 #include <algorithm>
+#include <cstdint>
+#include <vector>
 
 // bounding volume hierarchy
+// the tree is flattened into one array of nodes in depth-first order: the first child of an interior node
+// directly follows it and only the second child needs an explicit offset
+// leaves refer to a range of the primitive array, which is reordered so every leaf's primitives are adjacent
+// the tree is generic over what the primitives are (see bvh_tree): bvh is the tree over hittable objects, a
+// triangle mesh is a tree over its own triangles whose leaves are ranges of its index buffer
+// on CPUs with SIMD the binary tree is collapsed into a 4- or 8-wide tree (see bvh_wide.h) that is traversed
+// instead, the binary traversal remains the scalar fallback
 
-class bvh_node : public hittable {
-    public:
-        bvh_node();
+// 32 bytes, two nodes per cache line
+struct linear_bvh_node {
+    float bounds_min[3];
+    float bounds_max[3];
+    uint32_t offset; // leaf: index of the first primitive, interior: index of the second child
+    uint16_t count;  // number of primitives in a leaf, 0 for interior nodes
+    uint8_t axis;    // axis the interior node was split along
+    uint8_t pad;
+};
 
-        bvh_node(const hittable_list& list, double time0, double time1)
-            : bvh_node(list.objects, 0, list.objects.size(), time0, time1)
-        {}
+// what the builder needs to know about a primitive, computed once up front
+struct bvh_primitive_info {
+    aabb bounds;
+    point3 centroid;
+    size_t index; // position in the source object list
+};
 
-        // the children of a bvh_node are to generic hittables (not necessarily bvh_nodes)
-        bvh_node(
-            const std::vector<shared_ptr<hittable>>& src_objects,
-            size_t start, size_t end, double time0, double time1
-        );
+// working state of one BVH build
+// every subtree over n primitives owns the 2n-1 node slots that follow its root in scratch, so subtrees can
+// be built concurrently without agreeing on node indices; the gaps left by multi-primitive leaves are
+// squeezed out when the tree is flattened into depth-first order afterwards
+struct bvh_build_state {
+    std::vector<bvh_primitive_info> info;
+    std::vector<linear_bvh_node> scratch;
+    thread_pool* pool;
+};
 
-        virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+// a bvh_tree is built over Primitives, which holds the primitives and provides
+//     size_t size() const
+//     aabb bounds(size_t i, double time0, double time1) const
+//     void reorder(const std::vector<bvh_primitive_info>& order, thread_pool* pool)
+//         moves primitive order[i].index to position i
+//     bool hit(uint32_t first, uint32_t count, const ray& r, real t_min, real& t_max, hit_record& rec) const
+//         the closest hit on the primitives of a leaf, shortening t_max when there is one
+//     int hit_packet(uint32_t first, uint32_t count, const ray_packet& packet, int mask, real t_min,
+//                    real* t_max, hit_record* recs) const
+//     void collect_lights(std::vector<const hittable*>& lights) const
+template <typename Primitives>
+class bvh_tree : public hittable {
+    public:
+        virtual bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const override;
+        virtual int hit_packet(
+            const ray_packet& packet, int mask, real t_min, real* t_max, hit_record* recs
+        ) const override;
 
         virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
+        virtual void collect_lights(std::vector<const hittable*>& lights) const override {
+            primitives.collect_lights(lights);
+        }
+
+        // builds the wide trees of every traversal path, not only the one this CPU takes (e.g. before the tree
+        // is saved to a scene file that may be read on another CPU)
+        void collapse_all();
+
+        // after the primitives moved (e.g. instances were given new transforms): recomputes the boxes of the
+        // nodes bottom up over the same tree, which is far cheaper than a new build but makes a worse tree the
+        // further the primitives move from where they were built
+        void refit(double time0, double time1, thread_pool* pool = nullptr);
+        // refits, then builds the tree anew if the refitted tree's sah_cost is more than rebuild_ratio times
+        // that of the last build; returns whether it rebuilt
+        bool update(double time0, double time1, thread_pool* pool = nullptr, double rebuild_ratio = 1.3);
+
+        // the expected cost of tracing a ray through the tree under the surface area heuristic, in units of
+        // one primitive test
+        double sah_cost() const;
+
+    protected:
+        // builds the tree over primitives, reordering them so every leaf's primitives are adjacent
+        // pass a thread pool to build large trees in parallel, the tree is the same without one
+        void build_tree(double time0, double time1, thread_pool* pool);
+        // only the binary tree, without the wide tree of the traversal path
+        void build_binary_tree(double time0, double time1, thread_pool* pool);
+        // the rest of build_tree after build_binary_tree: the wide tree of the traversal path
+        void collapse_tree();
+        // takes a tree that was built before over primitives already in its order (e.g. read from a file)
+        void use_tree(buffer<linear_bvh_node> binary, buffer<wide_bvh_node<4>> wide4, buffer<wide_bvh_node<8>> wide8);
+
+        // the traversals read their nodes through node_at(index), see stored_nodes
+        template <typename Nodes>
+        bool hit_binary(const Nodes& node_at, const ray& r, real t_min, real t_max, hit_record& rec) const;
+        template <int N, typename Kernel, typename Nodes>
+        bool hit_wide(const Nodes& node_at, const ray& r, real t_min, real t_max, hit_record& rec) const;
+
+    private:
+        void build(bvh_build_state& state, size_t start, size_t end, int depth, uint32_t index) const;
+        uint32_t flatten(const std::vector<linear_bvh_node>& scratch, uint32_t index);
+
+        template <int N>
+        uint32_t collapse(buffer<wide_bvh_node<N>>& wide, uint32_t index) const;
+
+        bool hit_sse(const ray& r, real t_min, real t_max, hit_record& rec) const;
+        bool hit_avx2(const ray& r, real t_min, real t_max, hit_record& rec) const;
+
+        template <typename Kernel>
+        int hit_packet_binary(const ray_packet& packet, int mask, real t_min, real* t_max,
+                              hit_record* recs) const;
+        int hit_packet_avx2(const ray_packet& packet, int mask, real t_min, real* t_max,
+                            hit_record* recs) const;
 
     public:
-        shared_ptr<hittable> left;
-        shared_ptr<hittable> right;
+        Primitives primitives;
+        buffer<linear_bvh_node> nodes;
+        aabb box;
+        double build_cost = 0; // sah_cost of the tree as built
+
+        // traversal path picked when the tree was built, with the wide tree it needs
+        simd_isa isa = simd_isa::scalar;
+        buffer<wide_bvh_node<4>> nodes4;
+        buffer<wide_bvh_node<8>> nodes8;
+};
+
+// the nodes of a tree as they are stored; a tree whose boxes move (see motion_bvh.h) hands the traversal its
+// nodes interpolated to the ray's time instead
+template <typename Node>
+struct stored_nodes {
+    const Node& operator()(uint32_t index) const { return nodes[index]; }
+
+    const buffer<Node>& nodes;
+};
+
+// the primitives of a bvh over hittable objects
+struct object_primitives {
+    size_t size() const { return objects.size(); }
+
+    aabb bounds(size_t i, double time0, double time1) const {
         aabb box;
+        if (!objects[i]->bounding_box(time0, time1, box))
+            std::cerr << "No bounding box in bvh constructor.\n";
+        return box;
+    }
+
+    void reorder(const std::vector<bvh_primitive_info>& order, thread_pool* pool);
+
+    bool hit(uint32_t first, uint32_t count, const ray& r, real t_min, real& t_max, hit_record& rec) const {
+        bool hit_anything = false;
+        for (uint32_t i = first; i < first + count; ++i) {
+            if (objects[i]->hit(r, t_min, t_max, rec)) {
+                hit_anything = true;
+                t_max = rec.t;
+            }
+        }
+        return hit_anything;
+    }
+
+    int hit_packet(uint32_t first, uint32_t count, const ray_packet& packet, int mask, real t_min,
+                   real* t_max, hit_record* recs) const {
+        // every object shortens the t_max of the rays it hits, so later objects only report closer hits
+        int hits = 0;
+        for (uint32_t i = first; i < first + count; ++i)
+            hits |= objects[i]->hit_packet(packet, mask, t_min, t_max, recs);
+        return hits;
+    }
+
+    void collect_lights(std::vector<const hittable*>& lights) const {
+        for (const auto& object : objects)
+            object->collect_lights(lights);
+    }
+
+    std::vector<shared_ptr<hittable>> objects;
+};
+
+// gathers the plain spheres among objects, which are in the order of the tree nodes built over them, into
+// sphere_batch_trees (see sphere_batch.h): every largest subtree that holds only spheres, at least
+// sphere_batch_min_spheres of them, becomes one batch, so a batch only covers spheres that lie together
+// returns whether any were gathered
+bool batch_spheres(std::vector<shared_ptr<hittable>>& objects, const buffer<linear_bvh_node>& nodes, thread_pool* pool);
+
+class bvh : public bvh_tree<object_primitives> {
+    public:
+        bvh() {}
+
+        // pass a thread pool to build large trees in parallel, the tree is the same without one
+        bvh(const hittable_list& list, double time0, double time1, thread_pool* pool = nullptr)
+            : bvh(list.objects, time0, time1, pool)
+        {}
+
+        // the spheres among the objects end up in leaves of sphere batches, bvhs of their own under this one:
+        // the tree is built over the objects, the clusters of spheres in it are batched, and the tree is built
+        // again over what is left
+        bvh(const std::vector<shared_ptr<hittable>>& src_objects, double time0, double time1,
+            thread_pool* pool = nullptr) {
+            primitives.objects = src_objects;
+            build_binary_tree(time0, time1, pool);
+            if (batch_spheres(primitives.objects, nodes, pool)) {
+                nodes = buffer<linear_bvh_node>();
+                build_binary_tree(time0, time1, pool);
+            }
+            collapse_tree();
+        }
+
+        // a tree over one object (a bvh over nothing but spheres is one batch) hands rays straight to it
+        virtual bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const override {
+            if (primitives.objects.size() == 1)
+                return primitives.objects[0]->hit(r, t_min, t_max, rec);
+            return bvh_tree::hit(r, t_min, t_max, rec);
+        }
+
+        virtual int hit_packet(
+            const ray_packet& packet, int mask, real t_min, real* t_max, hit_record* recs
+        ) const override {
+            if (primitives.objects.size() == 1)
+                return primitives.objects[0]->hit_packet(packet, mask, t_min, t_max, recs);
+            return bvh_tree::hit_packet(packet, mask, t_min, t_max, recs);
+        }
+};
+
+// node bounds are stored in single precision, rounded outwards so the float box always contains the
+// double precision one
+inline float round_down(double x) {
+    auto f = static_cast<float>(x);
+    return f > x ? std::nextafter(f, -std::numeric_limits<float>::infinity()) : f;
+}
+
+inline float round_up(double x) {
+    auto f = static_cast<float>(x);
+    return f < x ? std::nextafter(f, std::numeric_limits<float>::infinity()) : f;
+}
+
+// splitting BVH volumes with the surface area heuristic (SAH):
+// the chance that a ray passing through a node also passes through a child is proportional to the
+// child's surface area, so the expected cost of a split is
+//     traversal + (area_left * count_left + area_right * count_right) / area_node
+// 1. sort the primitive centroids into equal width bins along each axis
+// 2. evaluate the cost of splitting between every pair of neighbouring bins
+// 3. split at the cheapest plane, or make a leaf if testing every primitive is cheaper
+
+const int bvh_bin_count = 16;
+const size_t bvh_max_leaf_size = 4;
+const double bvh_traversal_cost = 1.0;
+// the traversal stacks hold one entry per level of the tree, so no node may lie deeper than this
+const int bvh_max_depth = 64;
+// a tree over any range that fits the 32-bit offsets of the nodes fits by median splits alone
+static_assert(bvh_max_depth > 32, "the traversal stacks must hold a tree over 2^32 primitives");
+
+// the levels of median splits that take span primitives down to single ones
+inline int bvh_median_levels(size_t span) {
+    int levels = 0;
+    for (size_t n = 1; n < span; n *= 2)
+        levels++;
+    return levels;
+}
+
+// how many primitives a leaf may hold and what testing them costs, in units of one primitive test
+// by default one each; primitives that are tested several at a time (see sphere_batch.h) specialise this
+template <typename Primitives>
+struct bvh_leaf {
+    static const size_t max_size = bvh_max_leaf_size;
+    static double cost(size_t count) { return static_cast<double>(count); }
+};
+
+// parallel construction:
+// ranges longer than one chunk are binned and partitioned chunk by chunk on the pool, and subtrees above the
+// task threshold are built as separate tasks; both thresholds are fixed primitive counts and the chunk
+// results are merged in order, so the tree never depends on the number of threads
+const size_t bvh_parallel_chunk = 16384;
+const size_t bvh_parallel_task_threshold = 4096;
+
+inline aabb empty_box() {
+    return aabb(point3(infinity, infinity, infinity), point3(-infinity, -infinity, -infinity));
+}
+
+// grow a box in place to enclose another box or a point
+inline void grow(aabb& box, const point3& min, const point3& max) {
+    for (int a = 0; a < 3; a++) {
+        box.minimum.e[a] = min.e[a] < box.minimum.e[a] ? min.e[a] : box.minimum.e[a];
+        box.maximum.e[a] = max.e[a] > box.maximum.e[a] ? max.e[a] : box.maximum.e[a];
+    }
+}
+
+inline void grow(aabb& box, const aabb& other) {
+    grow(box, other.minimum, other.maximum);
+}
+
+struct bvh_bin {
+    size_t count = 0;
+    aabb bounds = empty_box();
 };
 
-inline bool box_compare(const shared_ptr<hittable> a, const shared_ptr<hittable> b, int axis) {
-    aabb box_a;
-    aabb box_b;
+// scale is bvh_bin_count / extent of the centroid bounds, or 0 for a flat axis
+inline int bvh_bin_index(double centroid, double min, double scale) {
+    auto b = static_cast<int>((centroid - min) * scale);
+    return b < 0 ? 0 : (b >= bvh_bin_count ? bvh_bin_count - 1 : b);
+}
 
-    if (!a->bounding_box(0, 0, box_a) || !b->bounding_box(0, 0, box_b))
-        std::cerr << "No bounding box in bvh_node constructor.\n";
+// call f(chunk, begin, end) for every chunk of [start,end), on the pool when there is more than one
+template <typename F>
+void bvh_for_chunks(thread_pool* pool, size_t start, size_t end, F f) {
+    auto chunks = (end - start + bvh_parallel_chunk - 1) / bvh_parallel_chunk;
+    auto run = [&](size_t c) {
+        auto begin = start + c * bvh_parallel_chunk;
+        f(c, begin, std::min(begin + bvh_parallel_chunk, end));
+    };
 
-    return box_a.min().e[axis] < box_b.min().e[axis];
+    if (pool && chunks > 1)
+        pool->parallel_for(chunks, run);
+    else
+        for (size_t c = 0; c < chunks; ++c)
+            run(c);
 }
 
-bool box_x_compare(const shared_ptr<hittable> a, const shared_ptr<hittable> b) {
-    return box_compare(a, b, 0);
+// stable partition of a long range, classifying and scattering the chunks in parallel
+template <typename Predicate>
+size_t bvh_parallel_partition(thread_pool* pool, std::vector<bvh_primitive_info>& info,
+                              size_t start, size_t end, Predicate pred) {
+    auto chunks = (end - start + bvh_parallel_chunk - 1) / bvh_parallel_chunk;
+    std::vector<size_t> below(chunks, 0);
+
+    bvh_for_chunks(pool, start, end, [&](size_t c, size_t begin, size_t finish) {
+        for (size_t i = begin; i < finish; ++i)
+            below[c] += pred(info[i]) ? 1 : 0;
+    });
+
+    // each chunk writes its primitives below the split after those of the earlier chunks, and its
+    // primitives above the split after all primitives below it
+    std::vector<size_t> below_offset(chunks), above_offset(chunks);
+    size_t total_below = 0;
+    for (size_t c = 0; c < chunks; ++c) {
+        below_offset[c] = total_below;
+        total_below += below[c];
+    }
+    size_t total_above = 0;
+    for (size_t c = 0; c < chunks; ++c) {
+        above_offset[c] = total_below + total_above;
+        auto size = std::min(bvh_parallel_chunk, end - start - c * bvh_parallel_chunk);
+        total_above += size - below[c];
+    }
+
+    std::vector<bvh_primitive_info> sorted(end - start);
+    bvh_for_chunks(pool, start, end, [&](size_t c, size_t begin, size_t finish) {
+        auto lo = below_offset[c];
+        auto hi = above_offset[c];
+        for (size_t i = begin; i < finish; ++i)
+            sorted[pred(info[i]) ? lo++ : hi++] = info[i];
+    });
+    bvh_for_chunks(pool, start, end, [&](size_t, size_t begin, size_t finish) {
+        std::copy(sorted.begin() + (begin - start), sorted.begin() + (finish - start), info.begin() + begin);
+    });
+
+    return start + total_below;
 }
 
-bool box_y_compare(const shared_ptr<hittable> a, const shared_ptr<hittable> b) {
-    return box_compare(a, b, 1);
+template <typename Primitives>
+void bvh_tree<Primitives>::build_tree(double time0, double time1, thread_pool* pool) {
+    build_binary_tree(time0, time1, pool);
+    collapse_tree();
 }
 
-bool box_z_compare(const shared_ptr<hittable> a, const shared_ptr<hittable> b) {
-    return box_compare(a, b, 2);
+template <typename Primitives>
+void bvh_tree<Primitives>::collapse_tree() {
+    build_cost = sah_cost();
+
+    // the scalar path until a wide tree is built, a rebuilt tree may have lost the one it had
+    isa = simd_isa::scalar;
+
+    // a root leaf has nothing to collapse
+    if (!nodes.empty() && nodes[0].count == 0) {
+        isa = active_simd_isa();
+        if (isa == simd_isa::avx2)
+            collapse(nodes8, 0);
+        else if (isa == simd_isa::sse)
+            collapse(nodes4, 0);
+    }
 }
 
-// splitting BVH volumes:
-// 1. randomly choose an axis
-// 2. sort the primitives
-// 3. put half in each subtree
+template <typename Primitives>
+void bvh_tree<Primitives>::build_binary_tree(double time0, double time1, thread_pool* pool) {
+    auto count = primitives.size();
+    if (count == 0)
+        return;
+
+    bvh_build_state state;
+    state.pool = pool;
+    state.info.resize(count);
+    state.scratch.resize(2 * count - 1);
+
+    bvh_for_chunks(pool, 0, count, [&](size_t, size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            auto& info = state.info[i];
+            info.bounds = primitives.bounds(i, time0, time1);
+            info.centroid = 0.5 * (info.bounds.min() + info.bounds.max());
+            info.index = i;
+        }
+    });
+
+    build(state, 0, count, 0, 0);
+
+    nodes.reserve(state.scratch.size());
+    flatten(state.scratch, 0);
+
+    // the builder partitions the primitive info in place, leaving every leaf's primitives adjacent
+    primitives.reorder(state.info, pool);
 
-bvh_node::bvh_node(
-    const std::vector<shared_ptr<hittable>>& src_objects,
-    size_t start, size_t end, double time0, double time1
+    box = aabb(
+        point3(nodes[0].bounds_min[0], nodes[0].bounds_min[1], nodes[0].bounds_min[2]),
+        point3(nodes[0].bounds_max[0], nodes[0].bounds_max[1], nodes[0].bounds_max[2]));
+}
+
+void object_primitives::reorder(const std::vector<bvh_primitive_info>& order, thread_pool* pool) {
+    std::vector<shared_ptr<hittable>> sorted(objects.size());
+    bvh_for_chunks(pool, 0, objects.size(), [&](size_t, size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i)
+            sorted[i] = objects[order[i].index];
+    });
+    objects.swap(sorted);
+}
+
+template <typename Primitives>
+void bvh_tree<Primitives>::collapse_all() {
+    if (nodes.empty() || nodes[0].count > 0)
+        return;
+    if (nodes4.empty())
+        collapse(nodes4, 0);
+    if (nodes8.empty())
+        collapse(nodes8, 0);
+}
+
+template <typename Primitives>
+void bvh_tree<Primitives>::use_tree(
+    buffer<linear_bvh_node> binary, buffer<wide_bvh_node<4>> wide4, buffer<wide_bvh_node<8>> wide8
 ) {
-    auto objects = src_objects; // Create a modifiable array of the source scene objects
+    nodes = std::move(binary);
+    nodes4 = std::move(wide4);
+    nodes8 = std::move(wide8);
+    if (nodes.empty())
+        return;
+
+    box = aabb(
+        point3(nodes[0].bounds_min[0], nodes[0].bounds_min[1], nodes[0].bounds_min[2]),
+        point3(nodes[0].bounds_max[0], nodes[0].bounds_max[1], nodes[0].bounds_max[2]));
+    build_cost = sah_cost();
+
+    // the widest traversal this CPU supports that the tree has
+    auto active = active_simd_isa();
+    if (active == simd_isa::avx2 && !nodes8.empty())
+        isa = simd_isa::avx2;
+    else if (active != simd_isa::scalar && !nodes4.empty())
+        isa = simd_isa::sse;
+    else
+        isa = simd_isa::scalar;
+}
+
+// node surface area from its float bounds
+inline double node_area(const linear_bvh_node& node) {
+    double dx = node.bounds_max[0] - node.bounds_min[0];
+    double dy = node.bounds_max[1] - node.bounds_min[1];
+    double dz = node.bounds_max[2] - node.bounds_min[2];
+    return 2 * (dx*dy + dy*dz + dz*dx);
+}
+
+template <typename Primitives>
+double bvh_tree<Primitives>::sah_cost() const {
+    if (nodes.empty())
+        return 0;
+
+    // every node is entered with probability area / root area, and costs a traversal step or its primitives
+    double cost = 0;
+    for (const auto& node : nodes)
+        cost += node_area(node) * (node.count > 0 ? bvh_leaf<Primitives>::cost(node.count) : bvh_traversal_cost);
+    auto root_area = node_area(nodes[0]);
+    return root_area > 0 ? cost / root_area : cost;
+}
+
+template <typename Primitives>
+void bvh_tree<Primitives>::refit(double time0, double time1, thread_pool* pool) {
+    if (nodes.empty())
+        return;
+
+    auto set_bounds = [this](uint32_t i, const aabb& bounds) {
+        auto& node = nodes[i];
+        for (int a = 0; a < 3; a++) {
+            node.bounds_min[a] = round_down(bounds.min()[a]);
+            node.bounds_max[a] = round_up(bounds.max()[a]);
+        }
+    };
+
+    // the leaves from their primitives, in parallel; then the interior nodes from their children, walking the
+    // array backwards so children (which follow their parents) come first
+    // a tree that refers to nodes stored elsewhere (read from a scene file) copies them once, before the threads
+    // write to them
+    nodes.resize(nodes.size());
+    bvh_for_chunks(pool, 0, nodes.size(), [&](size_t, size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            const auto& node = nodes[i];
+            if (node.count == 0)
+                continue;
+            aabb bounds = empty_box();
+            for (uint32_t p = node.offset; p < node.offset + node.count; ++p)
+                grow(bounds, primitives.bounds(p, time0, time1));
+            set_bounds(static_cast<uint32_t>(i), bounds);
+        }
+    });
+    for (auto i = nodes.size(); i-- > 0;) {
+        const auto& node = nodes[i];
+        if (node.count > 0)
+            continue;
+        const auto& left = nodes[i + 1];
+        const auto& right = nodes[node.offset];
+        auto& parent = nodes[i];
+        for (int a = 0; a < 3; a++) {
+            parent.bounds_min[a] = std::min(left.bounds_min[a], right.bounds_min[a]);
+            parent.bounds_max[a] = std::max(left.bounds_max[a], right.bounds_max[a]);
+        }
+    }
+
+    box = aabb(
+        point3(nodes[0].bounds_min[0], nodes[0].bounds_min[1], nodes[0].bounds_min[2]),
+        point3(nodes[0].bounds_max[0], nodes[0].bounds_max[1], nodes[0].bounds_max[2]));
+
+    // the wide trees take their boxes from the binary one, collapsing it again is a single pass
+    if (!nodes4.empty()) {
+        nodes4 = buffer<wide_bvh_node<4>>();
+        collapse(nodes4, 0);
+    }
+    if (!nodes8.empty()) {
+        nodes8 = buffer<wide_bvh_node<8>>();
+        collapse(nodes8, 0);
+    }
+}
+
+template <typename Primitives>
+bool bvh_tree<Primitives>::update(double time0, double time1, thread_pool* pool, double rebuild_ratio) {
+    refit(time0, time1, pool);
+    if (sah_cost() <= rebuild_ratio * build_cost)
+        return false;
 
-    int axis = random_int(0, 2);
-    auto comparator = (axis == 0) ? box_x_compare
-        : (axis == 1) ? box_y_compare
-        : box_z_compare;
+    nodes = buffer<linear_bvh_node>();
+    nodes4 = buffer<wide_bvh_node<4>>();
+    nodes8 = buffer<wide_bvh_node<8>>();
+    build_tree(time0, time1, pool);
+    return true;
+}
 
+template <typename Primitives>
+void bvh_tree<Primitives>::build(bvh_build_state& state, size_t start, size_t end, int depth, uint32_t index) const {
+    auto& info = state.info;
     size_t object_span = end - start;
+    // only long ranges are worth splitting into chunks
+    auto pool = object_span > bvh_parallel_chunk ? state.pool : nullptr;
 
-    if (object_span == 1) {
-        left = right = objects[start];
-    } else if (object_span == 2) {
-        if (comparator(objects[start], objects[start + 1])) {
-            left = objects[start];
-            right = objects[start + 1];
-        } else {
-            left = objects[start + 1];
-            right = objects[start];
+    // per-chunk results live in vectors only when there is more than one chunk, small nodes never allocate
+    auto chunks = (object_span + bvh_parallel_chunk - 1) / bvh_parallel_chunk;
+
+    aabb bounds = empty_box();
+    aabb centroid_bounds = empty_box();
+    {
+        std::vector<aabb> extra_bounds(chunks - 1, empty_box()), extra_centroids(chunks - 1, empty_box());
+        bvh_for_chunks(pool, start, end, [&](size_t c, size_t begin, size_t finish) {
+            auto& chunk_bounds = c == 0 ? bounds : extra_bounds[c - 1];
+            auto& chunk_centroids = c == 0 ? centroid_bounds : extra_centroids[c - 1];
+            for (size_t i = begin; i < finish; ++i) {
+                grow(chunk_bounds, info[i].bounds);
+                grow(chunk_centroids, info[i].centroid, info[i].centroid);
+            }
+        });
+        for (size_t c = 1; c < chunks; ++c) {
+            grow(bounds, extra_bounds[c - 1]);
+            grow(centroid_bounds, extra_centroids[c - 1]);
+        }
+    }
+
+    linear_bvh_node node;
+    for (int a = 0; a < 3; a++) {
+        node.bounds_min[a] = round_down(bounds.min()[a]);
+        node.bounds_max[a] = round_up(bounds.max()[a]);
+    }
+    node.axis = 0;
+    node.pad = 0;
+
+    auto extent = centroid_bounds.max() - centroid_bounds.min();
+    double bin_scale[3];
+    for (int a = 0; a < 3; a++)
+        bin_scale[a] = extent[a] > 0 ? bvh_bin_count / extent[a] : 0;
+
+    // find the cheapest split over all three axes
+    int best_axis = -1;
+    int best_bin = 0;
+    double best_cost = infinity;
+
+    // a SAH split may leave a child with all but one primitive, so it is only made while median splits below
+    // it would still fit in bvh_max_depth; past that the range is split at the median, which halves it
+    bool sah_fits = depth + 1 + bvh_median_levels(object_span) <= bvh_max_depth;
+
+    if (object_span > 1 && sah_fits) {
+        // bin along all three axes in a single pass over the primitives
+        struct bin_set {
+            bvh_bin bins[3][bvh_bin_count];
+        };
+        bin_set first;
+        std::vector<bin_set> extra(chunks - 1);
+        bvh_for_chunks(pool, start, end, [&](size_t c, size_t begin, size_t finish) {
+            auto& bins = c == 0 ? first.bins : extra[c - 1].bins;
+            for (size_t i = begin; i < finish; ++i) {
+                for (int axis = 0; axis < 3; axis++) {
+                    auto b = bvh_bin_index(info[i].centroid[axis], centroid_bounds.min()[axis], bin_scale[axis]);
+                    bins[axis][b].count++;
+                    grow(bins[axis][b].bounds, info[i].bounds);
+                }
+            }
+        });
+
+        auto& bins = first.bins;
+        for (size_t c = 1; c < chunks; ++c) {
+            for (int axis = 0; axis < 3; axis++) {
+                for (int b = 0; b < bvh_bin_count; ++b) {
+                    bins[axis][b].count += extra[c - 1].bins[axis][b].count;
+                    grow(bins[axis][b].bounds, extra[c - 1].bins[axis][b].bounds);
+                }
+            }
+        }
+
+        for (int axis = 0; axis < 3; axis++) {
+            if (extent[axis] <= 0)
+                continue;
+
+            // sweep from the right to get the area and count above every split plane
+            double area_above[bvh_bin_count];
+            size_t count_above[bvh_bin_count];
+            aabb above = empty_box();
+            size_t count = 0;
+            for (int b = bvh_bin_count - 1; b > 0; --b) {
+                grow(above, bins[axis][b].bounds);
+                count += bins[axis][b].count;
+                area_above[b] = count > 0 ? above.surface_area() : 0;
+                count_above[b] = count;
+            }
+
+            // then from the left, evaluating the split after bin b
+            aabb below = empty_box();
+            count = 0;
+            for (int b = 0; b < bvh_bin_count - 1; ++b) {
+                grow(below, bins[axis][b].bounds);
+                count += bins[axis][b].count;
+                if (count == 0 || count_above[b + 1] == 0)
+                    continue;
+
+                auto cost = bvh_leaf<Primitives>::cost(count) * below.surface_area() +
+                            bvh_leaf<Primitives>::cost(count_above[b + 1]) * area_above[b + 1];
+                if (cost < best_cost) {
+                    best_cost = cost;
+                    best_axis = axis;
+                    best_bin = b;
+                }
+            }
         }
+        best_cost = bvh_traversal_cost + best_cost / bounds.surface_area();
+    }
+
+    size_t mid = start;
+    if (best_axis >= 0 && (object_span > bvh_leaf<Primitives>::max_size ||
+                           best_cost < bvh_leaf<Primitives>::cost(object_span))) {
+        auto axis = best_axis;
+        auto split = best_bin;
+        auto min = centroid_bounds.min()[axis];
+        auto scale = bin_scale[axis];
+        auto below_split = [=](const bvh_primitive_info& p) {
+            return bvh_bin_index(p.centroid[axis], min, scale) <= split;
+        };
+        if (object_span > bvh_parallel_chunk)
+            mid = bvh_parallel_partition(state.pool, info, start, end, below_split);
+        else
+            mid = std::partition(info.begin() + start, info.begin() + end, below_split) - info.begin();
+        node.axis = static_cast<uint8_t>(axis);
+    } else if (object_span > bvh_leaf<Primitives>::max_size &&
+               (!sah_fits || object_span > std::numeric_limits<uint16_t>::max())) {
+        // too deep, or too many coincident centroids for one leaf: split at the median
+        auto axis = extent.x() > extent.y() ? (extent.x() > extent.z() ? 0 : 2) : (extent.y() > extent.z() ? 1 : 2);
+        mid = start + object_span / 2;
+        std::nth_element(info.begin() + start, info.begin() + mid, info.begin() + end,
+            [=](const bvh_primitive_info& a, const bvh_primitive_info& b) {
+                return a.centroid[axis] < b.centroid[axis];
+            });
+        node.axis = static_cast<uint8_t>(axis);
+    }
+
+    if (mid == start) {
+        node.offset = static_cast<uint32_t>(start);
+        node.count = static_cast<uint16_t>(object_span);
     } else {
-        std::sort(objects.begin() + start, objects.begin() + end, comparator);
+        // the left subtree takes the 2*(mid-start)-1 slots after this node, the right subtree follows
+        auto left = index + 1;
+        auto right = static_cast<uint32_t>(index + 2 * (mid - start));
+
+        if (state.pool && object_span > bvh_parallel_task_threshold) {
+            thread_pool::task_group group;
+            state.pool->submit(group, [&, start, mid, depth, left] {
+                build(state, start, mid, depth + 1, left);
+            });
+            build(state, mid, end, depth + 1, right);
+            state.pool->wait(group);
+        } else {
+            build(state, start, mid, depth + 1, left);
+            build(state, mid, end, depth + 1, right);
+        }
 
-        auto mid = start + object_span / 2;
-        left = make_shared<bvh_node>(objects, start, mid, time0, time1);
-        right = make_shared<bvh_node>(objects, mid, end, time0, time1);
+        node.offset = right;
+        node.count = 0;
     }
 
-    aabb box_left, box_right;
+    state.scratch[index] = node;
+}
+
+// copy the subtree at scratch[index] into the node array in depth-first order, returning its new index
+template <typename Primitives>
+uint32_t bvh_tree<Primitives>::flatten(const std::vector<linear_bvh_node>& scratch, uint32_t index) {
+    auto flat = static_cast<uint32_t>(nodes.size());
+    nodes.push_back(scratch[index]);
 
-    if (!left->bounding_box(time0, time1, box_left)
-        || !right->bounding_box(time0, time1, box_right)
-    ) {
-        std::cerr << "No bounding box in bvh_node constructor.\n";
+    if (scratch[index].count == 0) {
+        flatten(scratch, index + 1);
+        nodes[flat].offset = flatten(scratch, scratch[index].offset);
     }
 
-    box = surrounding_box(box_left, box_right);
+    return flat;
 }
 
-bool bvh_node::bounding_box(double time0, double time1, aabb& output_box) const {
+template <typename Primitives>
+bool bvh_tree<Primitives>::bounding_box(double time0, double time1, aabb& output_box) const {
     output_box = box;
-    return true;
+    return !nodes.empty();
+}
+
+// the up to N nodes of the binary subtree at nodes[index] that become the children of its wide node, found by
+// opening the interior child with the largest surface area until there are N of them
+template <int N>
+int wide_node_children(const buffer<linear_bvh_node>& nodes, uint32_t index, uint32_t* children) {
+    int child_count = 0;
+    children[child_count++] = index + 1;
+    children[child_count++] = nodes[index].offset;
+
+    while (child_count < N) {
+        int best = -1;
+        double best_area = -1;
+        for (int i = 0; i < child_count; i++) {
+            const auto& child = nodes[children[i]];
+            if (child.count > 0)
+                continue;
+
+            double area = 0;
+            for (int a = 0; a < 3; a++) {
+                double d0 = child.bounds_max[a] - child.bounds_min[a];
+                double d1 = child.bounds_max[(a + 1) % 3] - child.bounds_min[(a + 1) % 3];
+                area += d0 * d1;
+            }
+            if (area > best_area) {
+                best_area = area;
+                best = i;
+            }
+        }
+        if (best < 0)
+            break;
+
+        auto opened = children[best];
+        children[best] = opened + 1;
+        children[child_count++] = nodes[opened].offset;
+    }
+
+    return child_count;
+}
+
+// collapse the binary subtree at nodes[index] into a wide node, returning the wide node's index
+template <typename Primitives>
+template <int N>
+uint32_t bvh_tree<Primitives>::collapse(buffer<wide_bvh_node<N>>& wide, uint32_t index) const {
+    auto wide_index = static_cast<uint32_t>(wide.size());
+    wide.emplace_back();
+
+    uint32_t children[N];
+    int child_count = wide_node_children<N>(nodes, index, children);
+
+    wide_bvh_node<N> node;
+    clear_wide_node(node);
+    for (int i = 0; i < child_count; i++) {
+        const auto& child = nodes[children[i]];
+        for (int a = 0; a < 3; a++) {
+            node.bounds[a][i] = child.bounds_min[a];
+            node.bounds[a + 3][i] = child.bounds_max[a];
+        }
+        if (child.count > 0) {
+            node.child[i] = child.offset;
+            node.count[i] = child.count;
+        } else {
+            node.child[i] = collapse(wide, children[i]);
+        }
+    }
+
+    // collapsing the children may have reallocated the array
+    wide[wide_index] = node;
+    return wide_index;
+}
+
+template <typename Primitives>
+bool bvh_tree<Primitives>::hit(const ray& r, real t_min, real t_max, hit_record& rec) const {
+    if (nodes.empty())
+        return false;
+
+    switch (isa) {
+#ifdef RAYTRACER_X86_SIMD
+        case simd_isa::avx2:
+            return hit_avx2(r, t_min, t_max, rec);
+        case simd_isa::sse:
+            return hit_sse(r, t_min, t_max, rec);
+#endif
+        default:
+            return hit_binary(stored_nodes<linear_bvh_node>{nodes}, r, t_min, t_max, rec);
+    }
+}
+
+template <typename Primitives>
+template <typename Nodes>
+bool bvh_tree<Primitives>::hit_binary(
+    const Nodes& node_at, const ray& r, real t_min, real t_max, hit_record& rec
+) const {
+    // per-ray constants of the slab test, computed once instead of once per node
+    slab_ray sr(r);
+
+    bool hit_anything = false;
+    uint32_t stack[bvh_max_depth];
+    int stack_size = 0;
+    uint32_t current = 0;
+
+    while (true) {
+        const auto& node = node_at(current);
+
+        auto tmin = static_cast<float>(t_min);
+        auto tmax = static_cast<float>(t_max);
+        bool overlaps = true;
+        for (int a = 0; a < 3; a++) {
+            auto t0 = ((sr.dir_is_neg[a] ? node.bounds_max : node.bounds_min)[a] - sr.origin[a]) * sr.inv_dir[a];
+            auto t1 = ((sr.dir_is_neg[a] ? node.bounds_min : node.bounds_max)[a] - sr.origin[a]) * sr.inv_dir[a];
+            t1 *= slab_far_scale;
+            // a NaN (ray parallel to and on the slab) fails both comparisons and leaves the range unchanged
+            tmin = t0 > tmin ? t0 : tmin;
+            tmax = t1 < tmax ? t1 : tmax;
+            if (tmax < tmin) {
+                overlaps = false;
+                break;
+            }
+        }
+
+        if (overlaps && node.count > 0) {
+            hit_anything |= primitives.hit(node.offset, node.count, r, t_min, t_max, rec);
+        } else if (overlaps) {
+            // visit the child on the near side of the split first, its hits shorten the far child's range
+            if (sr.dir_is_neg[node.axis]) {
+                stack[stack_size++] = current + 1;
+                current = node.offset;
+            } else {
+                stack[stack_size++] = node.offset;
+                current = current + 1;
+            }
+            continue;
+        }
+
+        if (stack_size == 0)
+            break;
+        current = stack[--stack_size];
+    }
+
+    return hit_anything;
 }
 
-bool bvh_node::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
-    if (!box.hit(r, t_min, t_max)) return false;
+// packet traversal:
+// the whole packet walks the binary tree together, testing every node against all of its rays at once and
+// carrying the mask of rays still inside down to the children; a ray drops out of a subtree as soon as it
+// misses the subtree's box, and the packet stops as soon as no ray is left
+// the near child is chosen from the direction signs the rays share, so packets whose rays point into
+// different octants (e.g. after diffuse bounces) are traced ray by ray through hit() instead
+
+// per-ray constants of the slab test for a whole packet, in structure-of-arrays layout
+struct slab_packet {
+    explicit slab_packet(const ray_packet& packet) {
+        for (int a = 0; a < 3; a++) {
+            for (int i = 0; i < packet_size; i++) {
+                origin[a][i] = static_cast<float>(packet.origin[a][i]);
+                inv_dir[a][i] = static_cast<float>(1.0 / packet.direction[a][i]);
+            }
+        }
+    }
+
+    float origin[3][packet_size];
+    float inv_dir[3][packet_size];
+};
+
+// slab tests of every ray of a packet against one node, the same test as hit_binary
+// each kernel returns the mask of the rays selected by mask whose range overlaps the box
+// dir_is_neg is shared by all rays of the packet
+
+struct packet_kernel_scalar {
+    static int test(const linear_bvh_node& node, const slab_packet& sp, const int* dir_is_neg, int mask,
+                    float t_min, const float* t_max) {
+        int overlaps = 0;
+        for (int i = 0; i < packet_size; i++) {
+            if (!(mask & (1 << i)))
+                continue;
+
+            float tmin = t_min;
+            float tmax = t_max[i];
+            for (int a = 0; a < 3; a++) {
+                auto t0 = ((dir_is_neg[a] ? node.bounds_max : node.bounds_min)[a] - sp.origin[a][i]) * sp.inv_dir[a][i];
+                auto t1 = ((dir_is_neg[a] ? node.bounds_min : node.bounds_max)[a] - sp.origin[a][i]) * sp.inv_dir[a][i];
+                t1 *= slab_far_scale;
+                tmin = t0 > tmin ? t0 : tmin;
+                tmax = t1 < tmax ? t1 : tmax;
+            }
+            if (!(tmax < tmin))
+                overlaps |= 1 << i;
+        }
+        return overlaps;
+    }
+};
+
+#ifdef RAYTRACER_X86_SIMD
+
+struct packet_kernel_avx2 {
+    RAYTRACER_TARGET_AVX2_HELPER
+    static int test(const linear_bvh_node& node, const slab_packet& sp, const int* dir_is_neg, int mask,
+                    float t_min, const float* t_max) {
+        static_assert(packet_size == 8, "one AVX2 register holds the whole packet");
+        __m256 tmin = _mm256_set1_ps(t_min);
+        __m256 tmax = _mm256_loadu_ps(t_max);
+        for (int a = 0; a < 3; a++) {
+            __m256 origin = _mm256_loadu_ps(sp.origin[a]);
+            __m256 inv_dir = _mm256_loadu_ps(sp.inv_dir[a]);
+            __m256 near = _mm256_set1_ps((dir_is_neg[a] ? node.bounds_max : node.bounds_min)[a]);
+            __m256 far = _mm256_set1_ps((dir_is_neg[a] ? node.bounds_min : node.bounds_max)[a]);
+            __m256 t0 = _mm256_mul_ps(_mm256_sub_ps(near, origin), inv_dir);
+            __m256 t1 = _mm256_mul_ps(_mm256_sub_ps(far, origin), inv_dir);
+            tmin = _mm256_max_ps(t0, tmin);
+            tmax = _mm256_min_ps(_mm256_mul_ps(t1, _mm256_set1_ps(slab_far_scale)), tmax);
+        }
+        return mask & _mm256_movemask_ps(_mm256_cmp_ps(tmin, tmax, _CMP_LE_OQ));
+    }
+};
+
+#endif // RAYTRACER_X86_SIMD
 
-    bool hit_left = left->hit(r, t_min, t_max, rec);
-    bool hit_right = right->hit(r, t_min, hit_left ? rec.t : t_max, rec);
+template <typename Primitives>
+int bvh_tree<Primitives>::hit_packet(const ray_packet& packet, int mask, real t_min, real* t_max, hit_record* recs) const {
+    // a single ray gains nothing from the packet path
+    if (nodes.empty() || (mask & (mask - 1)) == 0 || !packet_is_coherent(packet, mask))
+        return hittable::hit_packet(packet, mask, t_min, t_max, recs);
 
-    return hit_left || hit_right;
+#ifdef RAYTRACER_X86_SIMD
+    if (isa == simd_isa::avx2)
+        return hit_packet_avx2(packet, mask, t_min, t_max, recs);
+#endif
+    return hit_packet_binary<packet_kernel_scalar>(packet, mask, t_min, t_max, recs);
 }
 
+template <typename Primitives>
+template <typename Kernel>
+int bvh_tree<Primitives>::hit_packet_binary(
+    const ray_packet& packet, int mask, real t_min, real* t_max, hit_record* recs
+) const {
+    slab_packet sp(packet);
+
+    int first = 0;
+    while (!(mask & (1 << first)))
+        ++first;
+    int dir_is_neg[3];
+    for (int a = 0; a < 3; a++)
+        dir_is_neg[a] = packet.direction[a][first] < 0;
+
+    float tmax[packet_size];
+    for (int i = 0; i < packet_size; i++)
+        tmax[i] = static_cast<float>(t_max[i]);
+
+    // nodes waiting to be visited, with the rays that entered their parent
+    struct entry {
+        uint32_t node;
+        int mask;
+    };
+    entry stack[bvh_max_depth];
+    int stack_size = 0;
+    entry current{0, mask};
+
+    int hits = 0;
+    while (true) {
+        const auto& node = nodes[current.node];
+        int active = Kernel::test(node, sp, dir_is_neg, current.mask, static_cast<float>(t_min), tmax);
+
+        if (active && node.count > 0) {
+            int leaf_hits = primitives.hit_packet(node.offset, node.count, packet, active, t_min, t_max, recs);
+            for (int j = 0; j < packet_size; j++) {
+                if (leaf_hits & (1 << j))
+                    tmax[j] = static_cast<float>(t_max[j]);
+            }
+            hits |= leaf_hits;
+        } else if (active) {
+            if (dir_is_neg[node.axis]) {
+                stack[stack_size++] = entry{current.node + 1, active};
+                current = entry{node.offset, active};
+            } else {
+                stack[stack_size++] = entry{node.offset, active};
+                current = entry{current.node + 1, active};
+            }
+            continue;
+        }
+
+        if (stack_size == 0)
+            break;
+        current = stack[--stack_size];
+    }
+
+    return hits;
+}
+
+#ifdef RAYTRACER_X86_SIMD
+
+template <typename Primitives>
+RAYTRACER_TARGET_AVX2
+int bvh_tree<Primitives>::hit_packet_avx2(
+    const ray_packet& packet, int mask, real t_min, real* t_max, hit_record* recs
+) const {
+    return hit_packet_binary<packet_kernel_avx2>(packet, mask, t_min, t_max, recs);
+}
+
+template <typename Primitives>
+template <int N, typename Kernel, typename Nodes>
+bool bvh_tree<Primitives>::hit_wide(
+    const Nodes& node_at, const ray& r, real t_min, real t_max, hit_record& rec
+) const {
+    slab_ray sr(r);
+
+    // children waiting to be visited, with the distance at which the ray enters them
+    struct entry {
+        uint32_t child;
+        uint32_t count;
+        float t_near;
+    };
+    entry stack[bvh_max_depth * N];
+    int stack_size = 0;
+    stack[stack_size++] = entry{0, 0, -std::numeric_limits<float>::infinity()};
+
+    bool hit_anything = false;
+    while (stack_size > 0) {
+        auto current = stack[--stack_size];
+
+        // skip children that lie beyond a hit found since they were pushed
+        if (current.t_near > static_cast<float>(t_max) * slab_far_scale)
+            continue;
+
+        if (current.count > 0) {
+            hit_anything |= primitives.hit(current.child, current.count, r, t_min, t_max, rec);
+            continue;
+        }
+
+        const wide_bvh_node<N>& node = node_at(current.child);
+        float t_near[N];
+        int mask = Kernel::test(node, sr, static_cast<float>(t_min), static_cast<float>(t_max), t_near);
+
+        // sort the children hit far to near, so the nearest is popped first
+        entry hits[N];
+        int hit_count = 0;
+        while (mask) {
+            int i = __builtin_ctz(mask);
+            mask &= mask - 1;
+
+            entry e{node.child[i], node.count[i], t_near[i]};
+            int j = hit_count++;
+            while (j > 0 && hits[j - 1].t_near < e.t_near) {
+                hits[j] = hits[j - 1];
+                --j;
+            }
+            hits[j] = e;
+        }
+        for (int i = 0; i < hit_count; i++)
+            stack[stack_size++] = hits[i];
+    }
+
+    return hit_anything;
+}
+
+template <typename Primitives>
+bool bvh_tree<Primitives>::hit_sse(const ray& r, real t_min, real t_max, hit_record& rec) const {
+    return hit_wide<4, wide_kernel_sse>(stored_nodes<wide_bvh_node<4>>{nodes4}, r, t_min, t_max, rec);
+}
+
+template <typename Primitives>
+RAYTRACER_TARGET_AVX2
+bool bvh_tree<Primitives>::hit_avx2(const ray& r, real t_min, real t_max, hit_record& rec) const {
+    return hit_wide<8, wide_kernel_avx2>(stored_nodes<wide_bvh_node<8>>{nodes8}, r, t_min, t_max, rec);
+}
+
+#endif // RAYTRACER_X86_SIMD
+
+// batch_spheres builds trees of the kind above
+#include "sphere_batch.h"
+
 #endif // BVH_H
@@ -0,0 +1,102 @@
+#ifndef BVH_WIDE_H
+#define BVH_WIDE_H
+
+#include "ray.h"
+#include "simd.h"
+
+#include <cstdint>
+#include <limits>
+
+// multi-branching BVH nodes (BVH4, BVH8)
+// a wide node stores the boxes of up to N children side by side in structure-of-arrays layout, so one ray
+// is tested against all of them with a single pass of SIMD instructions
+// wide trees are collapsed from the binary tree by repeatedly opening the child with the largest surface
+// area until a node has N children
+
+template <int N>
+struct wide_bvh_node {
+    float bounds[6][N]; // min x, y, z then max x, y, z of every child
+    uint32_t child[N];  // interior child: index of its wide node, leaf child: index of its first primitive
+    uint32_t count[N];  // leaf child: number of primitives, 0 for interior children and empty slots
+};
+
+// empty slots get an inverted box, which every slab test misses
+template <int N>
+inline void clear_wide_node(wide_bvh_node<N>& node) {
+    for (int i = 0; i < N; i++) {
+        for (int a = 0; a < 3; a++) {
+            node.bounds[a][i] = std::numeric_limits<float>::infinity();
+            node.bounds[a + 3][i] = -std::numeric_limits<float>::infinity();
+        }
+        node.child[i] = UINT32_MAX;
+        node.count[i] = 0;
+    }
+}
+
+// widen the far distance by the rounding error of the float slab test, so it never misses a box the ray grazes
+const float slab_far_scale = 1.0f + 2.0f * (3 * std::numeric_limits<float>::epsilon() * 0.5f);
+
+// per-ray constants of the slab test
+struct slab_ray {
+    explicit slab_ray(const ray& r) {
+        for (int a = 0; a < 3; a++) {
+            origin[a] = static_cast<float>(r.origin()[a]);
+            inv_dir[a] = static_cast<float>(1.0 / r.direction()[a]);
+            dir_is_neg[a] = inv_dir[a] < 0;
+            near[a] = dir_is_neg[a] ? a + 3 : a;
+            far[a] = dir_is_neg[a] ? a : a + 3;
+        }
+    }
+
+    float origin[3];
+    float inv_dir[3];
+    int dir_is_neg[3];
+    int near[3]; // row of wide_bvh_node::bounds the ray enters each slab through
+    int far[3];
+};
+
+// slab tests of one ray against every child of a wide node
+// each kernel returns a bit mask of the children hit and writes their entry distances to t_near
+// a NaN distance (ray parallel to and on a slab) leaves the range unchanged
+
+#ifdef RAYTRACER_X86_SIMD
+
+struct wide_kernel_sse {
+    static int test(const wide_bvh_node<4>& node, const slab_ray& r, float t_min, float t_max, float* t_near) {
+        // max/min return their second operand when the first is NaN
+        __m128 tmin = _mm_set1_ps(t_min);
+        __m128 tmax = _mm_set1_ps(t_max);
+        for (int a = 0; a < 3; a++) {
+            __m128 origin = _mm_set1_ps(r.origin[a]);
+            __m128 inv_dir = _mm_set1_ps(r.inv_dir[a]);
+            __m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.bounds[r.near[a]]), origin), inv_dir);
+            __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.bounds[r.far[a]]), origin), inv_dir);
+            tmin = _mm_max_ps(t0, tmin);
+            tmax = _mm_min_ps(_mm_mul_ps(t1, _mm_set1_ps(slab_far_scale)), tmax);
+        }
+        _mm_storeu_ps(t_near, tmin);
+        return _mm_movemask_ps(_mm_cmple_ps(tmin, tmax));
+    }
+};
+
+struct wide_kernel_avx2 {
+    RAYTRACER_TARGET_AVX2_HELPER
+    static int test(const wide_bvh_node<8>& node, const slab_ray& r, float t_min, float t_max, float* t_near) {
+        __m256 tmin = _mm256_set1_ps(t_min);
+        __m256 tmax = _mm256_set1_ps(t_max);
+        for (int a = 0; a < 3; a++) {
+            __m256 origin = _mm256_set1_ps(r.origin[a]);
+            __m256 inv_dir = _mm256_set1_ps(r.inv_dir[a]);
+            __m256 t0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.bounds[r.near[a]]), origin), inv_dir);
+            __m256 t1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.bounds[r.far[a]]), origin), inv_dir);
+            tmin = _mm256_max_ps(t0, tmin);
+            tmax = _mm256_min_ps(_mm256_mul_ps(t1, _mm256_set1_ps(slab_far_scale)), tmax);
+        }
+        _mm256_storeu_ps(t_near, tmin);
+        return _mm256_movemask_ps(_mm256_cmp_ps(tmin, tmax, _CMP_LE_OQ));
+    }
+};
+
+#endif // RAYTRACER_X86_SIMD
+
+#endif // BVH_WIDE_H
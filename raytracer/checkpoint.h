@@ -0,0 +1,231 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include "framebuffer.h"
+#include "renderer.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// checkpoints of a progressive render, so a render that is stopped can be resumed where it left off
+// the file is memory mapped and holds the settings that decide the image, the scene number with the file it
+// reads (the OBJ file of scene 11 or the scene file of scene 12, as its path was given) and the resolution of
+// its baked noise, the precision of the build that rendered it, and two copies of the accumulation buffer
+// (colour sums and per-pixel sample counts)
+// a save fills the copy that is not in use, flushes it to disk and only then switches the header over to
+// it, so a process killed in the middle of a save still leaves the previous checkpoint intact
+// the generator of every sample is seeded from (seed, pixel, sample) and the scene is built from the seed,
+// so the seed and the number of samples taken are the whole random state: a resumed render carries on with
+// the next sample and adds up exactly the same values an uninterrupted render would
+
+const char checkpoint_magic[8] = {'R', 'T', 'C', 'K', 'P', 'T', '\0', '\0'};
+const uint32_t checkpoint_version = 5;
+// the longest path of a scene's input file a checkpoint holds, with its terminating NUL
+const size_t checkpoint_max_input = 4096;
+
+struct checkpoint_header {
+    char magic[8];
+    uint32_t version;
+    int32_t scene;
+    int32_t image_width;
+    int32_t image_height;
+    int32_t samples_per_pixel;
+    int32_t max_depth;
+    int32_t roulette_depth;
+    int32_t integrator;
+    int32_t light_sampling;
+    int32_t real_size;        // sizeof(real) of the build that rendered it
+    uint64_t seed;
+    double bake_cells;        // the --bake-noise of the scene, 0 if its noise is not baked
+    uint32_t active;          // the copy holding the last checkpoint
+    uint32_t samples_done[2]; // samples per pixel summed into each copy
+    char input[checkpoint_max_input]; // the file the scene reads, empty if it reads none
+};
+
+static_assert(sizeof(checkpoint_header) % 8 == 0, "the buffers after the header hold doubles");
+
+class checkpoint_file {
+    public:
+        checkpoint_file() {}
+        checkpoint_file(const checkpoint_file&) = delete;
+        checkpoint_file& operator=(const checkpoint_file&) = delete;
+        ~checkpoint_file() { close(); }
+
+        // maps an existing checkpoint, false if there is none at path (or it is not a checkpoint)
+        bool open(const std::string& path);
+        // creates a checkpoint at path for a new render of scene, which reads the file input (empty if it reads
+        // none, and shorter than checkpoint_max_input) and bakes its noise at bake_cells (0 if it does not),
+        // replacing any file there
+        bool create(const std::string& path, const render_settings& settings, int scene, const std::string& input,
+                    double bake_cells);
+
+        // the settings, scene, input file and noise resolution of the checkpointed render
+        void restore(render_settings& settings, int& scene, std::string& input, double& bake_cells) const;
+        // whether the checkpoint was rendered in the precision of this build; samples of the other precision
+        // would not add up to the image an uninterrupted render makes
+        bool same_precision() const { return header->real_size == static_cast<int32_t>(sizeof(real)); }
+        // changes the samples per pixel the render takes (e.g. raised on resuming), false if it cannot be saved
+        bool set_samples_per_pixel(int samples_per_pixel);
+        // copies the last checkpoint into image and returns the samples per pixel it holds
+        int load(framebuffer& image) const;
+        bool save(const framebuffer& image, int samples_done);
+
+    private:
+        void close();
+        bool map(int fd, size_t size);
+
+        size_t pixel_count() const { return static_cast<size_t>(header->image_width) * header->image_height; }
+        // every copy starts 8-byte aligned, for its doubles
+        static size_t copy_size(size_t pixels) {
+            return (pixels * (sizeof(colour) + sizeof(uint32_t)) + 7) & ~size_t(7);
+        }
+        static size_t file_size(size_t pixels) { return sizeof(checkpoint_header) + 2 * copy_size(pixels); }
+
+        // copy c: the colour sums, then the sample counts
+        colour* pixels(uint32_t c) const {
+            return reinterpret_cast<colour*>(data + sizeof(checkpoint_header) + c * copy_size(pixel_count()));
+        }
+        uint32_t* counts(uint32_t c) const {
+            return reinterpret_cast<uint32_t*>(pixels(c) + pixel_count());
+        }
+
+    private:
+        char* data = nullptr;
+        size_t size = 0;
+        checkpoint_header* header = nullptr;
+};
+
+bool checkpoint_file::map(int fd, size_t file_size) {
+    void* mapping = mmap(nullptr, file_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    // the mapping stays valid after the descriptor is closed
+    ::close(fd);
+    if (mapping == MAP_FAILED)
+        return false;
+
+    data = static_cast<char*>(mapping);
+    size = file_size;
+    header = reinterpret_cast<checkpoint_header*>(data);
+    return true;
+}
+
+bool checkpoint_file::open(const std::string& path) {
+    close();
+    int fd = ::open(path.c_str(), O_RDWR);
+    if (fd < 0)
+        return false;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(checkpoint_header)) {
+        ::close(fd);
+        return false;
+    }
+    if (!map(fd, static_cast<size_t>(st.st_size)))
+        return false;
+
+    bool valid = std::memcmp(header->magic, checkpoint_magic, sizeof(checkpoint_magic)) == 0 &&
+                 header->version == checkpoint_version && header->image_width > 0 && header->image_height > 0 &&
+                 header->active < 2 && size == file_size(pixel_count()) && header->bake_cells >= 0 &&
+                 std::memchr(header->input, '\0', sizeof(header->input)) != nullptr;
+    if (!valid)
+        close();
+    return valid;
+}
+
+bool checkpoint_file::create(const std::string& path, const render_settings& settings, int scene,
+                             const std::string& input, double bake_cells) {
+    close();
+    if (input.size() >= checkpoint_max_input)
+        return false;
+
+    int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return false;
+
+    auto file_size = checkpoint_file::file_size(static_cast<size_t>(settings.image_width) * settings.image_height);
+    if (ftruncate(fd, static_cast<off_t>(file_size)) != 0) {
+        ::close(fd);
+        return false;
+    }
+    if (!map(fd, file_size))
+        return false;
+
+    // the new file reads as zeros: both copies hold no samples, and the header is filled in last
+    checkpoint_header h{};
+    std::memcpy(h.magic, checkpoint_magic, sizeof(checkpoint_magic));
+    h.version = checkpoint_version;
+    h.scene = scene;
+    h.image_width = settings.image_width;
+    h.image_height = settings.image_height;
+    h.samples_per_pixel = settings.samples_per_pixel;
+    h.max_depth = settings.max_depth;
+    h.roulette_depth = settings.roulette_depth;
+    h.integrator = static_cast<int32_t>(settings.integrator);
+    h.light_sampling = settings.light_sampling;
+    h.real_size = static_cast<int32_t>(sizeof(real));
+    h.seed = settings.seed;
+    h.bake_cells = bake_cells;
+    std::memcpy(h.input, input.c_str(), input.size() + 1);
+    *header = h;
+    return msync(data, size, MS_SYNC) == 0;
+}
+
+void checkpoint_file::restore(render_settings& settings, int& scene, std::string& input, double& bake_cells) const {
+    scene = header->scene;
+    input = header->input;
+    bake_cells = header->bake_cells;
+    settings.image_width = header->image_width;
+    settings.image_height = header->image_height;
+    settings.samples_per_pixel = header->samples_per_pixel;
+    settings.max_depth = header->max_depth;
+    settings.roulette_depth = header->roulette_depth;
+    settings.integrator = static_cast<integrator_kind>(header->integrator);
+    settings.light_sampling = header->light_sampling != 0;
+    settings.seed = header->seed;
+}
+
+bool checkpoint_file::set_samples_per_pixel(int samples_per_pixel) {
+    header->samples_per_pixel = samples_per_pixel;
+    return msync(data, sizeof(checkpoint_header), MS_SYNC) == 0;
+}
+
+int checkpoint_file::load(framebuffer& image) const {
+    const auto c = header->active;
+    image = framebuffer(header->image_width, header->image_height);
+    image.sample_counts.resize(pixel_count());
+    std::memcpy(image.pixels.data(), pixels(c), pixel_count() * sizeof(colour));
+    std::memcpy(image.sample_counts.data(), counts(c), pixel_count() * sizeof(uint32_t));
+    return static_cast<int>(header->samples_done[c]);
+}
+
+bool checkpoint_file::save(const framebuffer& image, int samples_done) {
+    const auto c = header->active ^ 1;
+    std::memcpy(pixels(c), image.pixels.data(), pixel_count() * sizeof(colour));
+    if (image.sample_counts.empty())
+        std::fill(counts(c), counts(c) + pixel_count(), static_cast<uint32_t>(samples_done));
+    else
+        std::memcpy(counts(c), image.sample_counts.data(), pixel_count() * sizeof(uint32_t));
+    header->samples_done[c] = static_cast<uint32_t>(samples_done);
+
+    // msync wants a page aligned start, so the whole mapping is flushed; only the pages written go to disk
+    if (msync(data, size, MS_SYNC) != 0)
+        return false;
+    header->active = c;
+    return msync(data, sizeof(checkpoint_header), MS_SYNC) == 0;
+}
+
+void checkpoint_file::close() {
+    if (data)
+        munmap(data, size);
+    data = nullptr;
+    size = 0;
+    header = nullptr;
+}
+
+#endif // CHECKPOINT_H
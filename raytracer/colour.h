@@ -1,28 +1,79 @@
-
 #ifndef COLOUR_H
 #define COLOUR_H
 
-#include "vec3.h"
-#include <iostream>
-
-void write_colour(std::ostream &out, colour pixel_colour, int samples_per_pixel) {
-    auto r = pixel_colour.x();
-    auto g = pixel_colour.y();
-    auto b = pixel_colour.z();
-
-    // divide the colour by the number of samples
-    // apply gamma correction of 2.0 (raise colour to the power 1/gamma)
-    // gamma correction is used to "undo" the gamma correction applied to the image by the display
-    // because almost all image viewers assume the image is gamma corrected before being stored as a byte
-    auto scale = 1.0 / samples_per_pixel;
-    r = sqrt(scale * r);
-    g = sqrt(scale * g);
-    b = sqrt(scale * b);
-
-    // write the translated [0, 255] value of each colour component
-    out << static_cast<int>(256 * clamp(r, 0.0, 0.999)) << " "
-        << static_cast<int>(256 * clamp(g, 0.0, 0.999)) << " "
-        << static_cast<int>(256 * clamp(b, 0.0, 0.999)) << "\n";
+#include "raytracer.h"
+#include "framebuffer.h"
+#include "simd.h"
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+// converting the accumulated framebuffer to 8-bit colour, one pass over the whole image:
+// 1. divide the colour by the number of samples
+// 2. apply gamma correction of 2.0 (raise colour to the power 1/gamma)
+//    gamma correction is used to "undo" the gamma correction applied to the image by the display
+//    because almost all image viewers assume the image is gamma corrected before being stored as a byte
+// 3. translate to a [0, 255] value
+
+static_assert(sizeof(colour) == 3 * sizeof(double), "the framebuffer is read as a flat array of components");
+
+inline uint8_t quantise(double component, double scale) {
+    return static_cast<uint8_t>(256 * clamp(sqrt(scale * component), 0.0, 0.999));
+}
+
+#ifdef RAYTRACER_X86_SIMD
+
+// four components at a time, with the same operations as quantise so the bytes are identical
+RAYTRACER_TARGET_AVX2_HELPER
+inline size_t quantise_avx2(const double* in, size_t count, double scale, uint8_t* out) {
+    const __m256d s = _mm256_set1_pd(scale);
+    const __m256d lo = _mm256_setzero_pd();
+    const __m256d hi = _mm256_set1_pd(0.999);
+    const __m256d range = _mm256_set1_pd(256);
+
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m256d v = _mm256_sqrt_pd(_mm256_mul_pd(s, _mm256_loadu_pd(in + i)));
+        v = _mm256_mul_pd(range, _mm256_min_pd(_mm256_max_pd(v, lo), hi));
+        // truncate to int32, then narrow to bytes (every value is already within [0, 255])
+        __m128i q = _mm256_cvttpd_epi32(v);
+        q = _mm_packus_epi16(_mm_packus_epi32(q, q), q);
+        int bytes = _mm_cvtsi128_si32(q);
+        std::memcpy(out + i, &bytes, 4);
+    }
+    return i;
+}
+
+#endif // RAYTRACER_X86_SIMD
+
+// the gamma corrected 8-bit RGB values of every pixel, in image order
+inline std::vector<uint8_t> tonemap(const framebuffer& image, int samples_per_pixel) {
+    const size_t count = image.pixels.size() * 3;
+    const double* in = image.pixels.empty() ? nullptr : image.pixels[0].e;
+    const auto scale = 1.0 / samples_per_pixel;
+
+    std::vector<uint8_t> out(count);
+    size_t i = 0;
+#ifdef RAYTRACER_X86_SIMD
+    if (active_simd_isa() == simd_isa::avx2)
+        i = quantise_avx2(in, count, scale, out.data());
+#endif
+    for (; i < count; i++)
+        out[i] = quantise(in[i], scale);
+
+    return out;
+}
+
+// an image of how many samples every pixel of an adaptive render took, from blue (few) to red (max_samples)
+// the colours are squared to cancel the gamma correction applied when the image is written with 1 sample
+inline framebuffer sample_heatmap(const framebuffer& image, int max_samples) {
+    framebuffer heatmap(image.width, image.height);
+    for (size_t p = 0; p < image.sample_counts.size(); p++) {
+        auto t = clamp(static_cast<double>(image.sample_counts[p]) / max_samples, 0.0, 1.0);
+        heatmap.pixels[p] = colour(t*t, 0, (1-t)*(1-t));
+    }
+    return heatmap;
 }
 
 #endif // COLOUR_H
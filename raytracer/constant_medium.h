@@ -7,6 +7,26 @@
 #include "material.h"
 #include "texture.h"
 
+#include <cstring>
+
+// generator seeded from the bits of a ray
+// hit() has no generator to draw from, but every ray the renderer traces starts from a random point in a
+// random direction, so hashing the ray gives a fresh, reproducible stream per ray
+inline pcg32 ray_rng(const ray& r) {
+    double values[7] = {
+        r.origin().x(), r.origin().y(), r.origin().z(),
+        r.direction().x(), r.direction().y(), r.direction().z(), r.time()
+    };
+
+    uint64_t h = 0;
+    for (auto value : values) {
+        uint64_t bits;
+        std::memcpy(&bits, &value, sizeof(bits));
+        h = mix_seed(h ^ bits);
+    }
+    return pcg32(h);
+}
+
 // assumes once a ray exits the constant medium, it will continue forever outside the boundary - boundary shape is convex
 // will not work for torus or shapes that contain voids
 
@@ -15,7 +35,7 @@ class constant_medium : public hittable {
         constant_medium(shared_ptr<hittable> b, double d, shared_ptr<texture> a) : boundary(b), neg_inv_density(-1/d), phase_function(make_shared<isotropic>(a)) {}
         constant_medium(shared_ptr<hittable> b, double d, colour c) : boundary(b), neg_inv_density(-1/d), phase_function(make_shared<isotropic>(c)) {}
 
-        virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+        virtual bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const override;
 
         virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
             return boundary->bounding_box(time0, time1, output_box);
@@ -27,18 +47,24 @@ class constant_medium : public hittable {
         double neg_inv_density;
 };
 
-bool constant_medium::hit(const ray &r, double t_min, double t_max, hit_record &rec) const {
+bool constant_medium::hit(const ray &r, real t_min, real t_max, hit_record &rec) const {
+    auto rng = ray_rng(r);
+
     // Print occasional samples when debugging. To enable, set enableDebug true.
     const bool enableDebug = false;
-    const bool debugging = enableDebug && random_double() < 0.00001;
+    const bool debugging = enableDebug && random_double(rng) < 0.00001;
 
     hit_record rec1, rec2;
 
     if (!boundary->hit(r, -infinity, infinity, rec1))
         return false;
 
-    if (!boundary->hit(r, rec1.t+0.0001, infinity, rec2))
+    // the exit is found from just past the entry, moved off the boundary as scattered rays are (see
+    // hit_record::spawn_origin), rather than from an epsilon further along the ray
+    ray inside(rec1.spawn_origin(r.direction()), r.direction(), r.time());
+    if (!boundary->hit(inside, 0, infinity, rec2))
         return false;
+    rec2.t += rec1.t;
 
     if (debugging) std::cerr << "\nt0 t1 " << rec1.t << " " << rec2.t << '\n';
 
@@ -53,7 +79,7 @@ bool constant_medium::hit(const ray &r, double t_min, double t_max, hit_record &
 
     const auto ray_length = r.direction().length();
     const auto distance_inside_boundary = (rec2.t - rec1.t) * ray_length;
-    const auto hit_distance = neg_inv_density * log(random_double());
+    const auto hit_distance = neg_inv_density * log(random_double(rng));
 
     if (hit_distance > distance_inside_boundary)
         return false;
@@ -68,8 +94,11 @@ bool constant_medium::hit(const ray &r, double t_min, double t_max, hit_record &
     }
 
     rec.normal = vec3(1,0,0);  // arbitrary
+    rec.geometric_normal = rec.normal;
     rec.front_face = true;     // also arbitrary
-    rec.mat_ptr = phase_function;
+    rec.mat_ptr = phase_function.get();
+    // scattering inside the medium leaves no surface to escape from
+    rec.error = 0;
 
     return true;
 }
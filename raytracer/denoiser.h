@@ -0,0 +1,167 @@
+#ifndef DENOISER_H
+#define DENOISER_H
+
+#include "raytracer.h"
+#include "framebuffer.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <vector>
+
+// edge-avoiding a-trous wavelet denoiser (Dammertz et al., "Edge-Avoiding A-Trous Wavelet Transform for
+// fast Global Illumination Filtering", 2010), with the colour edge-stopping function scaled by the local
+// noise level as in SVGF (Schied et al., "Spatiotemporal Variance-Guided Filtering", 2017)
+// 1. divide the colour by the first-hit albedo, leaving the lighting (textures are not blurred)
+// 2. estimate the variance of the lighting's luminance at every pixel from its 5x5 neighbourhood
+// 3. blur the lighting with a 5x5 B3-spline kernel whose taps spread 1, 2, 4, ... pixels apart on successive
+//    iterations, so a few iterations cover a wide footprint at 25 taps per pixel each
+// 4. every tap is weighted down by how much its normal and depth differ from the centre pixel's, and by
+//    how much its luminance does measured in standard deviations of the noise: in noisy regions the blur
+//    reaches across large differences, where the image has converged it keeps them; the variance is
+//    filtered along with the colour, so the tolerance shrinks as the noise is removed
+// 5. multiply the albedo back in
+// iterations are parallel over rows
+
+struct denoise_settings {
+    int iterations = 5;
+    double sigma_luminance = 4;   // standard deviations of the noise
+    double sigma_normal = 0.25;   // of the difference of the normals
+    double sigma_depth = 0.02;    // of the relative depth difference, per pixel of tap distance
+};
+
+class denoiser {
+    public:
+        denoiser(const denoise_settings& s, thread_pool& p) : settings(s), pool(p) {}
+
+        // filters the accumulated colours of image in place; needs its feature buffers
+        void denoise(framebuffer& image, int samples_per_pixel) const;
+
+    private:
+        // the lighting and the variance of its luminance, in storage order
+        struct signal {
+            std::vector<colour> lighting;
+            std::vector<double> variance;
+        };
+
+        void estimate_variance(const framebuffer& image, signal& s, int row) const;
+        void filter_row(const framebuffer& image, const signal& in, signal& out, int row, int step) const;
+
+    public:
+        denoise_settings settings;
+
+    private:
+        thread_pool& pool;
+};
+
+// lighting below this albedo is left as the colour, to keep black surfaces from dividing by zero
+const double denoise_min_albedo = 0.01;
+
+inline double luminance(const colour& c) {
+    return 0.2126 * c.x() + 0.7152 * c.y() + 0.0722 * c.z();
+}
+
+void denoiser::denoise(framebuffer& image, int samples_per_pixel) const {
+    const auto pixels = image.pixels.size();
+    const auto scale = 1.0 / samples_per_pixel;
+
+    auto demodulate = [](double c, double a) { return a > denoise_min_albedo ? c / a : c; };
+    auto modulate = [](double c, double a) { return a > denoise_min_albedo ? c * a : c; };
+
+    signal current, next;
+    current.lighting.resize(pixels);
+    current.variance.resize(pixels);
+    next = current;
+    for (size_t p = 0; p < pixels; p++) {
+        const auto& c = image.pixels[p];
+        const auto& a = image.albedo[p];
+        current.lighting[p] = colour(demodulate(scale * c.x(), a.x()), demodulate(scale * c.y(), a.y()),
+                                     demodulate(scale * c.z(), a.z()));
+    }
+
+    pool.parallel_for(static_cast<size_t>(image.height), [&](size_t row) {
+        estimate_variance(image, current, static_cast<int>(row));
+    });
+
+    for (int iteration = 0; iteration < settings.iterations; iteration++) {
+        const int step = 1 << iteration;
+        pool.parallel_for(static_cast<size_t>(image.height), [&](size_t row) {
+            filter_row(image, current, next, static_cast<int>(row), step);
+        });
+        std::swap(current, next);
+    }
+
+    for (size_t p = 0; p < pixels; p++) {
+        const auto& c = current.lighting[p];
+        const auto& a = image.albedo[p];
+        image.pixels[p] = samples_per_pixel * colour(modulate(c.x(), a.x()), modulate(c.y(), a.y()),
+                                                     modulate(c.z(), a.z()));
+    }
+}
+
+// the spatial variance of the luminance over the 5x5 neighbourhood of each pixel of the row
+void denoiser::estimate_variance(const framebuffer& image, signal& s, int row) const {
+    const int width = image.width;
+    for (int x = 0; x < width; x++) {
+        double sum = 0, sum_squares = 0;
+        int n = 0;
+        for (int y = std::max(0, row - 2); y <= std::min(image.height - 1, row + 2); y++) {
+            for (int xq = std::max(0, x - 2); xq <= std::min(width - 1, x + 2); xq++) {
+                auto l = luminance(s.lighting[static_cast<size_t>(y) * width + xq]);
+                sum += l;
+                sum_squares += l * l;
+                n++;
+            }
+        }
+        auto mean = sum / n;
+        s.variance[static_cast<size_t>(row) * width + x] = std::max(0.0, sum_squares / n - mean * mean);
+    }
+}
+
+// row is counted in storage order, from the top
+void denoiser::filter_row(const framebuffer& image, const signal& in, signal& out, int row, int step) const {
+    static const double kernel[5] = {1.0/16, 1.0/4, 3.0/8, 1.0/4, 1.0/16};
+    const int width = image.width;
+    const double normal_scale = 1 / (settings.sigma_normal * settings.sigma_normal);
+    const double depth_scale = 1 / (settings.sigma_depth * step);
+
+    for (int x = 0; x < width; x++) {
+        const size_t p = static_cast<size_t>(row) * width + x;
+        const auto luminance_p = luminance(in.lighting[p]);
+        const auto& normal_p = image.normal[p];
+        const auto depth_p = image.depth[p];
+        const auto luminance_scale = 1 / (settings.sigma_luminance * std::sqrt(in.variance[p]) + 1e-10);
+
+        colour sum(0, 0, 0);
+        double variance_sum = 0;
+        double weight_sum = 0;
+        for (int dy = -2; dy <= 2; dy++) {
+            int y = row + dy * step;
+            if (y < 0 || y >= image.height)
+                continue;
+            for (int dx = -2; dx <= 2; dx++) {
+                int xq = x + dx * step;
+                if (xq < 0 || xq >= width)
+                    continue;
+
+                const size_t q = static_cast<size_t>(y) * width + xq;
+                auto luminance_distance = std::fabs(luminance(in.lighting[q]) - luminance_p);
+                auto normal_distance = (image.normal[q] - normal_p).length_squared();
+                auto depth_distance = std::fabs(image.depth[q] - depth_p) / std::max(depth_p, image.depth[q]);
+
+                // the three edge-stopping functions multiply, so their exponents add up to one exp
+                auto weight = kernel[dx + 2] * kernel[dy + 2] * std::exp(-(
+                    luminance_distance * luminance_scale + normal_distance * normal_scale +
+                    depth_distance * depth_scale));
+                sum += weight * in.lighting[q];
+                variance_sum += weight * weight * in.variance[q];
+                weight_sum += weight;
+            }
+        }
+
+        // the centre tap always has weight
+        out.lighting[p] = sum / weight_sum;
+        out.variance[p] = variance_sum / (weight_sum * weight_sum);
+    }
+}
+
+#endif // DENOISER_H
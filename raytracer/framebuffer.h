@@ -0,0 +1,42 @@
+#ifndef FRAMEBUFFER_H
+#define FRAMEBUFFER_H
+
+#include "vec3.h"
+
+#include <cstdint>
+#include <vector>
+
+// accumulated (summed, not yet averaged) sample colours for every pixel of the image
+// pixels are addressed like the camera: i - column from the left, j - row from the bottom
+// rows are stored top to bottom so the buffer can be written out in image order
+// adaptive rendering also records how many samples every pixel took
+// for denoising, the first hits of a pixel's camera rays are also recorded as feature buffers
+
+class framebuffer {
+    public:
+        framebuffer() : width(0), height(0) {}
+        framebuffer(int w, int h) : width(w), height(h), pixels(static_cast<size_t>(w) * h) {}
+
+        colour& at(int i, int j) { return pixels[index(i, j)]; }
+        const colour& at(int i, int j) const { return pixels[index(i, j)]; }
+
+        uint32_t& samples_at(int i, int j) { return sample_counts[index(i, j)]; }
+
+        // position of pixel (i, j) in the buffers
+        size_t index(int i, int j) const {
+            return static_cast<size_t>(height - 1 - j) * width + i;
+        }
+
+    public:
+        int width;
+        int height;
+        std::vector<colour> pixels;
+        std::vector<uint32_t> sample_counts; // empty unless the image was rendered adaptively
+
+        // first-hit features averaged over the pixel, empty unless computed (see renderer::render_features)
+        std::vector<colour> albedo; // base colour of the material
+        std::vector<vec3> normal;   // shading normal, facing the camera
+        std::vector<double> depth;  // distance from the camera, miss_depth where rays escape
+};
+
+#endif // FRAMEBUFFER_H
@@ -6,41 +6,142 @@
 #include "raytracer.h"
 #include "aabb.h"
 
+#include <vector>
+
 class material;
 
 // when a ray hits a surface (e.g. a sphere), the material pointer in the hit_record will be set to point
-// at the material pointer the sphere was created with
+// at the material the sphere was created with
 // when the ray_colour() routine gets the hit_record, it can call member functions of the material pointer
 // to find out what ray, if any, is scattered
+// the scene owns the materials through the shared pointers its objects were created with, so the record
+// only borrows a raw pointer: filling in a hit costs no reference count updates (atomic operations that
+// make threads contend for the material's cache line)
+// error bounds how far p may be from the true surface through rounding; rays leaving the surface start off it
+// by that much (see offset_ray_origin), so every primitive sets it, and transforms grow it
 struct hit_record {
     point3 p;
     vec3 normal;
-    shared_ptr<material> mat_ptr;
-    double t;
-    double u;
-    double v;
+    vec3 geometric_normal; // of the surface itself; normal may be a shading normal (interpolated on meshes)
+    const material* mat_ptr;
+    real t;
+    real u;
+    real v;
+    real error;
     bool front_face; // determine which side of the surface the ray is hitting
 
+    // the origin of a ray leaving the surface at p in direction, moved off along the geometric normal: only
+    // the surface itself is sure to lie within error of p along it
+    point3 spawn_origin(const vec3& direction) const {
+        return offset_ray_origin(p, geometric_normal, error, direction);
+    }
+
     // normal always points against the ray
     inline void set_face_normal(const ray& r, const vec3& outward_normal) {
-        front_face = dot(r.direction(), outward_normal) < 0;
+        set_face_normal(r, outward_normal, outward_normal);
+    }
+
+    // the sides are told apart by the geometric normal, and both normals are turned against the ray
+    inline void set_face_normal(const ray& r, const vec3& outward_normal, const vec3& outward_geometric_normal) {
+        front_face = dot(r.direction(), outward_geometric_normal) < 0;
         normal = front_face ? outward_normal : -outward_normal;
+        geometric_normal = front_face ? outward_geometric_normal : -outward_geometric_normal;
+    }
+};
+
+// a bundle of coherent rays (e.g. camera rays through neighbouring pixels) traced together
+// the rays are stored in structure-of-arrays layout, so SIMD intersection tests load one component of
+// several rays with a single instruction
+// which rays take part in a query is given by a bit mask, bit i for lane i
+const int packet_size = 8;
+
+struct ray_packet {
+    ray lane(int i) const {
+        return ray(point3(origin[0][i], origin[1][i], origin[2][i]),
+                   vec3(direction[0][i], direction[1][i], direction[2][i]), time[i]);
     }
+
+    void set_lane(int i, const ray& r) {
+        for (int a = 0; a < 3; a++) {
+            origin[a][i] = r.orig.e[a];
+            direction[a][i] = r.dir.e[a];
+        }
+        time[i] = r.tm;
+    }
+
+    real origin[3][packet_size];
+    real direction[3][packet_size];
+    real time[packet_size];
 };
 
+// all rays selected by mask have the same direction signs
+inline bool packet_is_coherent(const ray_packet& packet, int mask) {
+    int first = -1;
+    for (int i = 0; i < packet_size; i++) {
+        if (!(mask & (1 << i)))
+            continue;
+        if (first < 0) {
+            first = i;
+            continue;
+        }
+        for (int a = 0; a < 3; a++) {
+            if ((packet.direction[a][i] < 0) != (packet.direction[a][first] < 0))
+                return false;
+        }
+    }
+    return true;
+}
+
 class hittable {
     public:
-        virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const = 0;
+        // rec is only written when the ray hits, so a miss leaves the closest hit found so far in place
+        virtual bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const = 0;
+        // intersect the rays of the packet selected by mask, each against its own t_max
+        // a ray that hits fills its hit_record and shortens its t_max, the mask of those rays is returned
+        // by default the rays are traced one by one, primitives and acceleration structures override it
+        virtual int hit_packet(
+            const ray_packet& packet, int mask, real t_min, real* t_max, hit_record* recs
+        ) const;
         // not all primitives have bounding boxes (e.g. infinite plane)
         // moving objects have bounding box enclosing the object for the entire time interval
         virtual bool bounding_box(double time0, double time1, aabb& output_box) const = 0;
+
+        // light sampling (see lights.h), for primitives that can be lights
+        // the density over solid angle with which random_direction picks direction v from origin
+        virtual double pdf_value(const point3& origin, const vec3& v) const {
+            return 0;
+        }
+        // a direction from origin towards a random point on the primitive
+        virtual vec3 random_direction(const point3& origin, pcg32& rng) const {
+            return {1, 0, 0};
+        }
+        // adds the primitives made of diffuse_light to lights
+        // transforms add nothing, since the sampling functions of the primitives below them work in the
+        // untransformed space; lights under a transform are still found by scattered rays
+        virtual void collect_lights(std::vector<const hittable*>& lights) const {}
 };
 
+int hittable::hit_packet(
+    const ray_packet& packet, int mask, real t_min, real* t_max, hit_record* recs
+) const {
+    int hits = 0;
+    for (int i = 0; i < packet_size; i++) {
+        if ((mask & (1 << i)) && hit(packet.lane(i), t_min, t_max[i], recs[i])) {
+            t_max[i] = recs[i].t;
+            hits |= 1 << i;
+        }
+    }
+    return hits;
+}
+
 class translate : public hittable {
     public:
         translate(shared_ptr<hittable> p, const vec3& displacement) : ptr(p), offset(displacement) {}
 
-        virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+        virtual bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const override;
+        virtual int hit_packet(
+            const ray_packet& packet, int mask, real t_min, real* t_max, hit_record* recs
+        ) const override;
         virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
 
     public:
@@ -48,17 +149,39 @@ class translate : public hittable {
         vec3 offset;
 };
 
-bool translate::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+bool translate::hit(const ray& r, real t_min, real t_max, hit_record& rec) const {
     ray moved_r(r.origin() - offset, r.direction(), r.time());
     if (!ptr->hit(moved_r, t_min, t_max, rec))
         return false;
 
     rec.p += offset;
-    rec.set_face_normal(moved_r, rec.normal);
+    rec.error += hit_error(max_magnitude(rec.p));
+    rec.set_face_normal(moved_r, rec.normal, rec.geometric_normal);
 
     return true;
 }
 
+int translate::hit_packet(
+    const ray_packet& packet, int mask, real t_min, real* t_max, hit_record* recs
+) const {
+    ray_packet moved = packet;
+    for (int a = 0; a < 3; a++) {
+        for (int i = 0; i < packet_size; i++)
+            moved.origin[a][i] -= offset.e[a];
+    }
+
+    int hits = ptr->hit_packet(moved, mask, t_min, t_max, recs);
+    for (int i = 0; i < packet_size; i++) {
+        if (hits & (1 << i)) {
+            recs[i].p += offset;
+            recs[i].error += hit_error(max_magnitude(recs[i].p));
+            recs[i].set_face_normal(moved.lane(i), recs[i].normal, recs[i].geometric_normal);
+        }
+    }
+
+    return hits;
+}
+
 bool translate::bounding_box(double time0, double time1, aabb& output_box) const {
     if (!ptr->bounding_box(time0, time1, output_box))
         return false;
@@ -72,12 +195,20 @@ class rotate_y : public hittable {
     public:
         rotate_y(shared_ptr<hittable> p, double angle);
 
-        virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+        virtual bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const override;
+        virtual int hit_packet(
+            const ray_packet& packet, int mask, real t_min, real* t_max, hit_record* recs
+        ) const override;
         virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
             output_box = bbox;
             return hasbox;
         }
 
+    private:
+        // the ray in the object's frame, and the hit on the object back in the world's frame
+        ray to_object(const ray& r) const;
+        void to_world(const ray& rotated_r, hit_record& rec) const;
+
     public:
         shared_ptr<hittable> ptr;
         double sin_theta;
@@ -119,7 +250,38 @@ rotate_y::rotate_y(shared_ptr<hittable> p, double angle) : ptr(p) {
     bbox = aabb(min, max);
 }
 
-bool rotate_y::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+bool rotate_y::hit(const ray& r, real t_min, real t_max, hit_record& rec) const {
+    ray rotated_r = to_object(r);
+
+    if (!ptr->hit(rotated_r, t_min, t_max, rec))
+        return false;
+
+    to_world(rotated_r, rec);
+    return true;
+}
+
+int rotate_y::hit_packet(
+    const ray_packet& packet, int mask, real t_min, real* t_max, hit_record* recs
+) const {
+    // the same arithmetic as to_object, one component of all rays at a time
+    ray_packet rotated = packet;
+    for (int i = 0; i < packet_size; i++) {
+        rotated.origin[0][i] = cos_theta * packet.origin[0][i] - sin_theta * packet.origin[2][i];
+        rotated.origin[2][i] = sin_theta * packet.origin[0][i] + cos_theta * packet.origin[2][i];
+        rotated.direction[0][i] = cos_theta * packet.direction[0][i] - sin_theta * packet.direction[2][i];
+        rotated.direction[2][i] = sin_theta * packet.direction[0][i] + cos_theta * packet.direction[2][i];
+    }
+
+    int hits = ptr->hit_packet(rotated, mask, t_min, t_max, recs);
+    for (int i = 0; i < packet_size; i++) {
+        if (hits & (1 << i))
+            to_world(rotated.lane(i), recs[i]);
+    }
+
+    return hits;
+}
+
+ray rotate_y::to_object(const ray& r) const {
     auto origin = r.origin();
     auto direction = r.direction();
 
@@ -130,13 +292,13 @@ bool rotate_y::hit(const ray& r, double t_min, double t_max, hit_record& rec) co
     direction[0] = cos_theta * r.direction()[0] - sin_theta * r.direction()[2];
     direction[2] = sin_theta * r.direction()[0] + cos_theta * r.direction()[2];
 
-    ray rotated_r(origin, direction, r.time());
-
-    if (!ptr->hit(rotated_r, t_min, t_max, rec))
-        return false;
+    return ray(origin, direction, r.time());
+}
 
+void rotate_y::to_world(const ray& rotated_r, hit_record& rec) const {
     auto p = rec.p;
     auto normal = rec.normal;
+    auto geometric_normal = rec.geometric_normal;
 
     // rotate back
     p[0] = cos_theta * rec.p[0] + sin_theta * rec.p[2];
@@ -145,10 +307,12 @@ bool rotate_y::hit(const ray& r, double t_min, double t_max, hit_record& rec) co
     normal[0] = cos_theta * rec.normal[0] + sin_theta * rec.normal[2];
     normal[2] = -sin_theta * rec.normal[0] + cos_theta * rec.normal[2];
 
-    rec.p = p;
-    rec.set_face_normal(rotated_r, normal);
+    geometric_normal[0] = cos_theta * rec.geometric_normal[0] + sin_theta * rec.geometric_normal[2];
+    geometric_normal[2] = -sin_theta * rec.geometric_normal[0] + cos_theta * rec.geometric_normal[2];
 
-    return true;
+    rec.p = p;
+    rec.error += hit_error(max_magnitude(p));
+    rec.set_face_normal(rotated_r, normal, geometric_normal);
 }
 
 #endif // HITTABLE_H
@@ -19,29 +19,46 @@ class hittable_list : public hittable {
         void clear() { objects.clear(); }
         void add(shared_ptr<hittable> object) { objects.push_back(object); }
 
-        virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+        virtual bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const override;
+        virtual int hit_packet(
+            const ray_packet& packet, int mask, real t_min, real* t_max, hit_record* recs
+        ) const override;
         virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
+        virtual void collect_lights(std::vector<const hittable*>& lights) const override {
+            for (const auto& object : objects)
+                object->collect_lights(lights);
+        }
 
     public:
         std::vector<shared_ptr<hittable>> objects;
 };
 
-bool hittable_list::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
-    hit_record temp_rec;
+bool hittable_list::hit(const ray& r, real t_min, real t_max, hit_record& rec) const {
     bool hit_anything = false;
     auto closest_so_far = t_max;
 
+    // objects only write rec when they report a closer hit, so they can fill it in directly
     for (const auto& object : objects) {
-        if (object->hit(r, t_min, closest_so_far, temp_rec)) {
+        if (object->hit(r, t_min, closest_so_far, rec)) {
             hit_anything = true;
-            closest_so_far = temp_rec.t;
-            rec = temp_rec;
+            closest_so_far = rec.t;
         }
     }
 
     return hit_anything;
 }
 
+int hittable_list::hit_packet(
+    const ray_packet& packet, int mask, real t_min, real* t_max, hit_record* recs
+) const {
+    // every object shortens the t_max of the rays it hits, so later objects only report closer hits
+    int hits = 0;
+    for (const auto& object : objects)
+        hits |= object->hit_packet(packet, mask, t_min, t_max, recs);
+
+    return hits;
+}
+
 bool hittable_list::bounding_box(double time0, double time1, aabb& output_box) const {
     if (objects.empty()) return false;
 
@@ -0,0 +1,214 @@
+#ifndef IMAGE_WRITER_H
+#define IMAGE_WRITER_H
+
+#include "colour.h"
+#include "framebuffer.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// image output
+// ppm - binary P6 with 8-bit gamma corrected colours
+// png - the same colours as an uncompressed PNG
+// pfm - linear (averaged but not gamma corrected) 32-bit float colours, for HDR post-processing
+
+enum class image_format {
+    ppm,
+    png,
+    pfm
+};
+
+// picks the format from the file extension, ppm for anything unknown (and standard output)
+inline image_format image_format_from_path(const std::string& path) {
+    auto ends_with = [&path](const char* ext) {
+        auto n = std::strlen(ext);
+        return path.size() >= n && path.compare(path.size() - n, n, ext) == 0;
+    };
+    if (ends_with(".png"))
+        return image_format::png;
+    if (ends_with(".pfm"))
+        return image_format::pfm;
+    return image_format::ppm;
+}
+
+// P6 - binary RGB bytes; column number; row number; 255 - for max colour
+void write_ppm(std::ostream& out, const framebuffer& image, int samples_per_pixel) {
+    auto rgb = tonemap(image, samples_per_pixel);
+    out << "P6\n" << image.width << " " << image.height << "\n255\n";
+    out.write(reinterpret_cast<const char*>(rgb.data()), static_cast<std::streamsize>(rgb.size()));
+}
+
+// PF - three little endian floats per pixel (signalled by the negative scale), rows from the bottom up
+void write_pfm(std::ostream& out, const framebuffer& image, int samples_per_pixel) {
+    out << "PF\n" << image.width << " " << image.height << "\n-1.0\n";
+
+    const auto scale = 1.0 / samples_per_pixel;
+    std::vector<float> row(static_cast<size_t>(image.width) * 3);
+    for (int j = 0; j < image.height; ++j) {
+        for (int i = 0; i < image.width; ++i) {
+            const auto& pixel = image.at(i, j);
+            for (int c = 0; c < 3; c++)
+                row[static_cast<size_t>(i) * 3 + c] = static_cast<float>(scale * pixel.e[c]);
+        }
+        out.write(reinterpret_cast<const char*>(row.data()), static_cast<std::streamsize>(row.size() * sizeof(float)));
+    }
+}
+
+// PNG without compression: the zlib stream holds the filtered rows in "stored" deflate blocks, which
+// costs no time to encode and needs no library
+inline uint32_t png_crc(const uint8_t* data, size_t size, uint32_t crc = 0xffffffffu) {
+    static const auto table = [] {
+        std::vector<uint32_t> t(256);
+        for (uint32_t n = 0; n < 256; n++) {
+            uint32_t c = n;
+            for (int k = 0; k < 8; k++)
+                c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+            t[n] = c;
+        }
+        return t;
+    }();
+
+    for (size_t i = 0; i < size; i++)
+        crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+inline void png_put_u32(std::vector<uint8_t>& out, uint32_t value) {
+    for (int shift = 24; shift >= 0; shift -= 8)
+        out.push_back(static_cast<uint8_t>(value >> shift));
+}
+
+inline void png_chunk(std::ostream& out, const char* type, const std::vector<uint8_t>& data) {
+    std::vector<uint8_t> header;
+    png_put_u32(header, static_cast<uint32_t>(data.size()));
+    header.insert(header.end(), type, type + 4);
+
+    // the checksum covers the type and the data, not the length
+    std::vector<uint8_t> crc;
+    png_put_u32(crc, png_crc(data.data(), data.size(), png_crc(header.data() + 4, 4)) ^ 0xffffffffu);
+
+    out.write(reinterpret_cast<const char*>(header.data()), static_cast<std::streamsize>(header.size()));
+    out.write(reinterpret_cast<const char*>(data.data()), static_cast<std::streamsize>(data.size()));
+    out.write(reinterpret_cast<const char*>(crc.data()), static_cast<std::streamsize>(crc.size()));
+}
+
+void write_png(std::ostream& out, const framebuffer& image, int samples_per_pixel) {
+    auto rgb = tonemap(image, samples_per_pixel);
+
+    // every row starts with its filter type, 0 (none)
+    const size_t stride = static_cast<size_t>(image.width) * 3;
+    std::vector<uint8_t> raw;
+    raw.reserve((stride + 1) * image.height);
+    for (int row = 0; row < image.height; ++row) {
+        raw.push_back(0);
+        raw.insert(raw.end(), rgb.begin() + row * stride, rgb.begin() + (row + 1) * stride);
+    }
+
+    std::vector<uint8_t> zlib = {0x78, 0x01};
+    const size_t block_size = 65535;
+    size_t offset = 0;
+    do {
+        auto len = static_cast<uint16_t>(std::min(block_size, raw.size() - offset));
+        bool last = offset + len == raw.size();
+        zlib.push_back(last ? 1 : 0);
+        zlib.push_back(static_cast<uint8_t>(len));
+        zlib.push_back(static_cast<uint8_t>(len >> 8));
+        zlib.push_back(static_cast<uint8_t>(~len));
+        zlib.push_back(static_cast<uint8_t>(~len >> 8));
+        zlib.insert(zlib.end(), raw.begin() + offset, raw.begin() + offset + len);
+        offset += len;
+    } while (offset < raw.size());
+
+    // adler-32 checksum of the uncompressed data; the sums cannot overflow within 5552 bytes, so the
+    // modulo is only taken once per run of that length
+    uint32_t a = 1, b = 0;
+    for (size_t start = 0; start < raw.size(); start += 5552) {
+        auto end = std::min(raw.size(), start + 5552);
+        for (size_t i = start; i < end; i++) {
+            a += raw[i];
+            b += a;
+        }
+        a %= 65521;
+        b %= 65521;
+    }
+    png_put_u32(zlib, (b << 16) | a);
+
+    std::vector<uint8_t> header;
+    png_put_u32(header, static_cast<uint32_t>(image.width));
+    png_put_u32(header, static_cast<uint32_t>(image.height));
+    // 8 bits per channel, truecolour, deflate, adaptive filtering, no interlacing
+    header.insert(header.end(), {8, 2, 0, 0, 0});
+
+    const uint8_t signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+    out.write(reinterpret_cast<const char*>(signature), sizeof(signature));
+    png_chunk(out, "IHDR", header);
+    png_chunk(out, "IDAT", zlib);
+    png_chunk(out, "IEND", {});
+}
+
+void write_image(std::ostream& out, const framebuffer& image, int samples_per_pixel, image_format format) {
+    switch (format) {
+        case image_format::png: write_png(out, image, samples_per_pixel); break;
+        case image_format::pfm: write_pfm(out, image, samples_per_pixel); break;
+        default: write_ppm(out, image, samples_per_pixel); break;
+    }
+    out.flush();
+}
+
+// writes finished images on a background thread, so rendering can carry on meanwhile
+// the writer takes its own copy of the framebuffer; one write is in flight at a time
+
+class image_writer {
+    public:
+        image_writer() {}
+        image_writer(const image_writer&) = delete;
+        image_writer& operator=(const image_writer&) = delete;
+        ~image_writer() { wait(); }
+
+        // path "-" writes to the standard output
+        void write(framebuffer image, int samples_per_pixel, const std::string& path, image_format format) {
+            wait();
+            // the worker only sets failed while no other thread reads it, wait() joins it first
+            worker = std::thread([this, image = std::move(image), samples_per_pixel, path, format] {
+                if (path == "-") {
+                    write_image(std::cout, image, samples_per_pixel, format);
+                    if (!std::cout) {
+                        std::cerr << "ERROR: Could not write the image to the standard output.\n";
+                        failed = true;
+                    }
+                    return;
+                }
+
+                std::ofstream file(path, std::ios::binary);
+                if (!file) {
+                    std::cerr << "ERROR: Could not open output image file '" << path << "'.\n";
+                    failed = true;
+                    return;
+                }
+                write_image(file, image, samples_per_pixel, format);
+                if (!file) {
+                    std::cerr << "ERROR: Could not write output image file '" << path << "'.\n";
+                    failed = true;
+                }
+            });
+        }
+
+        // blocks until the last image has been written; false if any image so far could not be written
+        bool wait() {
+            if (worker.joinable())
+                worker.join();
+            return !failed;
+        }
+
+    private:
+        std::thread worker;
+        bool failed = false;
+};
+
+#endif // IMAGE_WRITER_H
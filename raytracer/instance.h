@@ -0,0 +1,95 @@
+#ifndef INSTANCE_H
+#define INSTANCE_H
+
+#include "raytracer.h"
+#include "hittable.h"
+#include "transform.h"
+
+// a placement of shared geometry (usually a bvh over the object, built once) in the scene by an affine transform
+// many instances can refer to the same object: the scene holds the object once and a transform per copy, and
+// a bvh over the instances (the top level) is built from their world space boxes
+// a hit transforms the ray into the object's space once and the hit back into world space once, whatever the
+// transform; the ray's direction is not renormalised, so t is the same in both spaces
+
+class instance : public hittable {
+    public:
+        instance(shared_ptr<hittable> object, const affine& object_to_world);
+
+        // moves the instance to a new place, the bvhs over it then need an update (see bvh_tree::update)
+        void place(const affine& object_to_world);
+
+        virtual bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const override;
+        virtual int hit_packet(
+            const ray_packet& packet, int mask, real t_min, real* t_max, hit_record* recs
+        ) const override;
+        virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
+
+    private:
+        ray to_object(const ray& r) const {
+            return ray(world_to_object.point(r.origin()), world_to_object.vector(r.direction()), r.time());
+        }
+        void to_world(hit_record& rec) const;
+
+    public:
+        shared_ptr<hittable> object;
+        affine object_to_world;
+        affine world_to_object;
+        double stretch; // object_to_world.norm(), which scales the error of hits
+};
+
+instance::instance(shared_ptr<hittable> object, const affine& object_to_world)
+    : object(object), object_to_world(object_to_world), world_to_object(object_to_world.inverse()),
+      stretch(object_to_world.norm())
+{}
+
+void instance::place(const affine& object_to_world) {
+    this->object_to_world = object_to_world;
+    world_to_object = object_to_world.inverse();
+    stretch = object_to_world.norm();
+}
+
+void instance::to_world(hit_record& rec) const {
+    rec.p = object_to_world.point(rec.p);
+    // the object's error is stretched with the object, and the transform rounds once more
+    rec.error = static_cast<real>(stretch * rec.error) + hit_error(max_magnitude(rec.p));
+    // the object already turned the normals against the ray, and the inverse transpose keeps them that way
+    // (the dot product with the ray direction is unchanged), so front_face stays as it is
+    rec.normal = unit_vector(world_to_object.transposed_vector(rec.normal));
+    rec.geometric_normal = unit_vector(world_to_object.transposed_vector(rec.geometric_normal));
+}
+
+bool instance::hit(const ray& r, real t_min, real t_max, hit_record& rec) const {
+    if (!object->hit(to_object(r), t_min, t_max, rec))
+        return false;
+
+    to_world(rec);
+    return true;
+}
+
+int instance::hit_packet(
+    const ray_packet& packet, int mask, real t_min, real* t_max, hit_record* recs
+) const {
+    ray_packet local = packet;
+    for (int i = 0; i < packet_size; i++) {
+        if (mask & (1 << i))
+            local.set_lane(i, to_object(packet.lane(i)));
+    }
+
+    int hits = object->hit_packet(local, mask, t_min, t_max, recs);
+    for (int i = 0; i < packet_size; i++) {
+        if (hits & (1 << i))
+            to_world(recs[i]);
+    }
+
+    return hits;
+}
+
+bool instance::bounding_box(double time0, double time1, aabb& output_box) const {
+    if (!object->bounding_box(time0, time1, output_box))
+        return false;
+
+    output_box = object_to_world.bounds(output_box);
+    return true;
+}
+
+#endif // INSTANCE_H
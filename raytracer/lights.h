@@ -0,0 +1,38 @@
+#ifndef LIGHTS_H
+#define LIGHTS_H
+
+#include "raytracer.h"
+#include "hittable.h"
+
+#include <algorithm>
+#include <vector>
+
+// the lights of a scene, for sampling them directly (next event estimation)
+// a light is picked uniformly and then sampled with its own random_direction, so the density of a direction
+// is the average of the lights' densities
+// the scene keeps ownership of the primitives, the list only borrows them
+
+class light_list {
+    public:
+        light_list() {}
+        explicit light_list(const hittable& world) { world.collect_lights(lights); }
+
+        bool empty() const { return lights.empty(); }
+
+        double pdf_value(const point3& origin, const vec3& v) const {
+            double sum = 0;
+            for (const auto* light : lights)
+                sum += light->pdf_value(origin, v);
+            return sum / lights.size();
+        }
+
+        vec3 random_direction(const point3& origin, pcg32& rng) const {
+            auto index = std::min(static_cast<size_t>(random_double(rng) * lights.size()), lights.size() - 1);
+            return lights[index]->random_direction(origin, rng);
+        }
+
+    public:
+        std::vector<const hittable*> lights;
+};
+
+#endif // LIGHTS_H
@@ -1,46 +1,35 @@
 
 #include "raytracer.h"
 #include "colour.h"
+#include "image_writer.h"
 #include "hittable_list.h"
 #include "sphere.h"
 #include "camera.h"
 #include "material.h"
 #include "moving_sphere.h"
 #include "bvh.h"
+#include "motion_bvh.h"
+#include "instance.h"
+#include "triangle_mesh.h"
+#include "obj_loader.h"
+#include "scene_file.h"
 #include "aarect.h"
 #include "box.h"
 #include "constant_medium.h"
-
+#include "renderer.h"
+#include "checkpoint.h"
+#include "denoiser.h"
+#include "thread_pool.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <functional>
 #include <iostream>
+#include <string>
 
-// ray tracer:
-// 1. calculate the ray from the eye to the pixel
-// 2. determine which objects the ray intersects
-// 3. compute a colour for that intersection point
-
-colour ray_colour(const ray& r, const colour& background, const hittable& world, int depth) {
-    hit_record rec;
-
-    // limit the maximum recursion depth, returning no light contribution at the maximum depth
-    if (depth <= 0)
-        return {0,0,0};
-
-    // if the ray hits nothing, return the background colour
-    // shadow acne: ignore hits very near zero (t_min = 0.001)
-    if (!world.hit(r, 0.001, infinity, rec))
-        return background;
-
-    ray scattered;
-    colour attenuation;
-    colour emitted = rec.mat_ptr->emitted(rec.u, rec.v, rec.p);
-
-    if (!rec.mat_ptr->scatter(r, rec, attenuation, scattered))
-        return emitted;
-
-    return emitted + attenuation * ray_colour(scattered, background, world, depth-1);
-}
-
-hittable_list random_scene() {
+// with motion the diffuse spheres bounce up during the shutter, and the scene is a motion bvh
+hittable_list random_scene(thread_pool& pool, bool motion = false) {
     hittable_list world;
 
     auto ground_material = make_shared<checker_texture>(colour(0.2, 0.3, 0.1), colour(0.9, 0.9, 0.9));
@@ -59,10 +48,12 @@ hittable_list random_scene() {
                 if (choose_mat < 0.8) {
                     auto albedo = colour::random() * colour::random();
                     sphere_material = make_shared<lambertian>(albedo);
-                    world.add(make_shared<sphere>(center, 0.2, sphere_material));
-                    // motion blur
-                    // auto center2 = center + vec3(0, random_double(0, 0.5), 0);
-                    // world.add(make_shared<moving_sphere>(center, center2, 0.0, 1.0, 0.2, sphere_material));
+                    if (motion) {
+                        auto center2 = center + vec3(0, random_double(0, 0.5), 0);
+                        world.add(make_shared<moving_sphere>(center, center2, 0.0, 1.0, 0.2, sphere_material));
+                    } else {
+                        world.add(make_shared<sphere>(center, 0.2, sphere_material));
+                    }
                 // metal
                 } else if (choose_mat < 0.95) {
                     auto albedo = colour::random(0.5, 1);
@@ -87,7 +78,9 @@ hittable_list random_scene() {
     auto material3 = make_shared<metal>(colour(0.7, 0.6, 0.5), 0.0);
     world.add(make_shared<sphere>(point3(4,1,0), 1.0, material3));
 
-    return {make_shared<bvh_node>(world, 0.0, 1.0)};
+    if (motion)
+        return {make_shared<motion_bvh>(world, 0.0, 1.0, 1, &pool)};
+    return {make_shared<bvh>(world, 0.0, 1.0, &pool)};
 }
 
 hittable_list two_spheres() {
@@ -101,10 +94,23 @@ hittable_list two_spheres() {
     return objects;
 }
 
-hittable_list two_perlin_spheres() {
-    hittable_list objects;
+// the finest --bake-noise resolution: 32 cells to the unit over the region below is some 80M points, which
+// turbulence_grid lowers to its cap
+const double max_bake_cells = 32;
 
+// the marble of the perlin scenes; with bake_cells its turbulence is baked, that many grid cells to the unit,
+// around the small sphere and the ground the camera sees close by
+shared_ptr<noise_texture> marble_texture(double bake_cells, thread_pool& pool) {
     auto pertext = make_shared<noise_texture>(2);
+    if (bake_cells > 0)
+        pertext->bake(aabb(point3(-12, -0.2, -12), point3(12, 4, 12)), bake_cells, &pool);
+    return pertext;
+}
+
+hittable_list two_perlin_spheres(double bake_cells, thread_pool& pool) {
+    hittable_list objects;
+
+    auto pertext = marble_texture(bake_cells, pool);
     objects.add(make_shared<sphere>(point3(0,-1000,0), 1000, make_shared<lambertian>(pertext)));
     objects.add(make_shared<sphere>(point3(0,2,0), 2, make_shared<lambertian>(pertext)));
 
@@ -119,10 +125,10 @@ hittable_list earth() {
     return {globe};
 }
 
-hittable_list simple_light() {
+hittable_list simple_light(double bake_cells, thread_pool& pool) {
     hittable_list objects;
 
-    auto pertext = make_shared<noise_texture>(2);
+    auto pertext = marble_texture(bake_cells, pool);
     objects.add(make_shared<sphere>(point3(0,-1000,0), 1000, make_shared<lambertian>(pertext)));
     objects.add(make_shared<sphere>(point3(0,2,0), 2, make_shared<lambertian>(pertext)));
 
@@ -149,13 +155,11 @@ hittable_list cornell_box() {
     objects.add(make_shared<xy_rect>(0, 555, 0, 555, 555, white));
 
     shared_ptr<hittable> box1 = make_shared<box>(point3(0,0,0), point3(165,330,165), white);
-    box1 = make_shared<rotate_y>(box1, 15);
-    box1 = make_shared<translate>(box1, vec3(265,0,295));
+    box1 = make_shared<instance>(box1, affine::translation(vec3(265,0,295)) * affine::rotation(vec3(0,1,0), 15));
     objects.add(box1);
 
     shared_ptr<hittable> box2 = make_shared<box>(point3(0,0,0), point3(165,165,165), white);
-    box2 = make_shared<rotate_y>(box2, -18);
-    box2 = make_shared<translate>(box2, vec3(130,0,65));
+    box2 = make_shared<instance>(box2, affine::translation(vec3(130,0,65)) * affine::rotation(vec3(0,1,0), -18));
     objects.add(box2);
 
     return objects;
@@ -177,12 +181,10 @@ hittable_list cornell_smoke() {
     objects.add(make_shared<xy_rect>(0, 555, 0, 555, 555, white));
 
     shared_ptr<hittable> box1 = make_shared<box>(point3(0,0,0), point3(165,330,165), white);
-    box1 = make_shared<rotate_y>(box1, 15);
-    box1 = make_shared<translate>(box1, vec3(265,0,295));
+    box1 = make_shared<instance>(box1, affine::translation(vec3(265,0,295)) * affine::rotation(vec3(0,1,0), 15));
 
     shared_ptr<hittable> box2 = make_shared<box>(point3(0,0,0), point3(165,165,165), white);
-    box2 = make_shared<rotate_y>(box2, -18);
-    box2 = make_shared<translate>(box2, vec3(130,0,65));
+    box2 = make_shared<instance>(box2, affine::translation(vec3(130,0,65)) * affine::rotation(vec3(0,1,0), -18));
 
     objects.add(make_shared<constant_medium>(box1, 0.01, colour(0,0,0)));
     objects.add(make_shared<constant_medium>(box2, 0.01, colour(1,1,1)));
@@ -190,7 +192,7 @@ hittable_list cornell_smoke() {
     return objects;
 }
 
-hittable_list popcorn_box() {
+hittable_list popcorn_box(thread_pool& pool) {
     hittable_list boxes1;
     auto ground = make_shared<lambertian>(colour(0.48, 0.83, 0.53));
 
@@ -211,7 +213,7 @@ hittable_list popcorn_box() {
 
     hittable_list objects;
 
-    objects.add(make_shared<bvh_node>(boxes1, 0, 1));
+    objects.add(make_shared<bvh>(boxes1, 0, 1, &pool));
 
     auto light = make_shared<diffuse_light>(colour(7, 7, 7));
     objects.add(make_shared<xz_rect>(123, 423, 147, 412, 554, light));
@@ -223,10 +225,9 @@ hittable_list popcorn_box() {
         boxes2.add(make_shared<sphere>(point3::random(0,165), 10, white));
     }
 
-    objects.add(make_shared<translate>(
-        make_shared<rotate_y>(
-            make_shared<bvh_node>(boxes2, 0.0, 1.0), 15),
-            vec3(-100,270,395)
+    objects.add(make_shared<instance>(
+        make_shared<bvh>(boxes2, 0.0, 1.0, &pool),
+        affine::translation(vec3(-100,270,395)) * affine::rotation(vec3(0,1,0), 15)
     ));
 
     return objects;
@@ -249,29 +250,314 @@ hittable_list cornell_glass() {
     objects.add(make_shared<xy_rect>(0, 555, 0, 555, 555, white));
 
     shared_ptr<hittable> box1 = make_shared<box>(point3(0,0,0), point3(165,330,165), glass);
-    box1 = make_shared<rotate_y>(box1, 15);
-    box1 = make_shared<translate>(box1, vec3(265,0,295));
+    box1 = make_shared<instance>(box1, affine::translation(vec3(265,0,295)) * affine::rotation(vec3(0,1,0), 15));
     objects.add(box1);
 
     shared_ptr<hittable> box2 = make_shared<box>(point3(0,0,0), point3(165,165,165), glass);
-    box2 = make_shared<rotate_y>(box2, -18);
-    box2 = make_shared<translate>(box2, vec3(130,0,65));
+    box2 = make_shared<instance>(box2, affine::translation(vec3(130,0,65)) * affine::rotation(vec3(0,1,0), -18));
     objects.add(box2);
 
     return objects;
 }
 
-int main() {
+// what changes from frame to frame of a sequence besides the camera: called with the time of the frame, from 0
+// at the first frame towards 1 at the last, it moves objects and updates the bvhs over them, returning whether
+// one of them was rebuilt rather than refit
+using scene_animation = std::function<bool(double)>;
+
+// a field of copies of one cluster of spheres: the cluster's bvh is built once and shared by all the
+// instances, which only add a transform each, and a top level bvh is built over the instances
+// animated, the clusters spin about their vertical axes and ride a wave across the ground
+hittable_list instanced_clusters(thread_pool& pool, scene_animation* animate = nullptr) {
+    hittable_list cluster;
+    for (int i = 0; i < 1000; i++) {
+        auto albedo = colour::random() * colour::random();
+        cluster.add(make_shared<sphere>(point3::random(-1,1), 0.08, make_shared<lambertian>(albedo)));
+    }
+    auto shared_cluster = make_shared<bvh>(cluster, 0.0, 1.0, &pool);
+
+    hittable_list instances;
+    std::vector<shared_ptr<instance>> placed;
+    std::vector<vec3> positions;
+    std::vector<affine> orientations;
+    const int clusters_per_side = 100;
+    for (int i = 0; i < clusters_per_side; i++) {
+        for (int j = 0; j < clusters_per_side; j++) {
+            auto scale = random_double(0.5, 1.2);
+            auto position = vec3(3.0*(i - clusters_per_side/2) + random_double(-0.5,0.5), scale,
+                                 3.0*(j - clusters_per_side/2) + random_double(-0.5,0.5));
+            auto orientation = affine::rotation(vec3::random(-1,1), random_double(0,360))
+                             * affine::scaling(vec3(scale, scale, scale));
+            placed.push_back(make_shared<instance>(shared_cluster, affine::translation(position) * orientation));
+            positions.push_back(position);
+            orientations.push_back(orientation);
+            instances.add(placed.back());
+        }
+    }
+
+    auto top = make_shared<bvh>(instances, 0.0, 1.0, &pool);
+    if (animate) {
+        *animate = [placed, positions, orientations, top, &pool](double t) {
+            pool.parallel_for(placed.size(), [&](size_t k) {
+                auto wave = 1.5 * (1 + sin(2*pi*t + 0.2 * (positions[k].x() + positions[k].z())));
+                placed[k]->place(affine::translation(positions[k] + vec3(0, wave, 0))
+                               * affine::rotation(vec3(0,1,0), 360 * t) * orientations[k]);
+            }, 256);
+            return top->update(0.0, 1.0, &pool);
+        };
+    }
+
+    hittable_list objects;
+    objects.add(top);
+    auto ground = make_shared<lambertian>(colour(0.48, 0.83, 0.53));
+    objects.add(make_shared<sphere>(point3(0,-1000,0), 1000, ground));
+
+    return objects;
+}
+
+// a mesh read from an OBJ file, scaled to 2 units across and standing on a ground sphere
+// an empty world if the file cannot be read
+hittable_list obj_scene(const std::string& path, thread_pool& pool) {
+    auto vertices = make_shared<mesh_vertices>();
+    std::vector<uint32_t> indices;
+    if (!read_obj(path, *vertices, indices))
+        return {};
+
+    auto material = make_shared<lambertian>(colour(0.73, 0.73, 0.73));
+    auto mesh = make_shared<triangle_mesh>(vertices, std::move(indices), material, &pool);
+
+    aabb bounds;
+    mesh->bounding_box(0, 1, bounds);
+    auto size = bounds.max() - bounds.min();
+    auto scale = 2 / fmax(size.x(), fmax(size.y(), size.z()));
+    auto base = point3(0.5 * (bounds.min().x() + bounds.max().x()), bounds.min().y(),
+                       0.5 * (bounds.min().z() + bounds.max().z()));
+
+    hittable_list objects;
+    objects.add(make_shared<instance>(mesh, affine::scaling(vec3(scale, scale, scale)) * affine::translation(-base)));
+    auto ground = make_shared<lambertian>(make_shared<checker_texture>(colour(0.2, 0.3, 0.1), colour(0.9, 0.9, 0.9)));
+    objects.add(make_shared<sphere>(point3(0,-1000,0), 1000, ground));
+
+    return objects;
+}
+
+// one of the denoiser's feature buffers as an image, for writing out with 1 sample per pixel
+template <typename T, typename F>
+framebuffer feature_image(const framebuffer& image, const std::vector<T>& feature, F to_colour) {
+    framebuffer out(image.width, image.height);
+    for (size_t p = 0; p < feature.size(); p++)
+        out.pixels[p] = to_colour(feature[p]);
+    return out;
+}
+
+// the file of one frame of a sequence, with the frame number before the extension
+std::string frame_path(const std::string& path, int frame) {
+    if (path.empty())
+        return path;
+
+    auto dot = path.find_last_of('.');
+    auto slash = path.find_last_of('/');
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+        dot = path.size();
+
+    char number[16];
+    std::snprintf(number, sizeof(number), "_%04d", frame);
+    return path.substr(0, dot) + number + path.substr(dot);
+}
+
+void usage() {
+    std::cerr << "usage: raytracer [--scene N] [--width W] [--spp N] [--threads N] [--seed S] [--simd scalar|sse|avx2]\n"
+              << "                 [--integrator recursive|iterative|packet|wavefront] [--output image.ppm|png|pfm]\n"
+              << "                 [--adaptive THRESHOLD] [--min-spp N] [--heatmap heatmap.ppm|png]\n"
+              << "                 [--checkpoint FILE] [--checkpoint-interval SECONDS] [--pass-spp N] [--light-sampling]\n"
+              << "                 [--denoise] [--aov PREFIX] [--obj mesh.obj] [--scene-file FILE] [--save-scene FILE]\n"
+              << "                 [--frames N] [--bake-noise CELLS]\n"
+              << "without --output a binary ppm is written to the standard output\n"
+              << "with --adaptive (recursive and iterative integrators only), --spp is the most samples a pixel\n"
+              << "may take\n"
+              << "with --checkpoint the image is rendered in passes of --pass-spp samples and saved to FILE at\n"
+              << "most every --checkpoint-interval seconds; if FILE already holds a checkpoint the render resumes\n"
+              << "from it with its own settings and scene, including the file of scenes 11 and 12 and --bake-noise\n"
+              << "(only --spp may be raised, and the checkpoint keeps the new count) and the image file is updated\n"
+              << "at every checkpoint\n"
+              << "--light-sampling samples the lights directly at diffuse and glossy bounces (iterative integrator only)\n"
+              << "--denoise filters the image guided by first-hit albedo, normal and depth buffers; --aov writes those\n"
+              << "buffers to PREFIX_albedo.pfm, PREFIX_normal.pfm and PREFIX_depth.pfm\n"
+              << "--obj renders the triangles of an OBJ file (scene 11, which --obj selects)\n"
+              << "--save-scene writes the scene, with its camera, to a binary scene file and exits without rendering;\n"
+              << "--scene-file renders a scene file (scene 12, which --scene-file selects)\n"
+              << "--frames renders a sequence of N frames in which the camera orbits the scene once (and scene 10\n"
+              << "moves), numbering the output files: image.png becomes image_0000.png, image_0001.png, ...\n"
+              << "--bake-noise samples the turbulence of the marble (scenes 3 and 5) on a grid of CELLS cells to the\n"
+              << "unit (more than 0 and at most " << max_bake_cells << ") around the spheres before rendering, and\n"
+              << "interpolates it instead of computing the noise\n";
+}
+
+int main(int argc, char* argv[]) {
+
+    int scene = 0;
+    int image_width = 1000;
+    int samples_per_pixel = 50;
+    unsigned int threads = std::thread::hardware_concurrency();
+    uint64_t seed = 0;
+    integrator_kind integrator = integrator_kind::recursive;
+    std::string output = "-";
+    double adaptive_threshold = 0;
+    int min_samples = 16;
+    std::string heatmap;
+    bool spp_given = false;
+    std::string checkpoint_path;
+    double checkpoint_interval = 60;
+    int pass_samples = 8;
+    bool light_sampling = false;
+    bool denoise = false;
+    std::string aov;
+    std::string obj;
+    std::string scene_path;
+    std::string save_scene;
+    int frames = 1;
+    double bake_noise = 0;
+
+    for (int a = 1; a < argc; ++a) {
+        if (std::strcmp(argv[a], "--scene") == 0 && a + 1 < argc) {
+            scene = std::stoi(argv[++a]);
+        } else if (std::strcmp(argv[a], "--width") == 0 && a + 1 < argc) {
+            image_width = std::stoi(argv[++a]);
+        } else if (std::strcmp(argv[a], "--spp") == 0 && a + 1 < argc) {
+            samples_per_pixel = std::stoi(argv[++a]);
+            spp_given = true;
+        } else if (std::strcmp(argv[a], "--threads") == 0 && a + 1 < argc) {
+            threads = static_cast<unsigned int>(std::stoul(argv[++a]));
+        } else if (std::strcmp(argv[a], "--seed") == 0 && a + 1 < argc) {
+            seed = std::stoull(argv[++a]);
+        } else if (std::strcmp(argv[a], "--simd") == 0 && a + 1 < argc) {
+            std::string isa = argv[++a];
+            if (isa != "scalar" && isa != "sse" && isa != "avx2") {
+                usage();
+                return 1;
+            }
+            simd_isa_limit() = isa == "scalar" ? simd_isa::scalar : isa == "sse" ? simd_isa::sse : simd_isa::avx2;
+        } else if (std::strcmp(argv[a], "--output") == 0 && a + 1 < argc) {
+            output = argv[++a];
+        } else if (std::strcmp(argv[a], "--adaptive") == 0 && a + 1 < argc) {
+            adaptive_threshold = std::stod(argv[++a]);
+        } else if (std::strcmp(argv[a], "--min-spp") == 0 && a + 1 < argc) {
+            min_samples = std::stoi(argv[++a]);
+        } else if (std::strcmp(argv[a], "--heatmap") == 0 && a + 1 < argc) {
+            heatmap = argv[++a];
+        } else if (std::strcmp(argv[a], "--checkpoint") == 0 && a + 1 < argc) {
+            checkpoint_path = argv[++a];
+        } else if (std::strcmp(argv[a], "--checkpoint-interval") == 0 && a + 1 < argc) {
+            checkpoint_interval = std::stod(argv[++a]);
+        } else if (std::strcmp(argv[a], "--pass-spp") == 0 && a + 1 < argc) {
+            pass_samples = std::max(1, std::stoi(argv[++a]));
+        } else if (std::strcmp(argv[a], "--denoise") == 0) {
+            denoise = true;
+        } else if (std::strcmp(argv[a], "--aov") == 0 && a + 1 < argc) {
+            aov = argv[++a];
+        } else if (std::strcmp(argv[a], "--obj") == 0 && a + 1 < argc) {
+            obj = argv[++a];
+            scene = 11;
+        } else if (std::strcmp(argv[a], "--scene-file") == 0 && a + 1 < argc) {
+            scene_path = argv[++a];
+            scene = 12;
+        } else if (std::strcmp(argv[a], "--save-scene") == 0 && a + 1 < argc) {
+            save_scene = argv[++a];
+        } else if (std::strcmp(argv[a], "--frames") == 0 && a + 1 < argc) {
+            frames = std::max(1, std::stoi(argv[++a]));
+        } else if (std::strcmp(argv[a], "--bake-noise") == 0 && a + 1 < argc) {
+            bake_noise = std::stod(argv[++a]);
+            if (!(bake_noise > 0 && bake_noise <= max_bake_cells)) {
+                usage();
+                return 1;
+            }
+        } else if (std::strcmp(argv[a], "--light-sampling") == 0) {
+            light_sampling = true;
+        } else if (std::strcmp(argv[a], "--integrator") == 0 && a + 1 < argc) {
+            std::string name = argv[++a];
+            if (name != "recursive" && name != "iterative" && name != "packet" && name != "wavefront") {
+                usage();
+                return 1;
+            }
+            integrator = name == "iterative" ? integrator_kind::iterative
+                       : name == "packet" ? integrator_kind::packet
+                       : name == "wavefront" ? integrator_kind::wavefront : integrator_kind::recursive;
+        } else {
+            usage();
+            return 1;
+        }
+    }
 
-    // write output image in ppm
     const auto aspect_ratio = 1.0;
     // const auto aspect_ratio = 16.0 / 9.0;
-    const int image_width = 1000;
-    const int image_height = static_cast<int>(image_width / aspect_ratio);
-    const int samples_per_pixel = 50;
-    const int max_depth = 50;
+    render_settings settings;
+    settings.image_width = image_width;
+    settings.image_height = static_cast<int>(settings.image_width / aspect_ratio);
+    settings.samples_per_pixel = samples_per_pixel;
+    settings.max_depth = 50;
+    settings.seed = seed;
+    settings.integrator = integrator;
+    settings.adaptive = adaptive_threshold > 0;
+    settings.adaptive_threshold = adaptive_threshold;
+    settings.min_samples = min_samples;
+    settings.light_sampling = light_sampling;
+    if (light_sampling && integrator != integrator_kind::iterative) {
+        std::cerr << "ERROR: --light-sampling needs --integrator iterative.\n";
+        return 1;
+    }
+    if (settings.adaptive && integrator != integrator_kind::recursive && integrator != integrator_kind::iterative) {
+        std::cerr << "ERROR: --adaptive needs --integrator recursive or iterative.\n";
+        return 1;
+    }
+
+    if (frames > 1 && (output == "-" || !checkpoint_path.empty())) {
+        std::cerr << "ERROR: --frames needs an --output file to number and cannot be combined with --checkpoint.\n";
+        return 1;
+    }
+
+    // a progressive render picks up an earlier checkpoint with all its settings, asking for more samples aside
+    checkpoint_file checkpoint;
+    bool resume = false;
+    // the file the scene reads, which a checkpoint keeps with the scene number
+    std::string scene_input = scene == 11 ? obj : scene == 12 ? scene_path : "";
+    if (!checkpoint_path.empty()) {
+        if (settings.adaptive) {
+            std::cerr << "ERROR: --adaptive cannot be combined with --checkpoint.\n";
+            return 1;
+        }
+        resume = checkpoint.open(checkpoint_path);
+        if (resume && !checkpoint.same_precision()) {
+            std::cerr << "ERROR: Checkpoint file '" << checkpoint_path << "' was rendered by a build of the other "
+                      << "precision.\n";
+            return 1;
+        }
+        if (resume) {
+            checkpoint.restore(settings, scene, scene_input, bake_noise);
+            if (scene == 11)
+                obj = scene_input;
+            else if (scene == 12)
+                scene_path = scene_input;
+            if (spp_given) {
+                settings.samples_per_pixel = samples_per_pixel;
+                if (!checkpoint.set_samples_per_pixel(samples_per_pixel)) {
+                    std::cerr << "ERROR: Could not save checkpoint file '" << checkpoint_path << "'.\n";
+                    return 1;
+                }
+            }
+            std::cerr << "Resuming from checkpoint '" << checkpoint_path << "'.\n";
+        } else if (scene_input.size() >= checkpoint_max_input) {
+            std::cerr << "ERROR: The input file path is too long for a checkpoint.\n";
+            return 1;
+        }
+    }
+
+    // the scene is built from the same seed, so a run is fully reproducible
+    seed_random(settings.seed);
+
+    thread_pool pool(threads);
 
     // world
+    auto build_start = std::chrono::steady_clock::now();
     hittable_list world;
 
     point3 lookfrom;
@@ -279,10 +565,11 @@ int main() {
     auto vfov = 40.0;
     auto aperture = 0.0;
     colour background(0,0,0);
+    scene_animation animate;
 
-    switch (0) {
+    switch (scene) {
         case 1:
-            world = random_scene();
+            world = random_scene(pool);
             background = colour(0.70, 0.80, 1.00);
             lookfrom = point3(13,2,3);
             lookat = point3(0,0,0);
@@ -299,7 +586,7 @@ int main() {
             break;
 
         case 3:
-            world = two_perlin_spheres();
+            world = two_perlin_spheres(bake_noise, pool);
             background = colour(0.70, 0.80, 1.00);
             lookfrom = point3(13,2,3);
             lookat = point3(0,0,0);
@@ -316,7 +603,7 @@ int main() {
 
         case 5:
             background = colour(0,0,0);
-            world = simple_light();
+            world = simple_light(bake_noise, pool);
             lookfrom = point3(26,3,6);
             lookat = point3(0,2,0);
             vfov = 20.0;
@@ -339,13 +626,56 @@ int main() {
             break;
 
         case 8:
-            world = popcorn_box();
+            world = popcorn_box(pool);
             background = colour(0,0,0);
             lookfrom = point3(278, 278, -800);
             lookat = point3(278, 240, 0);
             vfov = 40.0;
             break;
 
+        case 10:
+            world = instanced_clusters(pool, &animate);
+            background = colour(0.70, 0.80, 1.00);
+            lookfrom = point3(0, 20, -160);
+            lookat = point3(0, 0, 0);
+            vfov = 30.0;
+            break;
+
+        case 11:
+            world = obj_scene(obj, pool);
+            if (world.objects.empty()) {
+                std::cerr << "ERROR: scene 11 needs a mesh, pass one with --obj.\n";
+                return 1;
+            }
+            background = colour(0.70, 0.80, 1.00);
+            lookfrom = point3(3, 2.5, 5);
+            lookat = point3(0, 0.5, 0);
+            vfov = 30.0;
+            break;
+
+        case 12: {
+            scene_view view;
+            if (!read_scene_file(scene_path, world, view)) {
+                std::cerr << "ERROR: scene 12 needs a scene file, pass one with --scene-file.\n";
+                return 1;
+            }
+            background = view.background;
+            lookfrom = view.lookfrom;
+            lookat = view.lookat;
+            vfov = view.vfov;
+            aperture = view.aperture;
+            break;
+        }
+
+        case 13:
+            world = random_scene(pool, true);
+            background = colour(0.70, 0.80, 1.00);
+            lookfrom = point3(13,2,3);
+            lookat = point3(0,0,0);
+            vfov = 20.0;
+            aperture = 0.1;
+            break;
+
         default:
         case 9:
             world = cornell_glass();
@@ -360,26 +690,123 @@ int main() {
     vec3 vup(0,1,0);
     auto dist_to_focus = 10.0;
 
-    camera cam(lookfrom, lookat, vup, vfov, aspect_ratio, aperture, dist_to_focus, 0.0, 1.0);
-
-    // ppm format:
-    // P3 - colours in ASCII; column number; row number; 255 - for max colour;
-    // RGB triplets
-    std::cout << "P3\n" << image_width << " " << image_height << "\n255\n";
-
-    for (int j = image_height-1; j >= 0; --j) {
-        // write progress indicator to the error output stream
-        std::cerr << "\rScanline remaining: " << j << " " << std::flush;
-        for (int i = 0; i < image_width; ++i) {
-            colour pixel_colour(0, 0, 0);
-            for (int s = 0; s < samples_per_pixel; ++s) {
-                auto u = (i + random_double()) / (image_width-1);
-                auto v = (j + random_double()) / (image_height-1);
-                ray r = cam.get_ray(u, v);
-                pixel_colour += ray_colour(r, background, world, max_depth);
+    // scene construction includes building the BVHs
+    std::chrono::duration<double> build_time = std::chrono::steady_clock::now() - build_start;
+    std::cerr << "Scene built in " << build_time.count() << "s.\n";
+
+    if (!save_scene.empty()) {
+        if (!write_scene_file(save_scene, world, scene_view{lookfrom, lookat, vfov, aperture, background}, &pool))
+            return 1;
+        std::cerr << "Scene saved to " << save_scene << ".\n";
+        return 0;
+    }
+
+    // the renderer, the thread pool and the scene with its bvhs, textures and noise tables stay resident from one
+    // frame to the next; a sequence orbits the camera once around what it looks at and animates the scene
+    renderer render(settings, pool);
+    image_writer writer;
+
+    for (int frame = 0; frame < frames; ++frame) {
+        auto frame_output = output;
+        auto frame_heatmap = heatmap;
+        auto frame_aov = aov;
+        auto frame_lookfrom = lookfrom;
+        if (frames > 1) {
+            auto t = static_cast<double>(frame) / frames;
+            frame_lookfrom = lookat + affine::rotation(vup, 360 * t).vector(lookfrom - lookat);
+            frame_output = frame_path(output, frame);
+            frame_heatmap = frame_path(heatmap, frame);
+            frame_aov = frame_path(aov, frame);
+
+            if (animate) {
+                auto update_start = std::chrono::steady_clock::now();
+                bool rebuilt = animate(t);
+                std::chrono::duration<double> update_time = std::chrono::steady_clock::now() - update_start;
+                std::cerr << "Frame " << frame << ": scene " << (rebuilt ? "rebuilt" : "refit") << " in "
+                          << update_time.count() << "s.\n";
             }
-            write_colour(std::cout, pixel_colour, samples_per_pixel);
         }
+
+        camera cam(frame_lookfrom, lookat, vup, vfov, aspect_ratio, aperture, dist_to_focus, 0.0, 1.0);
+
+        framebuffer image;
+        auto start = std::chrono::steady_clock::now();
+        render_stats stats;
+        if (checkpoint_path.empty()) {
+            stats = render.render(world, cam, background, image);
+        } else {
+            int samples_done = 0;
+            if (resume) {
+                samples_done = checkpoint.load(image);
+            } else if (checkpoint.create(checkpoint_path, settings, scene, scene_input, bake_noise)) {
+                image = framebuffer(settings.image_width, settings.image_height);
+                image.sample_counts.resize(image.pixels.size());
+            } else {
+                std::cerr << "ERROR: Could not create checkpoint file '" << checkpoint_path << "'.\n";
+                return 1;
+            }
+
+            // passes of pass_samples samples; a checkpoint is saved once checkpoint_interval has passed since the
+            // last one, and after the final pass
+            auto last_save = std::chrono::steady_clock::now();
+            while (samples_done < settings.samples_per_pixel) {
+                int samples = std::min(pass_samples, settings.samples_per_pixel - samples_done);
+                stats += render.render_pass(world, cam, background, image, samples_done, samples);
+                samples_done += samples;
+
+                std::chrono::duration<double> since_save = std::chrono::steady_clock::now() - last_save;
+                if (since_save.count() < checkpoint_interval && samples_done < settings.samples_per_pixel)
+                    continue;
+                if (!checkpoint.save(image, samples_done)) {
+                    std::cerr << "\nERROR: Could not save checkpoint file '" << checkpoint_path << "'.\n";
+                    return 1;
+                }
+                last_save = std::chrono::steady_clock::now();
+                std::cerr << "\rCheckpoint saved at " << samples_done << "/" << settings.samples_per_pixel
+                          << " samples per pixel.\n";
+
+                // the image so far, unless it goes to the standard output, which only takes the final image
+                if (frame_output != "-" && samples_done < settings.samples_per_pixel)
+                    writer.write(image, samples_done, frame_output, image_format_from_path(frame_output));
+            }
+            settings.samples_per_pixel = samples_done;
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+        std::cerr << "\nRendered in " << elapsed.count() << "s on " << pool.size() << " threads ("
+                  << simd_isa_name(active_simd_isa()) << ", " << integrator_name(settings.integrator) << ", "
+                  << (sizeof(real) == sizeof(float) ? "single" : "double") << " precision).\n";
+        if (stats.samples)
+            std::cerr << "Average path length " << stats.average_path_length() << " rays, "
+                      << 1e6 * elapsed.count() * pool.size() / stats.samples << " thread-us per sample.\n";
+        if (settings.adaptive)
+            std::cerr << "Adaptive sampling took " << static_cast<double>(stats.samples) / image.pixels.size()
+                      << " samples per pixel on average.\n";
+
+        if (denoise || !frame_aov.empty()) {
+            auto denoise_start = std::chrono::steady_clock::now();
+            render.render_features(world, cam, image);
+            if (!frame_aov.empty()) {
+                auto albedo = feature_image(image, image.albedo, [](const colour& c) { return c; });
+                writer.write(std::move(albedo), 1, frame_aov + "_albedo.pfm", image_format::pfm);
+                auto normal = feature_image(image, image.normal, [](const vec3& n) { return colour(n); });
+                writer.write(std::move(normal), 1, frame_aov + "_normal.pfm", image_format::pfm);
+                auto depth = feature_image(image, image.depth, [](double d) { return colour(d, d, d); });
+                writer.write(std::move(depth), 1, frame_aov + "_depth.pfm", image_format::pfm);
+            }
+            if (denoise)
+                denoiser(denoise_settings(), pool).denoise(image, settings.samples_per_pixel);
+
+            std::chrono::duration<double> denoise_time = std::chrono::steady_clock::now() - denoise_start;
+            std::cerr << (denoise ? "Denoised in " : "Feature buffers rendered in ") << denoise_time.count() << "s.\n";
+        }
+
+        if (!frame_heatmap.empty() && !image.sample_counts.empty())
+            writer.write(sample_heatmap(image, settings.samples_per_pixel), 1, frame_heatmap,
+                         image_format_from_path(frame_heatmap));
+        writer.write(std::move(image), settings.samples_per_pixel, frame_output, image_format_from_path(frame_output));
     }
-        std::cerr << "\nDone.\n";
+    if (!writer.wait())
+        return 1;
+    std::cerr << "Done.\n";
 }
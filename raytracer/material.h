@@ -3,23 +3,63 @@
 #define MATERIAL_H
 
 #include "raytracer.h"
+#include "hittable.h"
+#include "onb.h"
 #include "texture.h"
 
 // abstract class for materials
 // 1. produce a scattered ray (or say that the incident ray is absorbed)
 // 2. compute the attenuation of the scattered ray, if scattered
+// materials that scatter over a continuous range of directions also describe their distribution, so that
+// directions picked by other means (e.g. towards a light) can be weighed:
+// - scatter samples a direction
+// - pdf is the density over solid angle with which scatter picks a direction
+// - eval is the BSDF times the cosine for a direction, so the attenuation of a sampled direction is
+//   eval / pdf
+// materials that only scatter into a few discrete directions (mirrors, glass) have a pdf of 0 everywhere
+
+// the family a material belongs to
+// the wavefront integrator shades all hits on one family together, calling that family's scatter directly
+// instead of through the virtual function; only diffuse_light and other materials are asked for emission
+enum class material_kind {
+    lambertian,
+    metal,
+    dielectric,
+    diffuse_light,
+    isotropic,
+    other
+};
 
-struct hit_record;
+const int material_kind_count = 6;
 
 class material {
     public:
         virtual bool scatter(
-            const ray& r_in, const hit_record& rec, colour& attenuation, ray& scattered
+            const ray& r_in, const hit_record& rec, colour& attenuation, ray& scattered, pcg32& rng
         ) const = 0;
 
         virtual colour emitted(double u, double v, const point3& p) const {
             return {0,0,0};
         }
+
+        virtual double pdf(const ray& r_in, const hit_record& rec, const vec3& direction) const {
+            return 0;
+        }
+
+        // the colour of the surface without lighting, recorded for the denoiser; materials that pass light
+        // through or emit it are white
+        virtual colour base_colour(const hit_record& rec) const {
+            return {1,1,1};
+        }
+
+        virtual colour eval(const ray& r_in, const hit_record& rec, const vec3& direction) const {
+            return {0,0,0};
+        }
+
+        // subclasses of the materials below that change their behaviour must report other
+        virtual material_kind kind() const {
+            return material_kind::other;
+        }
 };
 
 class lambertian : public material {
@@ -28,40 +68,84 @@ class lambertian : public material {
         explicit lambertian(shared_ptr<texture> a) : albedo(a) {}
 
         virtual bool scatter(
-            const ray& r_in, const hit_record& rec, colour& attenuation, ray& scattered
+            const ray& r_in, const hit_record& rec, colour& attenuation, ray& scattered, pcg32& rng
         ) const override {
-            auto scatter_direction = rec.normal + random_unit_vector(); // lambertian diffuse
-            //auto scatter_direction = random_in_hemisphere(rec.normal); // hemispherical scattering
-
-            // Catch degenerate scatter direction
-            if (scatter_direction.near_zero())
-                scatter_direction = rec.normal;
-
-            scattered = ray(rec.p, scatter_direction, r_in.time());
+            // lambertian diffuse: cosine weighted about the normal, which cancels the cosine of the BSDF
+            auto direction = onb::from_unit_w(rec.normal).local(random_cosine_direction(rng));
+            scattered = ray(rec.spawn_origin(direction), direction, r_in.time());
             attenuation = albedo->value(rec.u, rec.v, rec.p);
             return true;
         }
 
+        virtual double pdf(const ray& r_in, const hit_record& rec, const vec3& direction) const override {
+            auto cosine = dot(rec.normal, unit_vector(direction));
+            return cosine < 0 ? 0 : cosine / pi;
+        }
+
+        virtual colour eval(const ray& r_in, const hit_record& rec, const vec3& direction) const override {
+            return pdf(r_in, rec, direction) * albedo->value(rec.u, rec.v, rec.p);
+        }
+
+        virtual colour base_colour(const hit_record& rec) const override {
+            return albedo->value(rec.u, rec.v, rec.p);
+        }
+
+        virtual material_kind kind() const override {
+            return material_kind::lambertian;
+        }
+
     public:
         shared_ptr<texture> albedo;
 };
 
+// fuzzy reflection: directions about the mirror direction follow a Phong lobe cos^n, the analytic stand-in
+// for perturbing the mirror direction by a random point in a sphere of radius fuzz; for small angles both
+// spread the direction with a variance of fuzz^2 / 5 per axis, hence n = 5 / fuzz^2
+// directions below the surface are absorbed; within the lobe the attenuation is the albedo, i.e. eval is
+// the albedo times pdf above the surface
+// without fuzz the metal is a perfect mirror, with a pdf of 0
 class metal : public material {
     public:
-        metal(const colour& a, double f) : albedo(a), fuzz(f < 1 ? f : 1) {}
+        metal(const colour& a, double f)
+            : albedo(a), fuzz(f < 1 ? f : 1), exponent(fuzz > 0 ? 5 / (fuzz*fuzz) : 0) {}
 
         virtual bool scatter(
-            const ray& r_in, const hit_record& rec, colour& attenuation, ray& scattered
+            const ray& r_in, const hit_record& rec, colour& attenuation, ray& scattered, pcg32& rng
         ) const override {
             vec3 reflected = reflect(unit_vector(r_in.direction()), rec.normal);
-            scattered = ray(rec.p, reflected + fuzz*random_in_unit_sphere(), r_in.time());
+            if (fuzz > 0)
+                reflected = onb::from_unit_w(reflected).local(random_phong_direction(exponent, rng));
+            scattered = ray(rec.spawn_origin(reflected), reflected, r_in.time());
             attenuation = albedo;
             return (dot(scattered.direction(), rec.normal) > 0);
         }
 
+        virtual double pdf(const ray& r_in, const hit_record& rec, const vec3& direction) const override {
+            if (fuzz <= 0)
+                return 0;
+            vec3 reflected = reflect(unit_vector(r_in.direction()), rec.normal);
+            auto cosine = dot(reflected, unit_vector(direction));
+            return cosine <= 0 ? 0 : (exponent + 1) / (2*pi) * pow(cosine, exponent);
+        }
+
+        virtual colour eval(const ray& r_in, const hit_record& rec, const vec3& direction) const override {
+            if (dot(direction, rec.normal) <= 0)
+                return {0,0,0};
+            return pdf(r_in, rec, direction) * albedo;
+        }
+
+        virtual colour base_colour(const hit_record& rec) const override {
+            return albedo;
+        }
+
+        virtual material_kind kind() const override {
+            return material_kind::metal;
+        }
+
     public:
         colour albedo;
         double fuzz;
+        double exponent; // of the Phong lobe
 };
 
 class dielectric : public material {
@@ -69,7 +153,7 @@ class dielectric : public material {
         explicit dielectric(double index_of_refraction) : ir(index_of_refraction) {}
 
         virtual bool scatter(
-            const ray& r_in, const hit_record& rec, colour& attenuation, ray& scattered
+            const ray& r_in, const hit_record& rec, colour& attenuation, ray& scattered, pcg32& rng
         ) const override {
             attenuation = colour(1.0, 1.0, 1.0);
             double refraction_ratio = rec.front_face ? (1.0/ir) : ir;
@@ -81,15 +165,19 @@ class dielectric : public material {
             bool cannot_refract = refraction_ratio * sin_theta > 1.0;
             vec3 direction;
 
-            if (cannot_refract || reflectance(cos_theta, refraction_ratio) > random_double())
+            if (cannot_refract || reflectance(cos_theta, refraction_ratio) > random_double(rng))
                 direction = reflect(unit_direction, rec.normal);
             else
                 direction = refract(unit_direction, rec.normal, refraction_ratio);
 
-            scattered = ray(rec.p, direction, r_in.time());
+            scattered = ray(rec.spawn_origin(direction), direction, r_in.time());
             return true;
         }
 
+        virtual material_kind kind() const override {
+            return material_kind::dielectric;
+        }
+
     public:
         double ir; // index of refraction
 
@@ -109,7 +197,7 @@ class diffuse_light : public material {
         explicit diffuse_light(colour c) : emit(make_shared<solid_colour>(c)) {}
 
         virtual bool scatter(
-            const ray& r_in, const hit_record& rec, colour& attenuation, ray& scattered
+            const ray& r_in, const hit_record& rec, colour& attenuation, ray& scattered, pcg32& rng
         ) const override {
             return false;
         }
@@ -118,6 +206,10 @@ class diffuse_light : public material {
             return emit->value(u, v, p);
         }
 
+        virtual material_kind kind() const override {
+            return material_kind::diffuse_light;
+        }
+
     public:
         shared_ptr<texture> emit;
 };
@@ -129,13 +221,30 @@ class isotropic : public material {
         explicit isotropic(shared_ptr<texture> a) : albedo(a) {}
 
         virtual bool scatter(
-            const ray& r_in, const hit_record& rec, colour& attenuation, ray& scattered
+            const ray& r_in, const hit_record& rec, colour& attenuation, ray& scattered, pcg32& rng
         ) const override {
-            scattered = ray(rec.p, random_in_unit_sphere(), r_in.time());
+            auto direction = random_unit_vector(rng);
+            scattered = ray(rec.spawn_origin(direction), direction, r_in.time());
             attenuation = albedo->value(rec.u, rec.v, rec.p);
             return true;
         }
 
+        virtual double pdf(const ray& r_in, const hit_record& rec, const vec3& direction) const override {
+            return 1 / (4*pi);
+        }
+
+        virtual colour eval(const ray& r_in, const hit_record& rec, const vec3& direction) const override {
+            return albedo->value(rec.u, rec.v, rec.p) / (4*pi);
+        }
+
+        virtual colour base_colour(const hit_record& rec) const override {
+            return albedo->value(rec.u, rec.v, rec.p);
+        }
+
+        virtual material_kind kind() const override {
+            return material_kind::isotropic;
+        }
+
     public:
         shared_ptr<texture> albedo;
 };
@@ -0,0 +1,285 @@
+#ifndef MOTION_BVH_H
+#define MOTION_BVH_H
+
+#include "raytracer.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "bvh.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <vector>
+
+// bvh over moving objects
+// a bvh built over shutter-wide boxes gives a fast moving object one long box that every ray tests, whatever
+// its time; a motion bvh instead stores every node's box at a few key times across the shutter (its open and
+// close, and the ends of the segments in between when asked for more than one) and traversal interpolates the
+// box of each node to the ray's time before the slab test
+// between two keys the boxes move linearly, so objects must move linearly within a segment (as moving_sphere
+// does over the whole shutter) for the interpolated box to contain them; the node box at a key is the union
+// of its children's boxes at that key, which contains the interpolated children in between
+// the tree itself is built over the boxes at the middle of the shutter, and its nodes are then given the key
+// boxes bottom up; the traversals are those of bvh_tree, reading nodes through the interpolation
+// the keys are set once, a motion bvh is rebuilt rather than refit
+
+// a node box at one key time
+struct motion_bvh_key {
+    float bounds_min[3];
+    float bounds_max[3];
+};
+
+// a wide node over one segment: its children's boxes at the segment's start and how far they move until its end
+template <int N>
+struct motion_wide_node {
+    wide_bvh_node<N> start;
+    float motion[6][N];
+};
+
+class motion_bvh : public bvh_tree<object_primitives> {
+    public:
+        // segments is the number of linear pieces the shutter [time0, time1] is split into
+        motion_bvh(const hittable_list& list, double time0, double time1, int segments = 1,
+                   thread_pool* pool = nullptr);
+
+        virtual bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const override;
+        // the rays of a packet may be at different times, they are traced one by one
+        virtual int hit_packet(
+            const ray_packet& packet, int mask, real t_min, real* t_max, hit_record* recs
+        ) const override {
+            return hittable::hit_packet(packet, mask, t_min, t_max, recs);
+        }
+
+    private:
+        // the keys are set once, so the refit and update of bvh_tree, which only move the stored boxes, would
+        // leave them stale
+        void refit(double time0, double time1, thread_pool* pool = nullptr) = delete;
+        bool update(double time0, double time1, thread_pool* pool = nullptr, double rebuild_ratio = 1.3) = delete;
+
+        void set_keys();
+
+        template <int N>
+        uint32_t collapse_keys(std::vector<motion_wide_node<N>>& wide, uint32_t index) const;
+
+        // the segment the time falls in and how far into it, rays outside the shutter take its nearest end
+        void locate(double time, int& segment, float& f) const;
+
+        bool hit_sse(const ray& r, real t_min, real t_max, hit_record& rec) const;
+        bool hit_avx2(const ray& r, real t_min, real t_max, hit_record& rec) const;
+
+    public:
+        double time0, time1;
+        int segments;
+
+        // the boxes of node i are keys[i * (segments + 1) + k], k = 0 ... segments
+        std::vector<motion_bvh_key> keys;
+        // wide node i over segment s is at index i * segments + s
+        std::vector<motion_wide_node<4>> keys4;
+        std::vector<motion_wide_node<8>> keys8;
+};
+
+// binary nodes at one time: the stored node with its box interpolated
+struct interpolated_nodes {
+    const linear_bvh_node& operator()(uint32_t index) const {
+        const auto& a = keys[index * key_count + segment];
+        const auto& b = keys[index * key_count + segment + 1];
+        current = nodes[index];
+        for (int i = 0; i < 3; i++) {
+            current.bounds_min[i] = a.bounds_min[i] + f * (b.bounds_min[i] - a.bounds_min[i]);
+            current.bounds_max[i] = a.bounds_max[i] + f * (b.bounds_max[i] - a.bounds_max[i]);
+        }
+        return current;
+    }
+
+    const buffer<linear_bvh_node>& nodes;
+    const std::vector<motion_bvh_key>& keys;
+    int key_count;
+    int segment;
+    float f;
+    mutable linear_bvh_node current;
+};
+
+// wide nodes at one time
+template <int N>
+struct interpolated_wide_nodes {
+    const wide_bvh_node<N>& operator()(uint32_t index) const {
+        const auto& node = wide[index * segments + segment];
+        // a flat loop over the boxes of all children, which the compiler turns into SIMD
+        const float* start = &node.start.bounds[0][0];
+        const float* motion = &node.motion[0][0];
+        float* bounds = &current.bounds[0][0];
+        for (int i = 0; i < 6 * N; i++)
+            bounds[i] = start[i] + f * motion[i];
+        std::memcpy(current.child, node.start.child, sizeof(current.child));
+        std::memcpy(current.count, node.start.count, sizeof(current.count));
+        return current;
+    }
+
+    const std::vector<motion_wide_node<N>>& wide;
+    int segments;
+    int segment;
+    float f;
+    mutable wide_bvh_node<N> current;
+};
+
+motion_bvh::motion_bvh(const hittable_list& list, double time0, double time1, int segments, thread_pool* pool)
+    : time0(time0), time1(time1), segments(std::max(1, segments))
+{
+    primitives.objects = list.objects;
+    auto middle = 0.5 * (time0 + time1);
+    build_binary_tree(middle, middle, pool);
+    if (nodes.empty())
+        return;
+
+    set_keys();
+
+    // the box of the whole tree covers the shutter, for the trees and lists above this one
+    auto key_count = this->segments + 1;
+    box = empty_box();
+    for (int k = 0; k < key_count; k++) {
+        const auto& key = keys[k];
+        grow(box, point3(key.bounds_min[0], key.bounds_min[1], key.bounds_min[2]),
+             point3(key.bounds_max[0], key.bounds_max[1], key.bounds_max[2]));
+    }
+
+    if (nodes[0].count == 0) {
+        isa = active_simd_isa();
+        if (isa == simd_isa::avx2)
+            collapse_keys(keys8, 0);
+        else if (isa == simd_isa::sse)
+            collapse_keys(keys4, 0);
+    }
+}
+
+void motion_bvh::set_keys() {
+    auto key_count = segments + 1;
+    std::vector<aabb> boxes(nodes.size() * key_count, empty_box());
+
+    // children follow their parents in the node array, so walking it backwards visits children first
+    for (auto i = nodes.size(); i-- > 0;) {
+        const auto& node = nodes[i];
+        for (int k = 0; k < key_count; k++) {
+            auto& node_box = boxes[i * key_count + k];
+            if (node.count > 0) {
+                auto time = time0 + (time1 - time0) * k / segments;
+                for (uint32_t p = node.offset; p < node.offset + node.count; ++p)
+                    grow(node_box, primitives.bounds(p, time, time));
+            } else {
+                grow(node_box, boxes[(i + 1) * key_count + k]);
+                grow(node_box, boxes[node.offset * key_count + k]);
+            }
+        }
+    }
+
+    // interpolating in single precision rounds by up to a few units in the last place of the larger key, so
+    // the keys are widened by that much on top of rounding them outwards
+    keys.resize(boxes.size());
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        for (int a = 0; a < 3; a++) {
+            double largest = 0;
+            for (int k = 0; k < key_count; k++) {
+                const auto& node_box = boxes[i * key_count + k];
+                largest = fmax(largest, fmax(fabs(node_box.min()[a]), fabs(node_box.max()[a])));
+            }
+            auto slack = 4 * std::numeric_limits<float>::epsilon() * largest;
+            for (int k = 0; k < key_count; k++) {
+                const auto& node_box = boxes[i * key_count + k];
+                keys[i * key_count + k].bounds_min[a] = round_down(node_box.min()[a] - slack);
+                keys[i * key_count + k].bounds_max[a] = round_up(node_box.max()[a] + slack);
+            }
+        }
+    }
+}
+
+// collapse the binary subtree at nodes[index] into the segments of a wide node, returning the wide node's index
+template <int N>
+uint32_t motion_bvh::collapse_keys(std::vector<motion_wide_node<N>>& wide, uint32_t index) const {
+    auto key_count = segments + 1;
+    auto wide_index = static_cast<uint32_t>(wide.size() / segments);
+    wide.resize(wide.size() + segments);
+
+    uint32_t children[N];
+    int child_count = wide_node_children<N>(nodes, index, children);
+
+    uint32_t child_index[N];
+    for (int i = 0; i < child_count; i++) {
+        const auto& child = nodes[children[i]];
+        child_index[i] = child.count > 0 ? child.offset : collapse_keys(wide, children[i]);
+    }
+
+    for (int s = 0; s < segments; s++) {
+        // empty slots get the largest finite inverted box, which does not move, instead of an infinite one,
+        // whose motion (infinity - infinity) would be NaN and pass the slab test
+        motion_wide_node<N> node;
+        clear_wide_node(node.start);
+        for (int i = 0; i < N; i++) {
+            for (int a = 0; a < 3; a++) {
+                node.start.bounds[a][i] = std::numeric_limits<float>::max();
+                node.start.bounds[a + 3][i] = -std::numeric_limits<float>::max();
+                node.motion[a][i] = 0;
+                node.motion[a + 3][i] = 0;
+            }
+        }
+        for (int i = 0; i < child_count; i++) {
+            const auto& from = keys[children[i] * key_count + s];
+            const auto& to = keys[children[i] * key_count + s + 1];
+            for (int a = 0; a < 3; a++) {
+                node.start.bounds[a][i] = from.bounds_min[a];
+                node.start.bounds[a + 3][i] = from.bounds_max[a];
+                node.motion[a][i] = to.bounds_min[a] - from.bounds_min[a];
+                node.motion[a + 3][i] = to.bounds_max[a] - from.bounds_max[a];
+            }
+            node.start.child[i] = child_index[i];
+            node.start.count[i] = nodes[children[i]].count;
+        }
+        wide[wide_index * segments + s] = node;
+    }
+
+    return wide_index;
+}
+
+void motion_bvh::locate(double time, int& segment, float& f) const {
+    auto s = time1 > time0 ? (time - time0) / (time1 - time0) * segments : 0.0;
+    s = s < 0 ? 0 : (s > segments ? segments : s);
+    segment = std::min(static_cast<int>(s), segments - 1);
+    f = static_cast<float>(s - segment);
+}
+
+bool motion_bvh::hit(const ray& r, real t_min, real t_max, hit_record& rec) const {
+    if (nodes.empty())
+        return false;
+
+    switch (isa) {
+#ifdef RAYTRACER_X86_SIMD
+        case simd_isa::avx2:
+            return hit_avx2(r, t_min, t_max, rec);
+        case simd_isa::sse:
+            return hit_sse(r, t_min, t_max, rec);
+#endif
+        default: {
+            interpolated_nodes node_at{nodes, keys, segments + 1, 0, 0, {}};
+            locate(r.time(), node_at.segment, node_at.f);
+            return hit_binary(node_at, r, t_min, t_max, rec);
+        }
+    }
+}
+
+#ifdef RAYTRACER_X86_SIMD
+
+bool motion_bvh::hit_sse(const ray& r, real t_min, real t_max, hit_record& rec) const {
+    interpolated_wide_nodes<4> node_at{keys4, segments, 0, 0, {}};
+    locate(r.time(), node_at.segment, node_at.f);
+    return hit_wide<4, wide_kernel_sse>(node_at, r, t_min, t_max, rec);
+}
+
+RAYTRACER_TARGET_AVX2
+bool motion_bvh::hit_avx2(const ray& r, real t_min, real t_max, hit_record& rec) const {
+    interpolated_wide_nodes<8> node_at{keys8, segments, 0, 0, {}};
+    locate(r.time(), node_at.segment, node_at.f);
+    return hit_wide<8, wide_kernel_avx2>(node_at, r, t_min, t_max, rec);
+}
+
+#endif // RAYTRACER_X86_SIMD
+
+#endif // MOTION_BVH_H
@@ -5,6 +5,7 @@
 #include "hittable.h"
 #include "raytracer.h"
 #include "aabb.h"
+#include "sphere.h"
 
 class moving_sphere: public hittable {
     public:
@@ -13,7 +14,7 @@ class moving_sphere: public hittable {
                 point3 cen0, point3 cen1, double _time0, double _time1, double r, shared_ptr<material> m
             ) : center0(cen0), center1(cen1), time0(_time0), time1(_time1), radius(r), mat_ptr(m) {};
 
-        virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+        virtual bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const override;
         virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
 
         point3 center(double time) const;
@@ -29,30 +30,17 @@ point3 moving_sphere::center(double time) const {
     return center0 + ((time - time0) / (time1 - time0)) * (center1 - center0);
 }
 
-bool moving_sphere::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
-    vec3 oc = r.origin() - center(r.time());
-    auto a = r.direction().length_squared();
-    auto half_b = dot(oc, r.direction());
-    auto c = oc.length_squared() - radius*radius;
-
-    auto discriminant = half_b*half_b - a*c;
-    if (discriminant < 0)
+bool moving_sphere::hit(const ray& r, real t_min, real t_max, hit_record& rec) const {
+    auto current = center(r.time());
+    double root;
+    if (!hit_sphere(current, radius, r, t_min, t_max, root))
         return false;
-    auto sqrtd = sqrt(discriminant);
-
-    // find the nearest root that lies in the acceptable range
-    auto root = (-half_b - sqrtd) / a;
-    if (root < t_min || t_max < root) {
-        root = (-half_b + sqrtd) / a;
-        if (root < t_min || t_max < root)
-            return false;
-    }
 
     rec.t = root;
-    rec.p = r.at(rec.t);
-    vec3 outward_normal = (rec.p - center(r.time())) / radius;
+    set_sphere_point(current, radius, r.at(rec.t), rec);
+    vec3 outward_normal = (rec.p - current) / radius;
     rec.set_face_normal(r, outward_normal);
-    rec.mat_ptr = mat_ptr;
+    rec.mat_ptr = mat_ptr.get();
 
     return true;
 }
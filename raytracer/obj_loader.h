@@ -0,0 +1,229 @@
+#ifndef OBJ_LOADER_H
+#define OBJ_LOADER_H
+
+#include "triangle_mesh.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Wavefront OBJ meshes
+// the file is read line by line and never held in memory as a whole: positions (v), texture coordinates (vt)
+// and normals (vn) are collected as they come, and every face (f) is split into a fan of triangles right away
+// OBJ indexes the three attributes of a corner separately, while a mesh indexes whole vertices, so every
+// distinct combination of attribute indices becomes one mesh vertex
+// other statements (groups, materials, lines, ...) are skipped; the mesh gets one material
+
+struct obj_corner {
+    int64_t v;
+    int64_t vt;
+    int64_t vn;
+
+    bool operator==(const obj_corner& other) const {
+        return v == other.v && vt == other.vt && vn == other.vn;
+    }
+};
+
+struct obj_corner_hash {
+    size_t operator()(const obj_corner& c) const {
+        return static_cast<size_t>(c.v * 73856093) ^ static_cast<size_t>(c.vt * 19349663) ^
+               static_cast<size_t>(c.vn * 83492791);
+    }
+};
+
+// state of one OBJ read
+class obj_reader {
+    public:
+        bool read(const std::string& path, mesh_vertices& vertices, std::vector<uint32_t>& indices);
+
+    private:
+        void read_face(const char* s);
+        bool parse_corner(const char*& s, obj_corner& corner) const;
+        uint32_t vertex(const obj_corner& corner);
+
+    private:
+        std::vector<double> positions;
+        std::vector<double> texcoords;
+        std::vector<double> normals;
+        std::unordered_map<obj_corner, uint32_t, obj_corner_hash> vertex_of_corner;
+        std::vector<obj_corner> face;
+
+        mesh_vertices* out = nullptr;
+        std::vector<uint32_t>* out_indices = nullptr;
+        size_t bad_faces = 0;
+};
+
+// reads the triangles of an OBJ file, false if it cannot be read or holds no triangles
+inline bool read_obj(const std::string& path, mesh_vertices& vertices, std::vector<uint32_t>& indices) {
+    return obj_reader().read(path, vertices, indices);
+}
+
+// reads up to count numbers separated by white space from s, returning how many were read
+inline int parse_numbers(const char* s, double* values, int count) {
+    int n = 0;
+    while (n < count) {
+        char* end;
+        auto value = std::strtod(s, &end);
+        if (end == s)
+            break;
+        values[n++] = value;
+        s = end;
+    }
+    return n;
+}
+
+bool obj_reader::read(const std::string& path, mesh_vertices& vertices, std::vector<uint32_t>& indices) {
+    FILE* file = std::fopen(path.c_str(), "r");
+    if (!file) {
+        std::cerr << "Cannot open " << path << ".\n";
+        return false;
+    }
+
+    vertices = mesh_vertices();
+    indices.clear();
+    out = &vertices;
+    out_indices = &indices;
+
+    std::vector<char> buffer(1 << 16);
+    std::string line;
+    while (std::fgets(buffer.data(), static_cast<int>(buffer.size()), file)) {
+        line += buffer.data();
+        if (line.back() != '\n' && !std::feof(file))
+            continue;
+
+        const char* s = line.c_str();
+        while (*s == ' ' || *s == '\t')
+            ++s;
+
+        double values[3];
+        if (s[0] == 'v' && (s[1] == ' ' || s[1] == '\t')) {
+            if (parse_numbers(s + 2, values, 3) == 3)
+                positions.insert(positions.end(), values, values + 3);
+        } else if (s[0] == 'v' && s[1] == 't' && (s[2] == ' ' || s[2] == '\t')) {
+            // a missing v coordinate is 0
+            values[1] = 0;
+            if (parse_numbers(s + 3, values, 2) >= 1)
+                texcoords.insert(texcoords.end(), values, values + 2);
+        } else if (s[0] == 'v' && s[1] == 'n' && (s[2] == ' ' || s[2] == '\t')) {
+            if (parse_numbers(s + 3, values, 3) == 3)
+                normals.insert(normals.end(), values, values + 3);
+        } else if (s[0] == 'f' && (s[1] == ' ' || s[1] == '\t')) {
+            read_face(s + 2);
+        }
+        line.clear();
+    }
+    std::fclose(file);
+
+    if (bad_faces > 0)
+        std::cerr << "Skipped " << bad_faces << " faces with missing vertices in " << path << ".\n";
+
+    // attributes that only some corners have are dropped, the mesh needs them on every vertex
+    if (vertices.u.size() != vertices.size()) {
+        vertices.u.clear();
+        vertices.v.clear();
+    }
+    if (vertices.nx.size() != vertices.size()) {
+        vertices.nx.clear();
+        vertices.ny.clear();
+        vertices.nz.clear();
+    }
+
+    if (indices.empty()) {
+        std::cerr << "No triangles in " << path << ".\n";
+        return false;
+    }
+    return true;
+}
+
+// a corner is v, v/vt, v//vn or v/vt/vn; indices count from 1, negative ones count back from the last
+// attribute read so far
+bool obj_reader::parse_corner(const char*& s, obj_corner& corner) const {
+    auto resolve = [](long long index, size_t count) -> int64_t {
+        if (index > 0)
+            return index <= static_cast<long long>(count) ? index - 1 : -1;
+        if (index < 0)
+            return -index <= static_cast<long long>(count) ? static_cast<int64_t>(count) + index : -1;
+        return -1;
+    };
+
+    char* end;
+    auto v = std::strtoll(s, &end, 10);
+    if (end == s)
+        return false;
+    s = end;
+
+    corner.v = resolve(v, positions.size() / 3);
+    corner.vt = -1;
+    corner.vn = -1;
+    if (*s == '/') {
+        ++s;
+        if (*s != '/') {
+            corner.vt = resolve(std::strtoll(s, &end, 10), texcoords.size() / 2);
+            s = end;
+        }
+        if (*s == '/') {
+            ++s;
+            corner.vn = resolve(std::strtoll(s, &end, 10), normals.size() / 3);
+            s = end;
+        }
+    }
+    return true;
+}
+
+void obj_reader::read_face(const char* s) {
+    // the whole face is checked before any of its corners becomes a vertex
+    face.clear();
+    bool valid = true;
+    obj_corner corner;
+    while (parse_corner(s, corner)) {
+        valid = valid && corner.v >= 0;
+        face.push_back(corner);
+    }
+
+    if (!valid || face.size() < 3) {
+        ++bad_faces;
+        return;
+    }
+
+    auto first = vertex(face[0]);
+    auto previous = vertex(face[1]);
+    for (size_t i = 2; i < face.size(); ++i) {
+        auto next = vertex(face[i]);
+        out_indices->push_back(first);
+        out_indices->push_back(previous);
+        out_indices->push_back(next);
+        previous = next;
+    }
+}
+
+uint32_t obj_reader::vertex(const obj_corner& corner) {
+    auto found = vertex_of_corner.find(corner);
+    if (found != vertex_of_corner.end())
+        return found->second;
+
+    auto index = static_cast<uint32_t>(out->size());
+    vertex_of_corner.emplace(corner, index);
+
+    out->x.push_back(positions[3*corner.v]);
+    out->y.push_back(positions[3*corner.v + 1]);
+    out->z.push_back(positions[3*corner.v + 2]);
+
+    // a corner without a texture coordinate or normal leaves its array short, which drops the attribute
+    if (corner.vt >= 0 && out->u.size() == index) {
+        out->u.push_back(texcoords[2*corner.vt]);
+        out->v.push_back(texcoords[2*corner.vt + 1]);
+    }
+    if (corner.vn >= 0 && out->nx.size() == index) {
+        out->nx.push_back(normals[3*corner.vn]);
+        out->ny.push_back(normals[3*corner.vn + 1]);
+        out->nz.push_back(normals[3*corner.vn + 2]);
+    }
+
+    return index;
+}
+
+#endif // OBJ_LOADER_H
@@ -0,0 +1,53 @@
+#ifndef ONB_H
+#define ONB_H
+
+#include "vec3.h"
+
+// orthonormal basis with its w axis along a given direction
+// directions sampled around the z axis (e.g. over a hemisphere or a cone) are turned into directions
+// around w with local()
+
+class onb {
+    public:
+        onb() {}
+        explicit onb(const vec3& w) { build_from_w(w); }
+
+        vec3 u() const { return axis[0]; }
+        vec3 v() const { return axis[1]; }
+        vec3 w() const { return axis[2]; }
+
+        vec3 local(double a, double b, double c) const {
+            return a*u() + b*v() + c*w();
+        }
+
+        vec3 local(const vec3& a) const {
+            return a.x()*u() + a.y()*v() + a.z()*w();
+        }
+
+        void build_from_w(const vec3& n) {
+            axis[2] = unit_vector(n);
+            // any vector not parallel to w will do for the cross product
+            vec3 a = (fabs(w().x()) > 0.9) ? vec3(0,1,0) : vec3(1,0,0);
+            axis[1] = unit_vector(cross(w(), a));
+            axis[0] = cross(w(), v());
+        }
+
+        // the same for a w that is already unit length, without normalising or branching (Duff et al.,
+        // "Building an Orthonormal Basis, Revisited", 2017); used for every bounce off a surface
+        static onb from_unit_w(const vec3& n) {
+            auto sign = std::copysign(1.0, n.z());
+            auto a = -1 / (sign + n.z());
+            auto b = n.x() * n.y() * a;
+
+            onb basis;
+            basis.axis[0] = vec3(1 + sign * n.x() * n.x() * a, sign * b, -sign * n.x());
+            basis.axis[1] = vec3(b, sign + n.y() * n.y() * a, -n.y());
+            basis.axis[2] = n;
+            return basis;
+        }
+
+    public:
+        vec3 axis[3];
+};
+
+#endif // ONB_H
@@ -1,31 +1,74 @@
-
 #ifndef PERLIN_H
 #define PERLIN_H
 
 #include "raytracer.h"
+#include "aabb.h"
+#include "simd.h"
+#include "thread_pool.h"
 
-class perlin {
-    public:
-        perlin() {
-            ranvec = new vec3[point_count];
-            for (int i = 0; i < point_count; ++i) {
-                ranvec[i] = unit_vector(vec3::random(-1, 1));
-            }
+#include <algorithm>
+#include <vector>
 
-            perm_x = perlin_generate_perm();
-            perm_y = perlin_generate_perm();
-            perm_z = perlin_generate_perm();
+// perlin noise
+// every noise texture reads one table of gradients and permutations, made once, from a generator of its own so
+// it is the same whenever it is first used; at 9KB it stays in the cache however many textures there are
+// noise and turbulence are computed in double precision whatever the precision of the geometry, and on AVX2 the
+// octaves of the turbulence are computed four at a time, finding the same values as the scalar code
+
+struct perlin_table {
+    static const int point_count = 256;
+
+    perlin_table() {
+        pcg32 rng(0x5045524c494eULL);
+        for (int i = 0; i < point_count; ++i) {
+            // drawn one coordinate after another, the order of function arguments being unspecified
+            auto x = random_double(rng, -1, 1);
+            auto y = random_double(rng, -1, 1);
+            auto z = random_double(rng, -1, 1);
+            auto g = unit_vector(vec3_t<double>(x, y, z));
+            gradient_x[i] = g.x();
+            gradient_y[i] = g.y();
+            gradient_z[i] = g.z();
         }
 
-        ~perlin() {
-            delete[] ranvec;
-            delete[] perm_x;
-            delete[] perm_y;
-            delete[] perm_z;
+        generate_perm(rng, perm_x);
+        generate_perm(rng, perm_y);
+        generate_perm(rng, perm_z);
+    }
+
+    // unit gradient vectors, attribute by attribute so four of them load into SIMD lanes
+    double gradient_x[point_count];
+    double gradient_y[point_count];
+    double gradient_z[point_count];
+    int perm_x[point_count];
+    int perm_y[point_count];
+    int perm_z[point_count];
+
+    private:
+        // a random permutation, made by swapping each element from the last with a random one before it
+        static void generate_perm(pcg32& rng, int* p) {
+            for (int i = 0; i < point_count; ++i)
+                p[i] = i;
+            for (int i = point_count-1; i > 0; --i) {
+                int target = static_cast<int>(random_double(rng, 0, i+1));
+                std::swap(p[i], p[target]);
+            }
         }
+};
+
+inline const perlin_table& shared_perlin_table() {
+    static const perlin_table table;
+    return table;
+}
+
+class perlin {
+    public:
+        perlin() : table(&shared_perlin_table()) {}
 
         // linearly interpolate to smooth out the blocky texture
-        double noise(const point3& p) const {
+        template <typename T>
+        double noise(const vec3_t<T>& point) const {
+            auto p = vec3_t<double>(point);
             auto u = p.x() - floor(p.x());
             auto v = p.y() - floor(p.y());
             auto w = p.z() - floor(p.z());
@@ -33,24 +76,40 @@ class perlin {
             auto i = static_cast<int>(floor(p.x()));
             auto j = static_cast<int>(floor(p.y()));
             auto k = static_cast<int>(floor(p.z()));
-            vec3 c[2][2][2];
 
+            const auto& t = *table;
+            int px[2] = {t.perm_x[i & 255], t.perm_x[(i+1) & 255]};
+            int py[2] = {t.perm_y[j & 255], t.perm_y[(j+1) & 255]};
+            int pz[2] = {t.perm_z[k & 255], t.perm_z[(k+1) & 255]};
+
+            // hermite cubic weights of the two lattice points along each axis
+            auto uu = u*u*(3-2*u);
+            auto vv = v*v*(3-2*v);
+            auto ww = w*w*(3-2*w);
+            double weight_u[2] = {1-uu, uu}, weight_v[2] = {1-vv, vv}, weight_w[2] = {1-ww, ww};
+            double offset_u[2] = {u, u-1}, offset_v[2] = {v, v-1}, offset_w[2] = {w, w-1};
+
+            auto accum = 0.0;
             for (int di = 0; di < 2; ++di)
                 for (int dj = 0; dj < 2; ++dj)
-                    for (int dk = 0; dk < 2; ++dk)
-                        c[di][dj][dk] = ranvec[
-                            perm_x[(i+di) & 255] ^
-                            perm_y[(j+dj) & 255] ^
-                            perm_z[(k+dk) & 255]
-                        ];
-
-            return perlin_interp(c, u, v, w);
+                    for (int dk = 0; dk < 2; ++dk) {
+                        auto h = px[di] ^ py[dj] ^ pz[dk];
+                        auto dot = t.gradient_x[h]*offset_u[di] + t.gradient_y[h]*offset_v[dj] +
+                                   t.gradient_z[h]*offset_w[dk];
+                        accum += weight_u[di]*weight_v[dj]*weight_w[dk]*dot;
+                    }
+
+            return accum;
         }
 
         // turbulance: a composite noise with multiple summed frequencies
         double turb(const point3& p, int depth=7) const {
+#ifdef RAYTRACER_X86_SIMD
+            if (active_simd_isa() == simd_isa::avx2)
+                return turb_avx2(vec3_t<double>(p), depth);
+#endif
             auto accum = 0.0;
-            auto temp_p = p;
+            auto temp_p = vec3_t<double>(p);
             auto weight = 1.0;
 
             for (int i = 0; i < depth; ++i) {
@@ -63,50 +122,172 @@ class perlin {
         }
 
     private:
-        static const int point_count = 256;
-        vec3* ranvec;
-        int* perm_x;
-        int* perm_y;
-        int* perm_z;
-
-        static int* perlin_generate_perm() {
-            int* p = new int[point_count];
-            for (int i = 0; i < perlin::point_count; ++i) {
-                p[i] = i;
+#ifdef RAYTRACER_X86_SIMD
+        void noise4_avx2(const __m256d p[3], double* out) const;
+        double turb_avx2(vec3_t<double> p, int depth) const;
+#endif
+
+        const perlin_table* table;
+};
+
+#ifdef RAYTRACER_X86_SIMD
+
+// the noise at four points, one per lane, with the operations of noise in the same order
+RAYTRACER_TARGET_AVX2
+void perlin::noise4_avx2(const __m256d p[3], double* out) const {
+    const auto& t = *table;
+    const __m256d one = _mm256_set1_pd(1);
+    const __m256d three = _mm256_set1_pd(3);
+    const __m128i mask = _mm_set1_epi32(255);
+    const int* perms[3] = {t.perm_x, t.perm_y, t.perm_z};
+
+    __m256d offset[3][2], weight[3][2];
+    __m128i perm[3][2];
+    for (int a = 0; a < 3; a++) {
+        auto f = _mm256_floor_pd(p[a]);
+        auto frac = _mm256_sub_pd(p[a], f);
+        auto cell = _mm256_cvttpd_epi32(f);
+        perm[a][0] = _mm_i32gather_epi32(perms[a], _mm_and_si128(cell, mask), 4);
+        perm[a][1] = _mm_i32gather_epi32(perms[a], _mm_and_si128(_mm_add_epi32(cell, _mm_set1_epi32(1)), mask), 4);
+
+        auto smooth = _mm256_mul_pd(_mm256_mul_pd(frac, frac), _mm256_sub_pd(three, _mm256_add_pd(frac, frac)));
+        weight[a][0] = _mm256_sub_pd(one, smooth);
+        weight[a][1] = smooth;
+        offset[a][0] = frac;
+        offset[a][1] = _mm256_sub_pd(frac, one);
+    }
+
+    __m256d accum = _mm256_setzero_pd();
+    for (int di = 0; di < 2; ++di)
+        for (int dj = 0; dj < 2; ++dj)
+            for (int dk = 0; dk < 2; ++dk) {
+                auto h = _mm_xor_si128(_mm_xor_si128(perm[0][di], perm[1][dj]), perm[2][dk]);
+                auto dot = _mm256_add_pd(
+                    _mm256_add_pd(_mm256_mul_pd(gather4_pd(t.gradient_x, h), offset[0][di]),
+                                  _mm256_mul_pd(gather4_pd(t.gradient_y, h), offset[1][dj])),
+                    _mm256_mul_pd(gather4_pd(t.gradient_z, h), offset[2][dk]));
+                auto w = _mm256_mul_pd(_mm256_mul_pd(weight[0][di], weight[1][dj]), weight[2][dk]);
+                accum = _mm256_add_pd(accum, _mm256_mul_pd(w, dot));
             }
-            permute(p, point_count);
-            return p;
+
+    _mm256_storeu_pd(out, accum);
+}
+
+// four octaves at a time, summed in order afterwards as turb sums them
+RAYTRACER_TARGET_AVX2
+double perlin::turb_avx2(vec3_t<double> p, int depth) const {
+    auto accum = 0.0;
+    auto weight = 1.0;
+
+    for (int base = 0; base < depth; base += 4) {
+        double octave[3][4];
+        for (int i = 0; i < 4; ++i) {
+            for (int a = 0; a < 3; a++)
+                octave[a][i] = p[a];
+            p *= 2;
         }
 
-        // generating a random permutation of the array by swapping the last element with a random element
-        static void permute(int* p, int n) {
-            for (int i = n-1; i > 0; --i) {
-                int target = random_int(0, i);
-                int tmp = p[i];
-                p[i] = p[target];
-                p[target] = tmp;
-            }
+        __m256d points[3] = {_mm256_loadu_pd(octave[0]), _mm256_loadu_pd(octave[1]), _mm256_loadu_pd(octave[2])};
+        double values[4];
+        noise4_avx2(points, values);
+
+        for (int i = 0; i < 4 && base + i < depth; ++i) {
+            accum += weight*values[i];
+            weight *= 0.5;
         }
+    }
 
-        static double perlin_interp(vec3 c[2][2][2], double u, double v, double w) {
-            auto uu = u*u*(3-2*u);
-            auto vv = v*v*(3-2*v);
-            auto ww = w*w*(3-2*w);
-            auto accum = 0.0;
+    return fabs(accum);
+}
+
+#endif // RAYTRACER_X86_SIMD
+
+// turbulence sampled on a grid over a box and read back with trilinear interpolation: eight lookups instead of
+// seven octaves of noise, at the cost of the detail finer than the grid
+// outside the box the turbulence is computed as usual, and so it is everywhere when the box is empty (flat along
+// an axis) or the resolution is not positive: such a grid holds no values
+// the grid holds at most max_points values; a finer resolution is lowered until it fits
+class turbulence_grid {
+    public:
+        static const size_t max_points = size_t(1) << 26;
+
+        turbulence_grid(const perlin& noise, const aabb& region, double cells_per_unit, thread_pool* pool = nullptr)
+            : noise(noise), region(region), cells{0, 0, 0}, spacing{0, 0, 0} {
+            double extent[3];
+            for (int a = 0; a < 3; a++) {
+                extent[a] = static_cast<double>(region.max()[a]) - region.min()[a];
+                if (!(extent[a] > 0 && extent[a] < infinity))
+                    return;
+            }
+            if (!(cells_per_unit > 0))
+                return;
 
-            for (int i = 0; i < 2; ++i)
-                for (int j = 0; j < 2; ++j)
-                    for (int k = 0; k < 2; ++k) {
-                        vec3 weight_v(u-i, v-j, w-k);
-                        accum += (i*uu + (1-i)*(1-uu))*
-                                 (j*vv + (1-j)*(1-vv))*
-                                 (k*ww + (1-k)*(1-ww))*dot(c[i][j][k], weight_v);
+            // the cell counts are found in double precision so an oversized resolution cannot overflow them
+            double count[3];
+            for (;;) {
+                for (int a = 0; a < 3; a++)
+                    count[a] = std::min(std::max(1.0, ceil(extent[a] * cells_per_unit)), double(max_points));
+                auto points = (count[0] + 1) * (count[1] + 1) * (count[2] + 1);
+                if (points <= max_points)
+                    break;
+                cells_per_unit *= std::min(0.9, cbrt(max_points / points));
+            }
+            for (int a = 0; a < 3; a++) {
+                cells[a] = static_cast<int>(count[a]);
+                spacing[a] = extent[a] / cells[a];
+            }
+            values.resize(static_cast<size_t>(cells[0] + 1) * (cells[1] + 1) * (cells[2] + 1));
+
+            auto bake_slice = [&](size_t k) {
+                for (int j = 0; j <= cells[1]; ++j)
+                    for (int i = 0; i <= cells[0]; ++i) {
+                        point3 p(region.min().x() + i*spacing[0], region.min().y() + j*spacing[1],
+                                 region.min().z() + k*spacing[2]);
+                        values[index(i, j, static_cast<int>(k))] = static_cast<float>(noise.turb(p));
                     }
+            };
+            if (pool)
+                pool->parallel_for(cells[2] + 1, bake_slice);
+            else
+                for (int k = 0; k <= cells[2]; ++k)
+                    bake_slice(k);
+        }
 
+        double turb(const point3& p) const {
+            int corner[3];
+            double t[3];
+            if (values.empty())
+                return noise.turb(p);
+            for (int a = 0; a < 3; a++) {
+                if (!(p[a] >= region.min()[a] && p[a] <= region.max()[a]))
+                    return noise.turb(p);
+                auto f = (p[a] - region.min()[a]) / spacing[a];
+                corner[a] = std::min(static_cast<int>(f), cells[a] - 1);
+                t[a] = f - corner[a];
+            }
+
+            auto accum = 0.0;
+            for (int di = 0; di < 2; ++di)
+                for (int dj = 0; dj < 2; ++dj)
+                    for (int dk = 0; dk < 2; ++dk) {
+                        auto w = (di ? t[0] : 1-t[0]) * (dj ? t[1] : 1-t[1]) * (dk ? t[2] : 1-t[2]);
+                        accum += w * values[index(corner[0] + di, corner[1] + dj, corner[2] + dk)];
+                    }
             return accum;
         }
 
-};
+        size_t size() const { return values.size(); }
 
+    private:
+        size_t index(int i, int j, int k) const {
+            return (static_cast<size_t>(k) * (cells[1] + 1) + j) * (cells[0] + 1) + i;
+        }
+
+        perlin noise;
+        aabb region;
+        int cells[3];
+        double spacing[3];
+        std::vector<float> values;
+};
 
 #endif // PERLIN_H
@@ -3,26 +3,97 @@
 
 #include "vec3.h"
 
-class ray {
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+
+template <typename T>
+class ray_t {
     public:
-        ray() {}
-        ray(const point3& origin, const vec3& direction, double time = 0.0)
+        ray_t() {}
+        ray_t(const vec3_t<T>& origin, const vec3_t<T>& direction, T time = 0)
             : orig(origin), dir(direction), tm(time)
         {}
 
-        point3 origin() const { return orig; }
-        vec3 direction() const { return dir; }
-        double time() const { return tm; }
+        vec3_t<T> origin() const { return orig; }
+        vec3_t<T> direction() const { return dir; }
+        T time() const { return tm; }
 
-        point3 at(double t) const {
+        vec3_t<T> at(T t) const {
             return orig + t*dir;
         }
 
     public:
-        point3 orig;
-        vec3 dir;
-        double tm;
+        vec3_t<T> orig;
+        vec3_t<T> dir;
+        T tm;
 };
 
+using ray = ray_t<real>;
+
+// the relative rounding error of one arithmetic operation in precision T
+template <typename T>
+constexpr T rounding_error() {
+    return std::numeric_limits<T>::epsilon() / 2;
+}
+
+// the largest absolute coordinate of p
+template <typename T>
+inline T max_magnitude(const vec3_t<T>& p) {
+    return std::max(std::fabs(p.x()), std::max(std::fabs(p.y()), std::fabs(p.z())));
+}
+
+// the bound on the rounding error of a hit point whose coordinates are about magnitude away from the origin,
+// for primitives that compute their hit points with a few operations on numbers of that size (see hit_record)
+template <typename T>
+inline T hit_error(T magnitude) {
+    return 16 * rounding_error<T>() * magnitude;
+}
+
+// the next representable numbers above and below v, as std::nextafter towards an infinity but inline: rays
+// are spawned at every bounce
+template <typename T, typename Bits>
+inline T next_up_bits(T v) {
+    if (v == std::numeric_limits<T>::infinity())
+        return v;
+    if (v == 0)
+        v = 0; // -0 becomes +0, whose successor is the smallest positive number
+    Bits bits;
+    std::memcpy(&bits, &v, sizeof(v));
+    bits = v >= 0 ? bits + 1 : bits - 1;
+    std::memcpy(&v, &bits, sizeof(v));
+    return v;
+}
+
+inline float next_up(float v) { return next_up_bits<float, uint32_t>(v); }
+inline double next_up(double v) { return next_up_bits<double, uint64_t>(v); }
+
+template <typename T>
+inline T next_down(T v) {
+    return -next_up(-v);
+}
+
+// the origin of a ray that leaves a surface: a hit point is only known to within error of the surface, so a ray
+// starting at it could hit the same surface again right away; instead it starts from the hit point moved off
+// the surface along the normal by the error, towards the side the ray leaves to, and rounded further away,
+// so no epsilon on the distance (which fits no scale well, and none at all in single precision) is needed
+// (as in pbrt, Pharr, Jakob and Humphreys, "Physically Based Rendering", 3rd edition, 3.9.5)
+template <typename T>
+inline vec3_t<T> offset_ray_origin(const vec3_t<T>& p, const vec3_t<T>& normal, T error, const vec3_t<T>& direction) {
+    auto n = dot(direction, normal) < 0 ? -normal : normal;
+    auto d = error * (fabs(n.x()) + fabs(n.y()) + fabs(n.z()));
+    auto origin = p + d * n;
+
+    // rounded away along every axis the normal has a part in, even with no error (a point snapped exactly
+    // onto a plane), so the ray never starts on the surface
+    for (int a = 0; a < 3; a++) {
+        if (n[a] > 0)
+            origin[a] = next_up(origin[a]);
+        else if (n[a] < 0)
+            origin[a] = next_down(origin[a]);
+    }
+    return origin;
+}
 
 #endif // RAY_H
@@ -6,12 +6,23 @@
 #include <limits>
 #include <memory>
 #include <cstdlib>
-#include <random>
+#include <cstdint>
+
+#include "rng.h"
 
 using std::shared_ptr;
 using std::make_shared;
 using std::sqrt;
 
+// the precision of the geometry: vectors, points, rays, boxes and hit records
+// double unless the build sets RAYTRACER_SINGLE_PRECISION (a CMake option), which halves their size; colours
+// stay in double precision either way
+#ifdef RAYTRACER_SINGLE_PRECISION
+using real = float;
+#else
+using real = double;
+#endif
+
 // Constants
 const double infinity = std::numeric_limits<double>::infinity();
 const double pi = 3.1415926535897932385;
@@ -21,12 +32,21 @@ inline double degrees_to_radians(double degrees) {
     return degrees * pi / 180.0;
 }
 
+// generator for code that runs outside of rendering, such as scene construction
+// every thread draws from its own generator, so it is safe but only reproducible on a single thread
+inline pcg32& random_generator() {
+    thread_local pcg32 generator;
+    return generator;
+}
+
+// reseed the calling thread's generator, making the numbers it draws from now on reproducible
+inline void seed_random(uint64_t seed) {
+    random_generator().reseed(mix_seed(seed));
+}
+
 inline double random_double() {
     // random number in [0,1)
-    static std::uniform_real_distribution<double> distribution(0.0,1.0);
-    static std::random_device dev;
-    static std::mt19937 generator(dev());
-    return distribution(generator);
+    return random_generator().next_double();
 }
 
 inline double random_double(double min, double max) {
@@ -39,6 +59,15 @@ inline int random_int(int min, int max) {
     return static_cast<int>(random_double(min, max+1));
 }
 
+// the rendering code draws from an explicitly passed generator instead
+inline double random_double(pcg32& rng) {
+    return rng.next_double();
+}
+
+inline double random_double(pcg32& rng, double min, double max) {
+    return min + (max-min)*rng.next_double();
+}
+
 inline double clamp(double x, double min, double max) {
     if (x < min) return min;
     if (x > max) return max;
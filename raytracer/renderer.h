@@ -0,0 +1,659 @@
+#ifndef RENDERER_H
+#define RENDERER_H
+
+#include "raytracer.h"
+#include "camera.h"
+#include "framebuffer.h"
+#include "hittable.h"
+#include "lights.h"
+#include "material.h"
+#include "thread_pool.h"
+#include "wavefront.h"
+
+#include <algorithm>
+#include <atomic>
+#include <iostream>
+#include <mutex>
+
+// ray tracer:
+// 1. calculate the ray from the eye to the pixel
+// 2. determine which objects the ray intersects
+// 3. compute a colour for that intersection point
+
+// segments counts the rays traced, for reporting the average path length
+
+colour ray_colour(
+    const ray& r, const colour& background, const hittable& world, int depth, pcg32& rng, uint64_t& segments
+) {
+    hit_record rec;
+
+    // limit the maximum recursion depth, returning no light contribution at the maximum depth
+    if (depth <= 0)
+        return {0,0,0};
+
+    // if the ray hits nothing, return the background colour
+    // no shadow acne at t_min = 0: rays leave surfaces from origins moved off them (see offset_ray_origin)
+    ++segments;
+    if (!world.hit(r, 0, infinity, rec))
+        return background;
+
+    ray scattered;
+    colour attenuation;
+    colour emitted = rec.mat_ptr->emitted(rec.u, rec.v, rec.p);
+
+    if (!rec.mat_ptr->scatter(r, rec, attenuation, scattered, rng))
+        return emitted;
+
+    return emitted + attenuation * ray_colour(scattered, background, world, depth-1, rng, segments);
+}
+
+// multiple importance sampling weight of a sample drawn with density pdf, when the same light could also
+// have been found by a strategy with density other_pdf (Veach's power heuristic)
+inline double power_heuristic(double pdf, double other_pdf) {
+    return pdf*pdf / (pdf*pdf + other_pdf*other_pdf);
+}
+
+// light reflected at rec from a direction sampled towards the lights (times the BSDF and cosine); the
+// shadow ray returns whatever light it meets first, weighted against finding it by scattering
+colour direct_light(
+    const ray& r_in, const hit_record& rec, const hittable& world, const light_list& lights, pcg32& rng,
+    uint64_t& segments
+) {
+    auto direction = lights.random_direction(rec.p, rng);
+    auto origin = rec.spawn_origin(direction);
+    auto light_pdf = lights.pdf_value(origin, direction);
+    auto scattering_pdf = rec.mat_ptr->pdf(r_in, rec, direction);
+    if (light_pdf <= 0 || scattering_pdf <= 0)
+        return {0,0,0};
+
+    ++segments;
+    hit_record light_rec;
+    if (!world.hit(ray(origin, direction, r_in.time()), 0, infinity, light_rec))
+        return {0,0,0};
+
+    auto emitted = light_rec.mat_ptr->emitted(light_rec.u, light_rec.v, light_rec.p);
+    auto weight = power_heuristic(light_pdf, scattering_pdf) / light_pdf;
+    return weight * rec.mat_ptr->eval(r_in, rec, direction) * emitted;
+}
+
+// ray_colour as a loop: the light reaching the camera along a path is the sum of what each bounce emits,
+// weighted by the product of the attenuations before it (the path throughput)
+// after roulette_depth bounces a path survives each further bounce with probability p, the largest
+// component of its throughput (capped at 0.95), and the survivors are weighted by 1/p, so dim paths end
+// early without biasing the image
+// with lights, every bounce off a material with a pdf also samples a light directly (direct_light), and light that the next
+// bounce finds by scattering is weighted by multiple importance sampling against having been sampled, so
+// small lights that scattered rays rarely find still light the scene with little noise
+colour path_colour(
+    ray r, const colour& background, const hittable& world, const light_list& lights, int max_depth,
+    int roulette_depth, pcg32& rng, uint64_t& segments
+) {
+    colour result(0, 0, 0);
+    colour throughput(1, 1, 1);
+    hit_record rec;
+    // density with which the last bounce scattered r, if that bounce also sampled the lights
+    double scattering_pdf = 0;
+
+    for (int depth = 0; depth < max_depth; ++depth) {
+        ++segments;
+        if (!world.hit(r, 0, infinity, rec))
+            return result + throughput * background;
+
+        ray scattered;
+        colour attenuation;
+        colour emitted = rec.mat_ptr->emitted(rec.u, rec.v, rec.p);
+        if (scattering_pdf > 0 && emitted.length_squared() > 0)
+            emitted *= power_heuristic(scattering_pdf, lights.pdf_value(r.origin(), r.direction()));
+        result += throughput * emitted;
+
+        if (!rec.mat_ptr->scatter(r, rec, attenuation, scattered, rng))
+            break;
+
+        scattering_pdf = 0;
+        if (!lights.empty()) {
+            scattering_pdf = rec.mat_ptr->pdf(r, rec, scattered.direction());
+            if (scattering_pdf > 0)
+                result += throughput * direct_light(r, rec, world, lights, rng, segments);
+        }
+
+        throughput = throughput * attenuation;
+        r = scattered;
+
+        if (depth + 1 >= roulette_depth) {
+            auto p = std::min(std::max(throughput.x(), std::max(throughput.y(), throughput.z())), 0.95);
+            if (random_double(rng) >= p)
+                break;
+            throughput /= p;
+        }
+    }
+
+    return result;
+}
+
+// how paths are traced
+enum class integrator_kind {
+    recursive, // one path at a time with ray_colour
+    iterative, // one path at a time with path_colour, ending paths by Russian roulette
+    packet,    // neighbouring pixels as ray packets
+    wavefront  // batches of paths one bounce at a time (see wavefront.h)
+};
+
+inline const char* integrator_name(integrator_kind kind) {
+    switch (kind) {
+        case integrator_kind::iterative: return "iterative";
+        case integrator_kind::packet: return "packet";
+        case integrator_kind::wavefront: return "wavefront";
+        default: return "recursive";
+    }
+}
+
+struct render_settings {
+    int image_width = 1000;
+    int image_height = 1000;
+    int samples_per_pixel = 50;
+    int max_depth = 50;
+    int roulette_depth = 3; // bounces before Russian roulette starts, iterative integrator only
+    int tile_size = 32;
+    uint64_t seed = 0;
+    integrator_kind integrator = integrator_kind::recursive;
+    bool light_sampling = false;   // sample the lights at bounces off materials with a pdf, iterative only
+    size_t wavefront_batch = 4096; // paths traced together by the wavefront integrator
+
+    // adaptive sampling, recursive and iterative integrators only: every pixel takes at least min_samples
+    // and at most samples_per_pixel samples, stopping once the estimated error of its displayed (gamma
+    // corrected) luminance falls below adaptive_threshold
+    bool adaptive = false;
+    int min_samples = 16;
+    double adaptive_threshold = 0.01;
+
+    int feature_samples = 8; // camera rays per pixel averaged into the denoiser's feature buffers
+};
+
+// feature depth of pixels whose rays escape the scene
+const double miss_depth = 1e30;
+// mirror and glass bounces the feature rays follow
+const int max_feature_bounces = 8;
+
+// tile-based renderer
+// the image is split into square tiles that are rendered as independent tasks on the thread pool
+// every camera sample draws from its own generator seeded from (seed, pixel, sample), so the image only
+// depends on the seed and not on the number of threads or the order in which tiles are picked up
+// the packet integrator traces each row of a tile packet_size pixels at a time: the same sample of
+// neighbouring pixels forms one packet, which stays together for as long as its rays remain coherent
+// the wavefront integrator traces all samples of a tile in batches of wavefront_batch paths
+// adaptive sampling decides when a pixel stops from the samples of its own block of pixels, so it stays
+// deterministic; each pixel's sum is rescaled to samples_per_pixel samples, so the image is written out
+// as if every pixel had taken them all
+// progressive rendering adds the samples in passes (render_pass); every sample is added straight to its
+// pixel in sample order, so the sums come out the same however the samples are split into passes
+
+// what a render traced
+struct render_stats {
+    uint64_t samples = 0;  // camera rays, i.e. paths
+    uint64_t segments = 0; // rays intersected with the scene along all paths
+
+    render_stats& operator+=(const render_stats& other) {
+        samples += other.samples;
+        segments += other.segments;
+        return *this;
+    }
+
+    double average_path_length() const {
+        return samples ? static_cast<double>(segments) / samples : 0;
+    }
+};
+
+class renderer {
+    public:
+        renderer(const render_settings& s, thread_pool& p) : settings(s), pool(p) {}
+
+        // renders the whole image from scratch
+        render_stats render(
+            const hittable& world, const camera& cam, const colour& background, framebuffer& image
+        ) const;
+
+        // adds samples [first_sample, first_sample + samples) of every pixel to an image of the right size,
+        // and to its sample counts if it keeps them (adaptive sampling is not used)
+        render_stats render_pass(
+            const hittable& world, const camera& cam, const colour& background, framebuffer& image,
+            int first_sample, int samples
+        ) const;
+
+        // fills the feature buffers of the image from the first (non-specular) hits of the camera rays of the
+        // pixels' first feature_samples samples (the same rays the render traced)
+        void render_features(const hittable& world, const camera& cam, framebuffer& image) const;
+
+    private:
+        // runs render_tile(x0, y0, x1, y1) for every tile on the thread pool, adding up the segments
+        template <typename F>
+        uint64_t for_each_tile(F&& render_tile) const;
+
+        // each tile renderer adds samples [s0, s1) of its pixels (the adaptive one decides how many itself)
+        // and returns the number of segments it traced
+        uint64_t render_tile(
+            const hittable& world, const light_list& lights, const camera& cam, const colour& background,
+            framebuffer& image, int x0, int y0, int x1, int y1, int s0, int s1
+        ) const;
+        uint64_t render_tile_adaptive(
+            const hittable& world, const light_list& lights, const camera& cam, const colour& background,
+            framebuffer& image, int x0, int y0, int x1, int y1
+        ) const;
+        uint64_t render_tile_packets(
+            const hittable& world, const camera& cam, const colour& background, framebuffer& image,
+            int x0, int y0, int x1, int y1, int s0, int s1
+        ) const;
+        uint64_t render_tile_wavefront(
+            const hittable& world, const camera& cam, const colour& background, framebuffer& image,
+            int x0, int y0, int x1, int y1, int s0, int s1
+        ) const;
+        // the lights the iterative integrator samples, none unless light sampling is on
+        light_list sampled_lights(const hittable& world) const;
+        // sample s of pixel (i, j) with the recursive or iterative integrator
+        colour trace_sample(
+            const hittable& world, const light_list& lights, const camera& cam, const colour& background,
+            int i, int j, int s, uint64_t& segments
+        ) const;
+        void trace_packet(
+            ray_packet& packet, int mask, const colour& background, const hittable& world, pcg32* rngs,
+            colour* result, uint64_t& segments
+        ) const;
+
+    public:
+        render_settings settings;
+
+    private:
+        thread_pool& pool;
+};
+
+render_stats renderer::render(
+    const hittable& world, const camera& cam, const colour& background, framebuffer& image
+) const {
+    image = framebuffer(settings.image_width, settings.image_height);
+    const bool adaptive = settings.adaptive && (settings.integrator == integrator_kind::recursive ||
+                                                settings.integrator == integrator_kind::iterative);
+    if (!adaptive)
+        return render_pass(world, cam, background, image, 0, settings.samples_per_pixel);
+
+    image.sample_counts.resize(image.pixels.size());
+    const auto lights = sampled_lights(world);
+    render_stats stats;
+    stats.segments = for_each_tile([&](int x0, int y0, int x1, int y1) {
+        return render_tile_adaptive(world, lights, cam, background, image, x0, y0, x1, y1);
+    });
+    for (auto count : image.sample_counts)
+        stats.samples += count;
+    return stats;
+}
+
+render_stats renderer::render_pass(
+    const hittable& world, const camera& cam, const colour& background, framebuffer& image,
+    int first_sample, int samples
+) const {
+    const int s0 = first_sample;
+    const int s1 = first_sample + samples;
+    const auto lights = sampled_lights(world);
+
+    render_stats stats;
+    stats.samples = static_cast<uint64_t>(settings.image_width) * settings.image_height * samples;
+    stats.segments = for_each_tile([&](int x0, int y0, int x1, int y1) {
+        uint64_t segments;
+        switch (settings.integrator) {
+            case integrator_kind::packet:
+                segments = render_tile_packets(world, cam, background, image, x0, y0, x1, y1, s0, s1);
+                break;
+            case integrator_kind::wavefront:
+                segments = render_tile_wavefront(world, cam, background, image, x0, y0, x1, y1, s0, s1);
+                break;
+            default:
+                segments = render_tile(world, lights, cam, background, image, x0, y0, x1, y1, s0, s1);
+                break;
+        }
+
+        if (!image.sample_counts.empty()) {
+            for (int j = y0; j < y1; ++j)
+                for (int i = x0; i < x1; ++i)
+                    image.samples_at(i, j) += static_cast<uint32_t>(samples);
+        }
+        return segments;
+    });
+    return stats;
+}
+
+void renderer::render_features(const hittable& world, const camera& cam, framebuffer& image) const {
+    const auto pixels = image.pixels.size();
+    image.albedo.assign(pixels, colour(0, 0, 0));
+    image.normal.assign(pixels, vec3(0, 0, 0));
+    image.depth.assign(pixels, 0);
+
+    const int samples = std::max(1, std::min(settings.feature_samples, settings.samples_per_pixel));
+    pool.parallel_for(static_cast<size_t>(settings.image_height), [&](size_t row) {
+        int j = static_cast<int>(row);
+        for (int i = 0; i < settings.image_width; ++i) {
+            colour albedo(0, 0, 0);
+            vec3 normal(0, 0, 0);
+            double depth = 0;
+            for (int s = 0; s < samples; ++s) {
+                // the camera ray of sample s, drawn as in trace_sample
+                auto rng = sample_rng(settings.seed, static_cast<uint64_t>(j) * settings.image_width + i, s);
+                auto u = (i + random_double(rng)) / (settings.image_width-1);
+                auto v = (j + random_double(rng)) / (settings.image_height-1);
+                ray r = cam.get_ray(u, v, rng);
+
+                // mirrors and glass show what they reflect or refract, so the ray follows them and the features
+                // of the first other surface are recorded, tinted by the attenuation on the way
+                colour throughput(1, 1, 1);
+                double distance = 0;
+                for (int bounce = 0; ; ++bounce) {
+                    hit_record rec;
+                    if (!world.hit(r, 0, infinity, rec)) {
+                        albedo += throughput;
+                        depth += miss_depth;
+                        break;
+                    }
+                    distance += rec.t * r.direction().length();
+
+                    ray scattered;
+                    colour attenuation;
+                    if (bounce < max_feature_bounces && rec.mat_ptr->scatter(r, rec, attenuation, scattered, rng) &&
+                        rec.mat_ptr->pdf(r, rec, scattered.direction()) == 0) {
+                        throughput = throughput * attenuation;
+                        r = scattered;
+                        continue;
+                    }
+
+                    albedo += throughput * rec.mat_ptr->base_colour(rec);
+                    normal += rec.normal;
+                    depth += distance;
+                    break;
+                }
+            }
+
+            auto p = image.index(i, j);
+            image.albedo[p] = albedo / samples;
+            image.normal[p] = normal / samples;
+            image.depth[p] = depth / samples;
+        }
+    });
+}
+
+template <typename F>
+uint64_t renderer::for_each_tile(F&& render_tile) const {
+    const int tile = settings.tile_size;
+    const int tiles_x = (settings.image_width + tile - 1) / tile;
+    const int tiles_y = (settings.image_height + tile - 1) / tile;
+    const size_t tile_count = static_cast<size_t>(tiles_x) * tiles_y;
+
+    std::atomic<size_t> tiles_done(0);
+    std::atomic<uint64_t> segments(0);
+    std::mutex progress_lock;
+
+    pool.parallel_for(tile_count, [&](size_t t) {
+        int x0 = static_cast<int>(t % tiles_x) * tile;
+        int y0 = static_cast<int>(t / tiles_x) * tile;
+
+        int x1 = std::min(x0 + tile, settings.image_width);
+        int y1 = std::min(y0 + tile, settings.image_height);
+        segments += render_tile(x0, y0, x1, y1);
+
+        // write progress indicator to the error output stream
+        auto done = ++tiles_done;
+        std::lock_guard<std::mutex> guard(progress_lock);
+        std::cerr << "\rTiles remaining: " << tile_count - done << " " << std::flush;
+    });
+    return segments;
+}
+
+uint64_t renderer::render_tile(
+    const hittable& world, const light_list& lights, const camera& cam, const colour& background,
+    framebuffer& image, int x0, int y0, int x1, int y1, int s0, int s1
+) const {
+    uint64_t segments = 0;
+    for (int j = y0; j < y1; ++j) {
+        for (int i = x0; i < x1; ++i) {
+            // tiles never overlap, so every pixel is written by exactly one thread
+            auto& pixel_colour = image.at(i, j);
+            for (int s = s0; s < s1; ++s)
+                pixel_colour += trace_sample(world, lights, cam, background, i, j, s, segments);
+        }
+    }
+    return segments;
+}
+
+light_list renderer::sampled_lights(const hittable& world) const {
+    if (settings.light_sampling && settings.integrator == integrator_kind::iterative)
+        return light_list(world);
+    return {};
+}
+
+colour renderer::trace_sample(
+    const hittable& world, const light_list& lights, const camera& cam, const colour& background,
+    int i, int j, int s, uint64_t& segments
+) const {
+    auto rng = sample_rng(settings.seed, static_cast<uint64_t>(j) * settings.image_width + i, s);
+    auto u = (i + random_double(rng)) / (settings.image_width-1);
+    auto v = (j + random_double(rng)) / (settings.image_height-1);
+    ray r = cam.get_ray(u, v, rng);
+
+    if (settings.integrator == integrator_kind::iterative)
+        return path_colour(
+            r, background, world, lights, settings.max_depth, settings.roulette_depth, rng, segments);
+    return ray_colour(r, background, world, settings.max_depth, rng, segments);
+}
+
+// estimated error of a pixel's displayed luminance after n samples, from the running mean and sum of
+// squared deviations of its sample luminances (Welford's algorithm)
+inline double display_error(double mean, double m2, int n) {
+    // standard error of the mean: sqrt(variance / n), with variance = m2 / (n - 1)
+    auto error = std::sqrt(m2 / (n - 1) / n);
+    // gamma correction (sqrt) scales a small error in the mean by 1 / (2 sqrt(mean)), capped at the whole
+    // display range
+    return error < 2 * std::sqrt(mean) ? error / (2 * std::sqrt(mean)) : (error > 0 ? 1.0 : 0.0);
+}
+
+// the tile is sampled in blocks of pixels, a few samples per pixel per pass
+// a pixel stops once both its own error and the average error of its block are below the threshold: a
+// pixel whose first samples happen to agree (e.g. none found the light yet) keeps sampling while its
+// neighbours are still noisy
+uint64_t renderer::render_tile_adaptive(
+    const hittable& world, const light_list& lights, const camera& cam, const colour& background,
+    framebuffer& image, int x0, int y0, int x1, int y1
+) const {
+    const int block = 8;
+    const int samples_per_pass = 4;
+
+    struct pixel_state {
+        colour sum;
+        double mean = 0;
+        double m2 = 0;
+        double error = 1;
+        int n = 0;
+        bool done = false;
+    };
+
+    uint64_t segments = 0;
+    for (int by = y0; by < y1; by += block) {
+        for (int bx = x0; bx < x1; bx += block) {
+            const int w = std::min(block, x1 - bx);
+            const int h = std::min(block, y1 - by);
+            pixel_state pixels[block * block];
+
+            bool active = true;
+            while (active) {
+                double block_error = 0;
+                for (int p = 0; p < w * h; p++) {
+                    auto& px = pixels[p];
+                    for (int k = 0; k < samples_per_pass && !px.done && px.n < settings.samples_per_pixel; k++) {
+                        auto sample = trace_sample(
+                            world, lights, cam, background, bx + p % w, by + p / w, px.n, segments);
+                        px.sum += sample;
+
+                        // samples brighter than the display can show all look the same, so they are clamped
+                        // before they count towards the noise
+                        auto y = std::min(0.2126 * sample.x() + 0.7152 * sample.y() + 0.0722 * sample.z(), 1.0);
+                        ++px.n;
+                        auto delta = y - px.mean;
+                        px.mean += delta / px.n;
+                        px.m2 += delta * (y - px.mean);
+                    }
+                    if (px.n > 1)
+                        px.error = display_error(px.mean, px.m2, px.n);
+                    block_error += px.error;
+                }
+                block_error /= w * h;
+
+                active = false;
+                for (int p = 0; p < w * h; p++) {
+                    auto& px = pixels[p];
+                    bool converged = px.n >= settings.min_samples && px.error <= settings.adaptive_threshold &&
+                                     block_error <= settings.adaptive_threshold;
+                    px.done = px.done || converged || px.n >= settings.samples_per_pixel;
+                    active = active || !px.done;
+                }
+            }
+
+            for (int p = 0; p < w * h; p++) {
+                const auto& px = pixels[p];
+                image.at(bx + p % w, by + p / w) = px.sum * (static_cast<double>(settings.samples_per_pixel) / px.n);
+                image.samples_at(bx + p % w, by + p / w) = static_cast<uint32_t>(px.n);
+            }
+        }
+    }
+    return segments;
+}
+
+uint64_t renderer::render_tile_packets(
+    const hittable& world, const camera& cam, const colour& background, framebuffer& image,
+    int x0, int y0, int x1, int y1, int s0, int s1
+) const {
+    uint64_t segments = 0;
+    for (int j = y0; j < y1; ++j) {
+        for (int i0 = x0; i0 < x1; i0 += packet_size) {
+            // the last packet of a row may be partly empty
+            int lanes = std::min(packet_size, x1 - i0);
+            int mask = (1 << lanes) - 1;
+
+            for (int s = s0; s < s1; ++s) {
+                ray_packet packet{}; // unused lanes of a partial packet stay zero
+                pcg32 rngs[packet_size];
+                for (int k = 0; k < lanes; k++) {
+                    auto pixel = static_cast<uint64_t>(j) * settings.image_width + i0 + k;
+                    rngs[k] = sample_rng(settings.seed, pixel, s);
+                    auto u = (i0 + k + random_double(rngs[k])) / (settings.image_width-1);
+                    auto v = (j + random_double(rngs[k])) / (settings.image_height-1);
+                    packet.set_lane(k, cam.get_ray(u, v, rngs[k]));
+                }
+
+                colour result[packet_size];
+                trace_packet(packet, mask, background, world, rngs, result, segments);
+                for (int k = 0; k < lanes; k++)
+                    image.at(i0 + k, j) += result[k];
+            }
+        }
+    }
+    return segments;
+}
+
+uint64_t renderer::render_tile_wavefront(
+    const hittable& world, const camera& cam, const colour& background, framebuffer& image,
+    int x0, int y0, int x1, int y1, int s0, int s1
+) const {
+    // path p of the tile is sample s0 + p % spp of pixel p / spp, counting pixels row by row
+    const int tile_width = x1 - x0;
+    const size_t spp = s1 - s0;
+    const size_t path_count = static_cast<size_t>(tile_width) * (y1 - y0) * spp;
+
+    wavefront_integrator integrator(world, background, settings.max_depth);
+    path_states paths;
+    uint64_t segments = 0;
+
+    for (size_t first = 0; first < path_count; first += settings.wavefront_batch) {
+        auto n = std::min(settings.wavefront_batch, path_count - first);
+        paths.resize(n);
+
+        for (size_t p = 0; p < n; p++) {
+            auto tile_pixel = (first + p) / spp;
+            auto s = s0 + (first + p) % spp;
+            int i = x0 + static_cast<int>(tile_pixel % tile_width);
+            int j = y0 + static_cast<int>(tile_pixel / tile_width);
+
+            auto& rng = paths.rng[p];
+            rng = sample_rng(settings.seed, static_cast<uint64_t>(j) * settings.image_width + i, s);
+            auto u = (i + random_double(rng)) / (settings.image_width-1);
+            auto v = (j + random_double(rng)) / (settings.image_height-1);
+            paths.set_ray(p, cam.get_ray(u, v, rng));
+        }
+
+        segments += integrator.trace(paths);
+
+        // samples are added up in order, as render_tile does
+        for (size_t p = 0; p < n; p++) {
+            auto tile_pixel = (first + p) / spp;
+            auto& pixel = image.at(x0 + static_cast<int>(tile_pixel % tile_width),
+                                   y0 + static_cast<int>(tile_pixel / tile_width));
+            pixel += colour(paths.radiance[0][p], paths.radiance[1][p], paths.radiance[2][p]);
+        }
+    }
+    return segments;
+}
+
+// ray_colour for every ray of a packet: the bounces are traced as a packet while the rays stay coherent,
+// the rest of each path by ray_colour
+// each ray draws from its own generator in the same order as ray_colour, so it follows the same path; only
+// the order in which the bounces are summed differs
+void renderer::trace_packet(
+    ray_packet& packet, int mask, const colour& background, const hittable& world, pcg32* rngs, colour* result,
+    uint64_t& segments
+) const {
+    colour throughput[packet_size];
+    hit_record recs[packet_size];
+    for (int k = 0; k < packet_size; k++) {
+        result[k] = colour(0, 0, 0);
+        throughput[k] = colour(1, 1, 1);
+    }
+
+    int depth = settings.max_depth;
+    for (; depth > 0 && mask; --depth) {
+        // once the rays have scattered in different directions, tracing them together only adds overhead
+        if (!(mask & (mask - 1)) || !packet_is_coherent(packet, mask))
+            break;
+
+        real t_max[packet_size];
+        for (int k = 0; k < packet_size; k++)
+            t_max[k] = infinity;
+        int hits = world.hit_packet(packet, mask, 0, t_max, recs);
+        for (int k = 0; k < packet_size; k++)
+            segments += (mask >> k) & 1;
+
+        for (int k = 0; k < packet_size; k++) {
+            if (!(mask & (1 << k)))
+                continue;
+
+            if (!(hits & (1 << k))) {
+                result[k] += throughput[k] * background;
+                mask &= ~(1 << k);
+                continue;
+            }
+
+            const auto& rec = recs[k];
+            ray scattered;
+            colour attenuation;
+            result[k] += throughput[k] * rec.mat_ptr->emitted(rec.u, rec.v, rec.p);
+
+            if (!rec.mat_ptr->scatter(packet.lane(k), rec, attenuation, scattered, rngs[k])) {
+                mask &= ~(1 << k);
+                continue;
+            }
+
+            throughput[k] = throughput[k] * attenuation;
+            packet.set_lane(k, scattered);
+        }
+    }
+
+    // the rest of every path is traced ray by ray
+    for (int k = 0; k < packet_size; k++) {
+        if (mask & (1 << k))
+            result[k] += throughput[k] * ray_colour(packet.lane(k), background, world, depth, rngs[k], segments);
+    }
+}
+
+#endif // RENDERER_H
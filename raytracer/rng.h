@@ -0,0 +1,55 @@
+#ifndef RNG_H
+#define RNG_H
+
+#include <cstdint>
+
+// mixes a 64-bit value into a well distributed seed (splitmix64 finaliser)
+inline uint64_t mix_seed(uint64_t x) {
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+// PCG32 random number generator (O'Neill, pcg-random.org)
+// 16 bytes of state and a handful of instructions per number, so every thread, tile or sample can own one
+// instead of sharing a single large generator
+
+class pcg32 {
+    public:
+        pcg32() : state(0x853c49e6748fea9bULL), inc(0xda3e39cb94b95bdbULL) {}
+        explicit pcg32(uint64_t seed, uint64_t stream = 1) { reseed(seed, stream); }
+
+        void reseed(uint64_t seed, uint64_t stream = 1) {
+            state = 0;
+            inc = (stream << 1u) | 1u;
+            next_uint();
+            state += seed;
+            next_uint();
+        }
+
+        uint32_t next_uint() {
+            uint64_t old_state = state;
+            state = old_state * 6364136223846793005ULL + inc;
+            auto xorshifted = static_cast<uint32_t>(((old_state >> 18u) ^ old_state) >> 27u);
+            auto rot = static_cast<uint32_t>(old_state >> 59u);
+            return (xorshifted >> rot) | (xorshifted << ((32u - rot) & 31u));
+        }
+
+        // random number in [0,1)
+        double next_double() {
+            return next_uint() * (1.0 / 4294967296.0);
+        }
+
+    public:
+        uint64_t state;
+        uint64_t inc;
+};
+
+// the generator for one camera sample, seeded from (seed, pixel, sample) alone
+// samples therefore see the same random numbers whichever thread renders them, in whatever order
+inline pcg32 sample_rng(uint64_t seed, uint64_t pixel, uint64_t sample) {
+    return pcg32(mix_seed(mix_seed(mix_seed(seed) ^ pixel) ^ sample));
+}
+
+#endif // RNG_H
@@ -0,0 +1,672 @@
+#ifndef SCENE_FILE_H
+#define SCENE_FILE_H
+
+#include "raytracer.h"
+#include "hittable_list.h"
+#include "sphere.h"
+#include "sphere_batch.h"
+#include "material.h"
+#include "texture.h"
+#include "bvh.h"
+#include "triangle_mesh.h"
+#include "instance.h"
+#include "buffer.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// binary scene files
+// a scene file holds a built scene as flat arrays: textures, materials, spheres and triangle meshes, with the
+// bvh of the spheres and of every mesh already built, in all of its layouts
+// reading one maps the file into memory and uses the arrays where they are: the geometry and the trees are
+// neither parsed nor copied, and only the textures, the materials and one object per mesh are allocated
+// before they are used, one linear pass checks that every material id, vertex index and tree node refers only
+// to what the file holds (see valid_tree), so a damaged file is rejected rather than read out of bounds while
+// rendering; the pass touches every page of the indices and the trees (not of the vertices), so reading a
+// scene takes time in proportion to them, a few tenths of a second for two million triangles
+// every array starts at a multiple of 64 bytes from the start of the file, so it is aligned for any element
+// what can be saved: spheres and triangle meshes (placed directly or by one instance each), under lists and
+// bvhs, made of lambertian, metal, dielectric and diffuse_light materials with solid or checker textures
+
+const char scene_file_magic[8] = {'R', 'T', 'S', 'C', 'E', 'N', 'E', '\0'};
+const uint32_t scene_file_version = 2;
+const uint64_t scene_file_alignment = 64;
+
+// count elements starting offset bytes into the file
+struct scene_array {
+    uint64_t offset;
+    uint64_t count;
+};
+
+enum class texture_record_kind : uint32_t { solid, checker };
+
+struct texture_record {
+    texture_record_kind kind;
+    uint32_t even; // checker: the textures of the two kinds of squares, both earlier in the array
+    uint32_t odd;
+    uint32_t pad;
+    double colour[3]; // solid
+};
+
+struct material_record {
+    uint32_t kind;    // a material_kind
+    uint32_t texture; // lambertian albedo, diffuse_light emission
+    double albedo[3]; // metal
+    double fuzz;      // metal
+    double ir;        // dielectric
+};
+
+struct mesh_record {
+    uint32_t material;
+    uint32_t has_transform; // the mesh is placed by transform, otherwise it is used as it is
+    double transform[3][4]; // object to world
+    scene_array x, y, z, nx, ny, nz, u, v;
+    scene_array indices;
+    scene_array nodes, nodes4, nodes8;
+};
+
+// the camera and background the scene is rendered with
+struct scene_view {
+    point3 lookfrom;
+    point3 lookat;
+    double vfov;
+    double aperture;
+    colour background;
+};
+
+struct scene_file_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t pad;
+    double lookfrom[3];
+    double lookat[3];
+    double vfov;
+    double aperture;
+    double background[3];
+    scene_array textures;
+    scene_array materials;
+    scene_array sphere_x, sphere_y, sphere_z, sphere_radius, sphere_material; // see sphere_batch
+    scene_array sphere_nodes, sphere_nodes4, sphere_nodes8;
+    scene_array sphere_lights; // indices of the spheres made of diffuse_light
+    scene_array meshes;
+};
+
+// writing
+
+// collects what the file stores while walking the scene
+class scene_writer {
+    public:
+        bool write(const std::string& path, hittable& world, const scene_view& view, thread_pool* pool);
+
+    private:
+        bool collect(hittable* object, const affine* transform);
+        bool add_texture(const shared_ptr<texture>& t, uint32_t& index);
+        bool add_material(const shared_ptr<material>& m, uint32_t& index);
+
+        template <typename T>
+        scene_array place(const T* data, size_t count);
+        template <typename T>
+        scene_array place(const buffer<T>& b) { return place(b.data(), b.size()); }
+        // vertex attributes are stored in double precision whatever the precision of the build; those of a
+        // single precision build are widened into a copy that is kept until the file is written
+        scene_array place_vertices(const buffer<double>& b) { return place(b); }
+        scene_array place_vertices(const buffer<float>& b) {
+            widened.emplace_back(b.begin(), b.end());
+            return place(widened.back().data(), widened.back().size());
+        }
+
+    private:
+        std::vector<texture_record> textures;
+        std::vector<material_record> materials;
+        std::vector<shared_ptr<material>> material_objects;
+        std::unordered_map<const texture*, uint32_t> texture_index;
+        std::unordered_map<const material*, uint32_t> material_index;
+
+        sphere_batch spheres; // materials are filled in at the end
+        bool add_sphere(const vec3_t<double>& center, double radius, const shared_ptr<material>& m);
+        struct placed_mesh {
+            triangle_mesh* mesh;
+            uint32_t material;
+            bool has_transform;
+            affine transform;
+        };
+        std::vector<placed_mesh> meshes;
+
+        // the arrays to write after the header, in file order
+        struct pending_array {
+            const void* data;
+            size_t bytes;
+            uint64_t offset;
+        };
+        std::vector<pending_array> arrays;
+        uint64_t end_offset = 0;
+        // moving a vector keeps its elements where they are, so the pending arrays stay valid as this grows
+        std::vector<std::vector<double>> widened;
+};
+
+// saves the scene to path, false if it cannot be written or holds something a scene file cannot
+inline bool write_scene_file(const std::string& path, hittable& world, const scene_view& view,
+                             thread_pool* pool = nullptr) {
+    return scene_writer().write(path, world, view, pool);
+}
+
+bool scene_writer::add_texture(const shared_ptr<texture>& t, uint32_t& index) {
+    auto found = texture_index.find(t.get());
+    if (found != texture_index.end()) {
+        index = found->second;
+        return true;
+    }
+
+    texture_record record{};
+    if (auto solid = dynamic_cast<const solid_colour*>(t.get())) {
+        record.kind = texture_record_kind::solid;
+        auto c = solid->value(0, 0, point3(0, 0, 0));
+        for (int a = 0; a < 3; a++)
+            record.colour[a] = c[a];
+    } else if (auto checker = dynamic_cast<const checker_texture*>(t.get())) {
+        record.kind = texture_record_kind::checker;
+        if (!add_texture(checker->even, record.even) || !add_texture(checker->odd, record.odd))
+            return false;
+    } else {
+        std::cerr << "Only solid and checker textures can be saved to a scene file.\n";
+        return false;
+    }
+
+    index = static_cast<uint32_t>(textures.size());
+    textures.push_back(record);
+    texture_index.emplace(t.get(), index);
+    return true;
+}
+
+bool scene_writer::add_material(const shared_ptr<material>& m, uint32_t& index) {
+    auto found = material_index.find(m.get());
+    if (found != material_index.end()) {
+        index = found->second;
+        return true;
+    }
+
+    material_record record{};
+    record.kind = static_cast<uint32_t>(m->kind());
+    bool saved = true;
+    switch (m->kind()) {
+        case material_kind::lambertian:
+            saved = add_texture(static_cast<const lambertian&>(*m).albedo, record.texture);
+            break;
+        case material_kind::metal: {
+            const auto& metal_material = static_cast<const metal&>(*m);
+            for (int a = 0; a < 3; a++)
+                record.albedo[a] = metal_material.albedo[a];
+            record.fuzz = metal_material.fuzz;
+            break;
+        }
+        case material_kind::dielectric:
+            record.ir = static_cast<const dielectric&>(*m).ir;
+            break;
+        case material_kind::diffuse_light:
+            saved = add_texture(static_cast<const diffuse_light&>(*m).emit, record.texture);
+            break;
+        default:
+            std::cerr << "Only lambertian, metal, dielectric and diffuse_light materials can be saved to a scene file.\n";
+            return false;
+    }
+    if (!saved)
+        return false;
+
+    index = static_cast<uint32_t>(materials.size());
+    materials.push_back(record);
+    material_objects.push_back(m);
+    material_index.emplace(m.get(), index);
+    return true;
+}
+
+bool scene_writer::collect(hittable* object, const affine* transform) {
+    if (auto list = dynamic_cast<hittable_list*>(object)) {
+        for (const auto& o : list->objects) {
+            if (!collect(o.get(), transform))
+                return false;
+        }
+        return true;
+    }
+    if (auto tree = dynamic_cast<bvh*>(object)) {
+        for (const auto& o : tree->primitives.objects) {
+            if (!collect(o.get(), transform))
+                return false;
+        }
+        return true;
+    }
+
+    if (auto mesh = dynamic_cast<triangle_mesh*>(object)) {
+        placed_mesh placed{mesh, 0, transform != nullptr, transform ? *transform : affine::identity()};
+        if (!add_material(mesh->primitives.mp, placed.material))
+            return false;
+        meshes.push_back(placed);
+        return true;
+    }
+    if (auto placed = dynamic_cast<instance*>(object)) {
+        if (!transform && dynamic_cast<triangle_mesh*>(placed->object.get()))
+            return collect(placed->object.get(), &placed->object_to_world);
+    }
+    if (auto s = dynamic_cast<sphere*>(object)) {
+        if (!transform)
+            return add_sphere(vec3_t<double>(s->center), s->radius, s->mat_ptr);
+    }
+    if (auto batch = dynamic_cast<sphere_batch_tree*>(object)) {
+        if (!transform) {
+            const auto& p = batch->primitives;
+            for (size_t i = 0; i < p.size(); ++i) {
+                if (!add_sphere(p.center(i), p.radius[i], p.materials[p.material_index[i]]))
+                    return false;
+            }
+            return true;
+        }
+    }
+
+    std::cerr << "Only spheres and triangle meshes, and instances of triangle meshes, can be saved to a scene file.\n";
+    return false;
+}
+
+bool scene_writer::add_sphere(const vec3_t<double>& center, double radius, const shared_ptr<material>& m) {
+    uint32_t index;
+    if (!add_material(m, index))
+        return false;
+    spheres.x.push_back(center.x());
+    spheres.y.push_back(center.y());
+    spheres.z.push_back(center.z());
+    spheres.radius.push_back(radius);
+    spheres.material_index.push_back(index);
+    return true;
+}
+
+template <typename T>
+scene_array scene_writer::place(const T* data, size_t count) {
+    scene_array placed{0, count};
+    if (count == 0)
+        return placed;
+
+    placed.offset = (end_offset + scene_file_alignment - 1) / scene_file_alignment * scene_file_alignment;
+    arrays.push_back(pending_array{data, count * sizeof(T), placed.offset});
+    end_offset = placed.offset + count * sizeof(T);
+    return placed;
+}
+
+bool scene_writer::write(const std::string& path, hittable& world, const scene_view& view, thread_pool* pool) {
+    if (!collect(&world, nullptr))
+        return false;
+
+    // the spheres get a tree of their own, the meshes bring theirs; every tree is saved in all its layouts
+    std::unique_ptr<sphere_batch_tree> tree;
+    if (spheres.size() > 0) {
+        spheres.materials = material_objects;
+        tree.reset(new sphere_batch_tree(std::move(spheres), pool));
+        tree->collapse_all();
+    }
+    for (auto& placed : meshes)
+        placed.mesh->collapse_all();
+
+    scene_file_header header{};
+    std::memcpy(header.magic, scene_file_magic, sizeof(scene_file_magic));
+    header.version = scene_file_version;
+    for (int a = 0; a < 3; a++) {
+        header.lookfrom[a] = view.lookfrom[a];
+        header.lookat[a] = view.lookat[a];
+        header.background[a] = view.background[a];
+    }
+    header.vfov = view.vfov;
+    header.aperture = view.aperture;
+
+    end_offset = sizeof(scene_file_header);
+    header.textures = place(textures.data(), textures.size());
+    header.materials = place(materials.data(), materials.size());
+    if (tree) {
+        header.sphere_x = place(tree->primitives.x);
+        header.sphere_y = place(tree->primitives.y);
+        header.sphere_z = place(tree->primitives.z);
+        header.sphere_radius = place(tree->primitives.radius);
+        header.sphere_material = place(tree->primitives.material_index);
+        header.sphere_nodes = place(tree->nodes);
+        header.sphere_nodes4 = place(tree->nodes4);
+        header.sphere_nodes8 = place(tree->nodes8);
+        header.sphere_lights = place(tree->lights);
+    }
+
+    std::vector<mesh_record> mesh_records(meshes.size());
+    for (size_t m = 0; m < meshes.size(); ++m) {
+        const auto& placed = meshes[m];
+        const auto& vertices = *placed.mesh->primitives.vertices;
+        auto& record = mesh_records[m];
+        record.material = placed.material;
+        record.has_transform = placed.has_transform;
+        std::memcpy(record.transform, placed.transform.m, sizeof(record.transform));
+        record.x = place_vertices(vertices.x);
+        record.y = place_vertices(vertices.y);
+        record.z = place_vertices(vertices.z);
+        record.nx = place_vertices(vertices.nx);
+        record.ny = place_vertices(vertices.ny);
+        record.nz = place_vertices(vertices.nz);
+        record.u = place_vertices(vertices.u);
+        record.v = place_vertices(vertices.v);
+        record.indices = place(placed.mesh->primitives.indices);
+        record.nodes = place(placed.mesh->nodes);
+        record.nodes4 = place(placed.mesh->nodes4);
+        record.nodes8 = place(placed.mesh->nodes8);
+    }
+    header.meshes = place(mesh_records.data(), mesh_records.size());
+
+    FILE* file = std::fopen(path.c_str(), "wb");
+    if (!file) {
+        std::cerr << "Cannot write " << path << ".\n";
+        return false;
+    }
+
+    bool written = std::fwrite(&header, sizeof(header), 1, file) == 1;
+    uint64_t offset = sizeof(header);
+    const char zeros[scene_file_alignment] = {};
+    for (const auto& array : arrays) {
+        if (!written)
+            break;
+        written = std::fwrite(zeros, 1, array.offset - offset, file) == array.offset - offset &&
+                  std::fwrite(array.data, 1, array.bytes, file) == array.bytes;
+        offset = array.offset + array.bytes;
+    }
+    written = std::fclose(file) == 0 && written;
+
+    if (!written)
+        std::cerr << "Cannot write " << path << ".\n";
+    return written;
+}
+
+// reading
+
+// the mapping of a scene file, unmapped when the last buffer using it is gone
+struct scene_mapping {
+    ~scene_mapping() {
+        if (data)
+            munmap(const_cast<char*>(data), size);
+    }
+
+    const char* data = nullptr;
+    size_t size = 0;
+};
+
+// whether every value is below bound
+inline bool all_below(const buffer<uint32_t>& values, size_t bound) {
+    for (auto value : values) {
+        if (value >= bound)
+            return false;
+    }
+    return true;
+}
+
+// whether nodes form a tree over count primitives that the traversals can walk: every child comes after its
+// parent and has no other (so there are no cycles), leaves lie within the primitives, and no node is deeper
+// than the traversal stacks hold (see bvh_max_depth)
+inline bool valid_tree(const buffer<linear_bvh_node>& nodes, size_t count) {
+    if (nodes.empty())
+        return false;
+
+    const uint8_t unreached = UINT8_MAX;
+    std::vector<uint8_t> depth(nodes.size(), unreached);
+    depth[0] = 0;
+    auto reach = [&](uint64_t child, size_t parent) {
+        if (child <= parent || child >= nodes.size() || depth[child] != unreached)
+            return false;
+        depth[child] = static_cast<uint8_t>(depth[parent] + 1);
+        return true;
+    };
+
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        const auto& node = nodes[i];
+        if (depth[i] == unreached)
+            return false;
+        if (node.count > 0) {
+            if (static_cast<uint64_t>(node.offset) + node.count > count)
+                return false;
+        } else if (node.axis > 2 || depth[i] >= bvh_max_depth || !reach(i + 1, i) || !reach(node.offset, i)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// the same for the wide layouts, which are optional; empty slots must have the inverted box that every ray
+// misses (see clear_wide_node), as their child is no node at all
+template <int N>
+bool valid_wide_tree(const buffer<wide_bvh_node<N>>& nodes, size_t count) {
+    if (nodes.empty())
+        return true;
+
+    const uint8_t unreached = UINT8_MAX;
+    std::vector<uint8_t> depth(nodes.size(), unreached);
+    depth[0] = 0;
+    for (size_t w = 0; w < nodes.size(); ++w) {
+        const auto& node = nodes[w];
+        if (depth[w] == unreached || depth[w] >= bvh_max_depth)
+            return false;
+
+        for (int i = 0; i < N; i++) {
+            if (node.count[i] > 0) {
+                if (static_cast<uint64_t>(node.child[i]) + node.count[i] > count)
+                    return false;
+            } else if (node.child[i] == UINT32_MAX) {
+                for (int a = 0; a < 3; a++) {
+                    if (node.bounds[a][i] != std::numeric_limits<float>::infinity() ||
+                        node.bounds[a + 3][i] != -std::numeric_limits<float>::infinity())
+                        return false;
+                }
+            } else {
+                auto child = node.child[i];
+                if (child <= w || child >= nodes.size() || depth[child] != unreached)
+                    return false;
+                depth[child] = static_cast<uint8_t>(depth[w] + 1);
+            }
+        }
+    }
+    return true;
+}
+
+class scene_reader {
+    public:
+        bool read(const std::string& path, hittable_list& world, scene_view& view);
+
+    private:
+        // the array at a, or an empty buffer (and valid false) if it lies outside the file
+        template <typename T>
+        buffer<T> view_of(const scene_array& a);
+        // the vertex attribute array at a in the precision of the geometry: the array itself in double
+        // precision, a narrowed copy in single
+        buffer<real> vertices_of(const scene_array& a) { return narrowed(view_of<double>(a), real()); }
+        static buffer<double> narrowed(buffer<double> b, double) { return b; }
+        static buffer<float> narrowed(const buffer<double>& b, float) {
+            return buffer<float>(std::vector<float>(b.begin(), b.end()));
+        }
+
+        shared_ptr<texture> make_texture(const texture_record& record);
+        shared_ptr<material> make_material(const material_record& record);
+
+    private:
+        shared_ptr<scene_mapping> mapping;
+        std::vector<shared_ptr<texture>> textures;
+        bool valid = true;
+};
+
+// reads the scene saved at path, false if there is no valid scene file there
+inline bool read_scene_file(const std::string& path, hittable_list& world, scene_view& view) {
+    return scene_reader().read(path, world, view);
+}
+
+template <typename T>
+buffer<T> scene_reader::view_of(const scene_array& a) {
+    if (a.count == 0)
+        return {};
+    if (a.offset % alignof(T) != 0 || a.offset > mapping->size || a.count > (mapping->size - a.offset) / sizeof(T)) {
+        valid = false;
+        return {};
+    }
+    return buffer<T>::view(reinterpret_cast<const T*>(mapping->data + a.offset), a.count, mapping);
+}
+
+shared_ptr<texture> scene_reader::make_texture(const texture_record& record) {
+    if (record.kind == texture_record_kind::solid)
+        return make_shared<solid_colour>(colour(record.colour[0], record.colour[1], record.colour[2]));
+
+    // checkers only refer to textures made before them
+    if (record.kind != texture_record_kind::checker || record.even >= textures.size() || record.odd >= textures.size())
+        return nullptr;
+    return make_shared<checker_texture>(textures[record.even], textures[record.odd]);
+}
+
+shared_ptr<material> scene_reader::make_material(const material_record& record) {
+    auto texture_of = [&]() { return record.texture < textures.size() ? textures[record.texture] : nullptr; };
+
+    switch (static_cast<material_kind>(record.kind)) {
+        case material_kind::lambertian:
+            return texture_of() ? make_shared<lambertian>(texture_of()) : nullptr;
+        case material_kind::metal:
+            return make_shared<metal>(colour(record.albedo[0], record.albedo[1], record.albedo[2]), record.fuzz);
+        case material_kind::dielectric:
+            return make_shared<dielectric>(record.ir);
+        case material_kind::diffuse_light:
+            return texture_of() ? make_shared<diffuse_light>(texture_of()) : nullptr;
+        default:
+            return nullptr;
+    }
+}
+
+bool scene_reader::read(const std::string& path, hittable_list& world, scene_view& view) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        std::cerr << "Cannot open " << path << ".\n";
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(scene_file_header)) {
+        ::close(fd);
+        std::cerr << path << " is not a scene file.\n";
+        return false;
+    }
+    void* data = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+    // the mapping stays valid after the descriptor is closed
+    ::close(fd);
+    if (data == MAP_FAILED) {
+        std::cerr << "Cannot map " << path << ".\n";
+        return false;
+    }
+    mapping = make_shared<scene_mapping>();
+    mapping->data = static_cast<const char*>(data);
+    mapping->size = static_cast<size_t>(st.st_size);
+
+    const auto& header = *reinterpret_cast<const scene_file_header*>(mapping->data);
+    if (std::memcmp(header.magic, scene_file_magic, sizeof(scene_file_magic)) != 0 ||
+        header.version != scene_file_version) {
+        std::cerr << path << " is not a scene file of version " << scene_file_version << ".\n";
+        return false;
+    }
+
+    view.lookfrom = point3(header.lookfrom[0], header.lookfrom[1], header.lookfrom[2]);
+    view.lookat = point3(header.lookat[0], header.lookat[1], header.lookat[2]);
+    view.vfov = header.vfov;
+    view.aperture = header.aperture;
+    view.background = colour(header.background[0], header.background[1], header.background[2]);
+
+    for (const auto& record : view_of<texture_record>(header.textures)) {
+        textures.push_back(make_texture(record));
+        valid = valid && textures.back();
+    }
+    std::vector<shared_ptr<material>> materials;
+    for (const auto& record : view_of<material_record>(header.materials)) {
+        materials.push_back(make_material(record));
+        valid = valid && materials.back();
+    }
+    auto material_of = [&](uint32_t index) -> shared_ptr<material> {
+        valid = valid && index < materials.size();
+        return valid ? materials[index] : nullptr;
+    };
+
+    hittable_list objects;
+    sphere_batch spheres;
+    spheres.x = view_of<double>(header.sphere_x);
+    spheres.y = view_of<double>(header.sphere_y);
+    spheres.z = view_of<double>(header.sphere_z);
+    spheres.radius = view_of<double>(header.sphere_radius);
+    spheres.material_index = view_of<uint32_t>(header.sphere_material);
+    if (spheres.size() > 0) {
+        // everything the spheres and their trees refer to is checked once here, so a damaged file is reported
+        // instead of read out of bounds while rendering
+        valid = valid && spheres.x.size() == spheres.size() && spheres.y.size() == spheres.size() &&
+                spheres.z.size() == spheres.size() && spheres.material_index.size() == spheres.size() &&
+                all_below(spheres.material_index, materials.size());
+        auto lights = view_of<uint32_t>(header.sphere_lights);
+        for (auto i : lights)
+            valid = valid && i < spheres.size() && material_of(spheres.material_index[i]);
+        auto nodes = view_of<linear_bvh_node>(header.sphere_nodes);
+        auto nodes4 = view_of<wide_bvh_node<4>>(header.sphere_nodes4);
+        auto nodes8 = view_of<wide_bvh_node<8>>(header.sphere_nodes8);
+        valid = valid && valid_tree(nodes, spheres.size()) && valid_wide_tree(nodes4, spheres.size()) &&
+                valid_wide_tree(nodes8, spheres.size());
+        if (valid) {
+            spheres.materials = materials;
+            objects.add(make_shared<sphere_batch_tree>(std::move(spheres), lights, nodes, nodes4, nodes8));
+        }
+    }
+
+    for (const auto& record : view_of<mesh_record>(header.meshes)) {
+        auto vertices = make_shared<mesh_vertices>();
+        vertices->x = vertices_of(record.x);
+        vertices->y = vertices_of(record.y);
+        vertices->z = vertices_of(record.z);
+        vertices->nx = vertices_of(record.nx);
+        vertices->ny = vertices_of(record.ny);
+        vertices->nz = vertices_of(record.nz);
+        vertices->u = vertices_of(record.u);
+        vertices->v = vertices_of(record.v);
+        auto indices = view_of<uint32_t>(record.indices);
+        auto nodes = view_of<linear_bvh_node>(record.nodes);
+        auto nodes4 = view_of<wide_bvh_node<4>>(record.nodes4);
+        auto nodes8 = view_of<wide_bvh_node<8>>(record.nodes8);
+        auto material = material_of(record.material);
+
+        // the optional attributes are absent or given for every vertex, and the triangles refer to vertices
+        // there are
+        auto n = vertices->size();
+        auto present = [n](const buffer<real>& attribute) { return attribute.size() == n; };
+        valid = valid && present(vertices->y) && present(vertices->z) &&
+                (vertices->nx.empty() ? vertices->ny.empty() && vertices->nz.empty()
+                                      : present(vertices->nx) && present(vertices->ny) && present(vertices->nz)) &&
+                (vertices->u.empty() ? vertices->v.empty() : present(vertices->u) && present(vertices->v)) &&
+                indices.size() % 3 == 0 && all_below(indices, n);
+        auto triangles = indices.size() / 3;
+        valid = valid && valid_tree(nodes, triangles) && valid_wide_tree(nodes4, triangles) &&
+                valid_wide_tree(nodes8, triangles);
+        if (!valid)
+            break;
+
+        shared_ptr<hittable> mesh = make_shared<triangle_mesh>(vertices, indices, material, nodes, nodes4, nodes8);
+        if (record.has_transform) {
+            affine transform;
+            std::memcpy(transform.m, record.transform, sizeof(transform.m));
+            mesh = make_shared<instance>(mesh, transform);
+        }
+        objects.add(mesh);
+    }
+
+    if (!valid) {
+        std::cerr << path << " is damaged.\n";
+        return false;
+    }
+
+    world = objects;
+    return true;
+}
+
+#endif // SCENE_FILE_H
@@ -0,0 +1,77 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+// SIMD support
+// kernels are compiled for each instruction set with target attributes rather than global compiler flags,
+// and the best one the CPU supports is picked at run time; every SIMD path has a scalar fallback
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define RAYTRACER_X86_SIMD 1
+#include <immintrin.h>
+// flatten inlines everything the kernel calls, so helpers written without the attribute still get AVX2 code
+// FMA stays off: contracted multiply-adds would round differently from the scalar paths
+#define RAYTRACER_TARGET_AVX2 __attribute__((target("avx2"), flatten))
+#define RAYTRACER_TARGET_AVX2_HELPER __attribute__((target("avx2")))
+#endif
+
+// ordered from least to most capable
+enum class simd_isa {
+    scalar,
+    sse,  // 4-wide, part of every x86-64 CPU
+    avx2  // 8-wide
+};
+
+inline const char* simd_isa_name(simd_isa isa) {
+    switch (isa) {
+        case simd_isa::sse: return "sse";
+        case simd_isa::avx2: return "avx2";
+        default: return "scalar";
+    }
+}
+
+inline simd_isa detect_simd_isa() {
+#ifdef RAYTRACER_X86_SIMD
+    if (__builtin_cpu_supports("avx2"))
+        return simd_isa::avx2;
+    return simd_isa::sse;
+#else
+    return simd_isa::scalar;
+#endif
+}
+
+// the most capable instruction set code may use, lowered to benchmark the narrower paths
+inline simd_isa& simd_isa_limit() {
+    static simd_isa limit = simd_isa::avx2;
+    return limit;
+}
+
+inline simd_isa active_simd_isa() {
+    static const simd_isa detected = detect_simd_isa();
+    return detected < simd_isa_limit() ? detected : simd_isa_limit();
+}
+
+#ifdef RAYTRACER_X86_SIMD
+
+// four values widened to double precision, for the kernels that compute in double whatever the precision of
+// the rays (see real in raytracer.h)
+RAYTRACER_TARGET_AVX2_HELPER
+inline __m256d load4_pd(const double* p) {
+    return _mm256_loadu_pd(p);
+}
+
+RAYTRACER_TARGET_AVX2_HELPER
+inline __m256d load4_pd(const float* p) {
+    return _mm256_cvtps_pd(_mm_loadu_ps(p));
+}
+
+// base[index[i]] in lane i; a masked gather with every lane on, as the plain one leaves its source undefined,
+// which GCC warns about
+RAYTRACER_TARGET_AVX2_HELPER
+inline __m256d gather4_pd(const double* base, __m128i index) {
+    const __m256d all = _mm256_castsi256_pd(_mm256_set1_epi64x(-1));
+    return _mm256_mask_i32gather_pd(_mm256_setzero_pd(), base, index, all, 8);
+}
+
+#endif // RAYTRACER_X86_SIMD
+
+#endif // SIMD_H
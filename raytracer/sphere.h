@@ -3,23 +3,87 @@
 #define SPHERE_H
 
 #include "hittable.h"
+#include "material.h"
+#include "onb.h"
+#include "simd.h"
 #include "vec3.h"
 
+// ray-sphere intersection
+// ray: p(t) = A + t*B
+// sphere: (p-C).(p-C) = r^2
+// (A + t*B - C).(A + t*B - C) = r^2
+// t^2*B.B + 2*t*B.(A-C) + (A-C).(A-C) - r^2 = 0
+// root is the nearest solution between t_min and t_max
+// the quadratic is solved in double precision whatever the precision of the ray: in single precision c
+// cancels to nothing useful for a large sphere seen from near its surface (such as the ground of the
+// random scene)
+// the centre may be in either precision (see sphere_batch.h)
+template <typename T>
+inline bool hit_sphere(const vec3_t<T>& center, double radius, const ray& r, real t_min, real t_max, double& root) {
+    auto oc = vec3_t<double>(r.origin()) - vec3_t<double>(center);
+    auto direction = vec3_t<double>(r.direction());
+    auto a = direction.length_squared();
+    auto half_b = dot(oc, direction);
+    auto c = oc.length_squared() - radius*radius;
+    auto discriminant = half_b*half_b - a*c;
+
+    if (discriminant < 0) return false;
+    auto sqrtd = sqrt(discriminant);
+
+    // find the nearest root that lies in the acceptable range
+    root = (-half_b - sqrtd) / a;
+    // if root is not in the acceptable range, try the other root
+    if (root < t_min || t_max < root) {
+        root = (-half_b + sqrtd) / a;
+        if (root < t_min || t_max < root)
+            return false;
+    }
+
+    return true;
+}
+
+// the hit point is moved onto the sphere along the direction from its centre, which leaves it off by a few
+// rounding errors of the size of the sphere's coordinates, however far the ray came from
+template <typename T>
+inline void set_sphere_point(const vec3_t<T>& center, double radius, const point3& p, hit_record& rec) {
+    auto offset = vec3_t<double>(p) - vec3_t<double>(center);
+    rec.p = vec3(vec3_t<double>(center) + offset * (fabs(radius) / offset.length()));
+    rec.error = hit_error(static_cast<real>(max_magnitude(center) + fabs(radius)));
+}
+
 class sphere : public hittable {
     public:
         sphere() {}
         sphere(point3 cen, double r, shared_ptr<material> m) : center(cen), radius(r), mat_ptr(m) {};
 
-        virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+        virtual bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const override;
+        virtual int hit_packet(
+            const ray_packet& packet, int mask, real t_min, real* t_max, hit_record* recs
+        ) const override;
         virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
 
+        virtual double pdf_value(const point3& origin, const vec3& v) const override;
+        virtual vec3 random_direction(const point3& origin, pcg32& rng) const override;
+        virtual void collect_lights(std::vector<const hittable*>& lights) const override {
+            if (mat_ptr->kind() == material_kind::diffuse_light)
+                lights.push_back(this);
+        }
+
     public:
         point3 center;
         double radius;
         shared_ptr<material> mat_ptr;
 
     private:
-        static void get_sphere_uv(const point3& p, double& u, double& v) {
+        void set_hit_record(const ray& r, double root, hit_record& rec) const;
+#ifdef RAYTRACER_X86_SIMD
+        int hit_packet_avx2(
+            const ray_packet& packet, int mask, real t_min, real* t_max, hit_record* recs
+        ) const;
+#endif
+
+    public:
+        static void get_sphere_uv(const point3& p, real& u, real& v) {
             // p: a given point on the sphere of radius one, centered at the origin
             // u: returned value [0,1] of angle around the Y axis from X=-1
             // v: returned value [0,1] of angle from Y=-1 to Y=+1
@@ -35,42 +99,112 @@ class sphere : public hittable {
         }
 };
 
-bool sphere::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
-    // ray-sphere intersection
-    // ray: p(t) = A + t*B
-    // sphere: (p-C).(p-C) = r^2
-    // (A + t*B - C).(A + t*B - C) = r^2
-    // t^2*B.B + 2*t*B.(A-C) + (A-C).(A-C) - r^2 = 0
-    vec3 oc = r.origin() - center;
-    auto a = r.direction().length_squared();
-    auto half_b = dot(oc, r.direction());
-    auto c = oc.length_squared() - radius*radius;
-    auto discriminant = half_b*half_b - a*c;
-
-    if (discriminant < 0) return false;
-    auto sqrtd = sqrt(discriminant);
+bool sphere::hit(const ray& r, real t_min, real t_max, hit_record& rec) const {
+    double root;
+    if (!hit_sphere(center, radius, r, t_min, t_max, root))
+        return false;
 
-    // find the nearest root that lies in the acceptable range
-    auto root = (-half_b - sqrtd) / a;
-    // if root is not in the acceptable range, try the other root
-    if (root < t_min || t_max < root) {
-            root = (-half_b + sqrtd) / a;
-            if (root < t_min || t_max < root) {
-                return false;
-            }
-        }
+    set_hit_record(r, root, rec);
+    return true;
+}
 
+void sphere::set_hit_record(const ray& r, double root, hit_record& rec) const {
     rec.t = root;
-    rec.p = r.at(rec.t);
+    set_sphere_point(center, radius, r.at(rec.t), rec);
     vec3 outward_normal = (rec.p - center) / radius;
     rec.set_face_normal(r, outward_normal);
     get_sphere_uv(outward_normal, rec.u, rec.v);
-    rec.mat_ptr = mat_ptr;
+    rec.mat_ptr = mat_ptr.get();
+}
 
-    return true;
+int sphere::hit_packet(
+    const ray_packet& packet, int mask, real t_min, real* t_max, hit_record* recs
+) const {
+#ifdef RAYTRACER_X86_SIMD
+    if (active_simd_isa() == simd_isa::avx2)
+        return hit_packet_avx2(packet, mask, t_min, t_max, recs);
+#endif
+    return hittable::hit_packet(packet, mask, t_min, t_max, recs);
+}
 
+#ifdef RAYTRACER_X86_SIMD
+
+// hit_sphere for four pairs of a ray and a sphere at a time (oc is the ray origin minus the centre), in double
+// precision and the same order of operations, so the lanes find exactly the roots hit_sphere does
+// returns the roots and the mask of the lanes that have one between lo and hi
+RAYTRACER_TARGET_AVX2_HELPER
+inline __m256d hit_sphere_avx2(const __m256d oc[3], const __m256d dir[3], __m256d radius, __m256d lo, __m256d hi,
+                               int& found) {
+    const __m256d sign = _mm256_set1_pd(-0.0);
+
+    __m256d a = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(dir[0], dir[0]), _mm256_mul_pd(dir[1], dir[1])),
+                              _mm256_mul_pd(dir[2], dir[2]));
+    __m256d half_b = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(oc[0], dir[0]), _mm256_mul_pd(oc[1], dir[1])),
+                                   _mm256_mul_pd(oc[2], dir[2]));
+    __m256d c = _mm256_sub_pd(
+        _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(oc[0], oc[0]), _mm256_mul_pd(oc[1], oc[1])),
+                      _mm256_mul_pd(oc[2], oc[2])),
+        _mm256_mul_pd(radius, radius));
+    __m256d discriminant = _mm256_sub_pd(_mm256_mul_pd(half_b, half_b), _mm256_mul_pd(a, c));
+
+    // most groups miss every sphere, and they are done before the square roots and divisions
+    __m256d solvable = _mm256_cmp_pd(discriminant, _mm256_setzero_pd(), _CMP_NLT_UQ);
+    if (!_mm256_movemask_pd(solvable)) {
+        found = 0;
+        return discriminant;
+    }
+    __m256d sqrtd = _mm256_sqrt_pd(discriminant);
+    __m256d neg_half_b = _mm256_xor_pd(half_b, sign);
+
+    // nearest root first, then the other one, each rejected outside [lo, hi]
+    __m256d root0 = _mm256_div_pd(_mm256_sub_pd(neg_half_b, sqrtd), a);
+    __m256d root1 = _mm256_div_pd(_mm256_add_pd(neg_half_b, sqrtd), a);
+    __m256d reject0 = _mm256_or_pd(_mm256_cmp_pd(root0, lo, _CMP_LT_OQ), _mm256_cmp_pd(hi, root0, _CMP_LT_OQ));
+    __m256d reject1 = _mm256_or_pd(_mm256_cmp_pd(root1, lo, _CMP_LT_OQ), _mm256_cmp_pd(hi, root1, _CMP_LT_OQ));
+
+    found = _mm256_movemask_pd(_mm256_andnot_pd(_mm256_and_pd(reject0, reject1), solvable));
+    return _mm256_blendv_pd(root0, root1, reject0);
 }
 
+// the same quadratic as hit_sphere for four rays at a time, so packets find exactly the hits single rays do
+RAYTRACER_TARGET_AVX2
+int sphere::hit_packet_avx2(
+    const ray_packet& packet, int mask, real t_min, real* t_max, hit_record* recs
+) const {
+    int hits = 0;
+
+    for (int base = 0; base < packet_size; base += 4) {
+        int lanes = (mask >> base) & 0xf;
+        if (!lanes)
+            continue;
+
+        __m256d oc[3], dir[3];
+        for (int a = 0; a < 3; a++) {
+            oc[a] = _mm256_sub_pd(load4_pd(packet.origin[a] + base), _mm256_set1_pd(center.e[a]));
+            dir[a] = load4_pd(packet.direction[a] + base);
+        }
+
+        int found;
+        __m256d root = hit_sphere_avx2(oc, dir, _mm256_set1_pd(radius), _mm256_set1_pd(t_min),
+                                       load4_pd(t_max + base), found);
+        lanes &= found;
+
+        double roots[4];
+        _mm256_storeu_pd(roots, root);
+        for (int i = 0; i < 4; i++) {
+            if (lanes & (1 << i)) {
+                set_hit_record(packet.lane(base + i), roots[i], recs[base + i]);
+                t_max[base + i] = roots[i];
+            }
+        }
+        hits |= lanes << base;
+    }
+
+    return hits;
+}
+
+#endif // RAYTRACER_X86_SIMD
+
 bool sphere::bounding_box(double time0, double time1, aabb& output_box) const {
     output_box = aabb(
             center - vec3(radius, radius, radius),
@@ -78,4 +212,32 @@ bool sphere::bounding_box(double time0, double time1, aabb& output_box) const {
     return true;
 }
 
+// light sampling: a uniformly random direction within the cone of directions from origin that meet the
+// sphere, whose solid angle is 2 pi (1 - cos_theta_max)
+double sphere::pdf_value(const point3& origin, const vec3& v) const {
+    auto distance_squared = (center - origin).length_squared();
+    hit_record rec;
+    if (distance_squared <= radius*radius || !hit(ray(origin, v), 0, infinity, rec))
+        return 0;
+
+    auto cos_theta_max = sqrt(1 - radius*radius / distance_squared);
+    return 1 / (2*pi * (1 - cos_theta_max));
+}
+
+vec3 sphere::random_direction(const point3& origin, pcg32& rng) const {
+    vec3 direction = center - origin;
+    auto distance_squared = direction.length_squared();
+    // from inside the sphere every direction meets it, and pdf_value is 0
+    if (distance_squared <= radius*radius)
+        return random_unit_vector(rng);
+
+    // cos(theta) is uniform between cos_theta_max and 1 about the direction to the centre
+    auto r1 = random_double(rng);
+    auto r2 = random_double(rng);
+    auto z = 1 + r2 * (sqrt(1 - radius*radius / distance_squared) - 1);
+    auto phi = 2*pi*r1;
+    auto sin_theta = sqrt(1 - z*z);
+    return onb(direction).local(cos(phi) * sin_theta, sin(phi) * sin_theta, z);
+}
+
 #endif // SPHERE_H
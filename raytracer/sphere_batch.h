@@ -0,0 +1,304 @@
+#ifndef SPHERE_BATCH_H
+#define SPHERE_BATCH_H
+
+#include "raytracer.h"
+#include "hittable.h"
+#include "sphere.h"
+#include "material.h"
+#include "bvh.h"
+#include "buffer.h"
+#include "simd.h"
+
+#include <cstdint>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// sphere batches
+// a scene of many small spheres spends its time at the leaves of its bvh, testing spheres one virtual call at a
+// time; a sphere batch is a bvh over spheres stored attribute by attribute (structure of arrays), centres,
+// radii and materials in separate arrays, so the spheres of a leaf load straight into SIMD lanes and one ray
+// is tested against four of them at once, the nearest root found across the lanes
+// leaves hold up to eight spheres, two groups of four, and the builder weighs them by the groups they take
+// the quadratic stays in double precision (see hit_sphere), so a group is four lanes of AVX2; other CPUs test
+// the spheres of a leaf one after another, finding the same hits
+// bvh gathers the plain spheres of its objects into batches by itself (see batch_spheres), and scene files
+// store their spheres in the same arrays
+
+// the primitives of a sphere batch
+struct sphere_batch {
+    size_t size() const { return radius.size(); }
+
+    vec3_t<double> center(size_t i) const { return vec3_t<double>(x[i], y[i], z[i]); }
+
+    aabb bounds(size_t i, double time0, double time1) const {
+        auto c = center(i);
+        auto r = fabs(radius[i]);
+        return aabb(point3(c - vec3_t<double>(r, r, r)), point3(c + vec3_t<double>(r, r, r)));
+    }
+
+    void reorder(const std::vector<bvh_primitive_info>& order, thread_pool* pool);
+
+    bool hit(uint32_t first, uint32_t count, const ray& r, real t_min, real& t_max, hit_record& rec) const;
+    int hit_packet(uint32_t first, uint32_t count, const ray_packet& packet, int mask, real t_min,
+                   real* t_max, hit_record* recs) const {
+        int hits = 0;
+        for (int i = 0; i < packet_size; i++) {
+            if ((mask & (1 << i)) && hit(first, count, packet.lane(i), t_min, t_max[i], recs[i]))
+                hits |= 1 << i;
+        }
+        return hits;
+    }
+
+    // the emissive spheres are also kept as sphere objects, which do the light sampling
+    void collect_lights(std::vector<const hittable*>& lights) const {
+        for (const auto& light : emitters)
+            lights.push_back(light.get());
+    }
+
+    // fills in the hit on sphere i, as sphere::hit does
+    void set_hit_record(const ray& r, uint32_t i, double root, hit_record& rec) const;
+
+#ifdef RAYTRACER_X86_SIMD
+    bool hit_avx2(uint32_t first, uint32_t count, const ray& r, real t_min, real& t_max, hit_record& rec) const;
+#endif
+
+    buffer<double> x, y, z;
+    buffer<double> radius;
+    buffer<uint32_t> material_index; // into materials
+    std::vector<shared_ptr<material>> materials;
+    std::vector<shared_ptr<sphere>> emitters;
+};
+
+// a leaf is tested in groups of four spheres, each about as costly as one sphere on its own
+template <>
+struct bvh_leaf<sphere_batch> {
+    static const size_t max_size = 8;
+    static double cost(size_t count) { return static_cast<double>((count + 3) / 4); }
+};
+
+void sphere_batch::reorder(const std::vector<bvh_primitive_info>& order, thread_pool* pool) {
+    auto sorted = [&](const buffer<double>& values) {
+        std::vector<double> out(values.size());
+        for (size_t i = 0; i < out.size(); ++i)
+            out[i] = values[order[i].index];
+        return out;
+    };
+    x = sorted(x);
+    y = sorted(y);
+    z = sorted(z);
+    radius = sorted(radius);
+
+    std::vector<uint32_t> materials_sorted(material_index.size());
+    for (size_t i = 0; i < materials_sorted.size(); ++i)
+        materials_sorted[i] = material_index[order[i].index];
+    material_index = std::move(materials_sorted);
+}
+
+bool sphere_batch::hit(
+    uint32_t first, uint32_t count, const ray& r, real t_min, real& t_max, hit_record& rec
+) const {
+#ifdef RAYTRACER_X86_SIMD
+    if (active_simd_isa() == simd_isa::avx2)
+        return hit_avx2(first, count, r, t_min, t_max, rec);
+#endif
+
+    uint32_t closest = 0;
+    double closest_root = 0;
+    bool hit_anything = false;
+    for (uint32_t i = first; i < first + count; ++i) {
+        double root;
+        if (hit_sphere(center(i), radius[i], r, t_min, t_max, root)) {
+            hit_anything = true;
+            t_max = root;
+            closest = i;
+            closest_root = root;
+        }
+    }
+
+    // only the closest sphere of the leaf fills in the record
+    if (hit_anything)
+        set_hit_record(r, closest, closest_root, rec);
+    return hit_anything;
+}
+
+void sphere_batch::set_hit_record(const ray& r, uint32_t i, double root, hit_record& rec) const {
+    auto c = center(i);
+    rec.t = root;
+    set_sphere_point(c, radius[i], r.at(rec.t), rec);
+    vec3 outward_normal = (rec.p - point3(c)) / radius[i];
+    rec.set_face_normal(r, outward_normal);
+    sphere::get_sphere_uv(outward_normal, rec.u, rec.v);
+    rec.mat_ptr = materials[material_index[i]].get();
+}
+
+#ifdef RAYTRACER_X86_SIMD
+
+// the spheres of a leaf four at a time; a group's lanes past the end of the leaf are masked off, and the masked
+// loads do not read them, so the arrays need no padding
+// the lanes that find a root are then taken in order, as the scalar loop would, so the hits are the same
+RAYTRACER_TARGET_AVX2
+bool sphere_batch::hit_avx2(
+    uint32_t first, uint32_t count, const ray& r, real t_min, real& t_max, hit_record& rec
+) const {
+    __m256d origin[3], dir[3];
+    for (int a = 0; a < 3; a++) {
+        origin[a] = _mm256_set1_pd(r.origin()[a]);
+        dir[a] = _mm256_set1_pd(r.direction()[a]);
+    }
+    const __m256d lo = _mm256_set1_pd(t_min);
+
+    uint32_t closest = 0;
+    double closest_root = 0;
+    bool hit_anything = false;
+    for (uint32_t base = first; base < first + count; base += 4) {
+        auto lanes = first + count - base;
+        const __m256i lane_index = _mm256_set_epi64x(3, 2, 1, 0);
+        __m256i load = _mm256_cmpgt_epi64(_mm256_set1_epi64x(lanes), lane_index);
+
+        __m256d oc[3];
+        oc[0] = _mm256_sub_pd(origin[0], _mm256_maskload_pd(x.data() + base, load));
+        oc[1] = _mm256_sub_pd(origin[1], _mm256_maskload_pd(y.data() + base, load));
+        oc[2] = _mm256_sub_pd(origin[2], _mm256_maskload_pd(z.data() + base, load));
+        auto radii = _mm256_maskload_pd(radius.data() + base, load);
+
+        int found;
+        __m256d root = hit_sphere_avx2(oc, dir, radii, lo, _mm256_set1_pd(t_max), found);
+        found &= _mm256_movemask_pd(_mm256_castsi256_pd(load));
+        if (!found)
+            continue;
+
+        double roots[4];
+        _mm256_storeu_pd(roots, root);
+        for (int i = 0; i < 4; i++) {
+            // a sphere found against the t_max the group started with may lie behind one found before it
+            if ((found & (1 << i)) && !(t_max < roots[i])) {
+                hit_anything = true;
+                t_max = roots[i];
+                closest = base + i;
+                closest_root = roots[i];
+            }
+        }
+    }
+
+    if (hit_anything)
+        set_hit_record(r, closest, closest_root, rec);
+    return hit_anything;
+}
+
+#endif // RAYTRACER_X86_SIMD
+
+class sphere_batch_tree : public bvh_tree<sphere_batch> {
+    public:
+        // builds the tree over spheres, whose material indices refer to their materials
+        sphere_batch_tree(sphere_batch spheres, thread_pool* pool) {
+            primitives = std::move(spheres);
+            build_tree(0, 1, pool);
+
+            for (uint32_t i = 0; i < primitives.size(); ++i) {
+                if (primitives.materials[primitives.material_index[i]]->kind() == material_kind::diffuse_light)
+                    lights.push_back(i);
+            }
+            add_emitters();
+        }
+
+        // spheres already in the order of a tree built before, with the indices of the emissive ones
+        sphere_batch_tree(sphere_batch spheres, buffer<uint32_t> lights, buffer<linear_bvh_node> binary,
+                          buffer<wide_bvh_node<4>> wide4, buffer<wide_bvh_node<8>> wide8)
+            : lights(std::move(lights)) {
+            primitives = std::move(spheres);
+            use_tree(std::move(binary), std::move(wide4), std::move(wide8));
+            add_emitters();
+        }
+
+        size_t sphere_count() const { return primitives.size(); }
+
+    private:
+        void add_emitters() {
+            for (auto i : lights) {
+                primitives.emitters.push_back(make_shared<sphere>(
+                    point3(primitives.center(i)), primitives.radius[i],
+                    primitives.materials[primitives.material_index[i]]));
+            }
+        }
+
+    public:
+        buffer<uint32_t> lights;
+};
+
+// fewer spheres than this are left as they are
+const size_t sphere_batch_min_spheres = 16;
+
+bool batch_spheres(std::vector<shared_ptr<hittable>>& objects, const buffer<linear_bvh_node>& nodes, thread_pool* pool) {
+    size_t sphere_count = 0;
+    for (const auto& object : objects)
+        sphere_count += dynamic_cast<const sphere*>(object.get()) != nullptr;
+    if (sphere_count < sphere_batch_min_spheres)
+        return false;
+
+    // the range of objects under every node and whether they are all spheres, children (which come after their
+    // parent) first
+    std::vector<uint32_t> first(nodes.size()), end(nodes.size());
+    std::vector<char> only_spheres(nodes.size());
+    for (size_t i = nodes.size(); i-- > 0;) {
+        const auto& node = nodes[i];
+        if (node.count > 0) {
+            first[i] = node.offset;
+            end[i] = node.offset + node.count;
+            only_spheres[i] = true;
+            for (auto k = first[i]; k < end[i]; ++k)
+                only_spheres[i] &= dynamic_cast<const sphere*>(objects[k].get()) != nullptr;
+        } else {
+            first[i] = first[i + 1];
+            end[i] = end[node.offset];
+            only_spheres[i] = only_spheres[i + 1] && only_spheres[node.offset];
+        }
+    }
+
+    // the largest subtrees of only spheres become batches, from the first node to the last; the walk descends
+    // into the first child and stacks the second, one entry per level as the traversals do
+    std::vector<shared_ptr<hittable>> batched;
+    bool batched_any = false;
+    uint32_t stack[bvh_max_depth];
+    int top = 0;
+    uint32_t i = 0;
+    while (true) {
+        const auto& node = nodes[i];
+        if (only_spheres[i] && end[i] - first[i] >= sphere_batch_min_spheres) {
+            sphere_batch spheres;
+            std::unordered_map<const material*, uint32_t> known;
+            for (auto k = first[i]; k < end[i]; ++k) {
+                auto s = static_cast<const sphere*>(objects[k].get());
+                spheres.x.push_back(s->center.x());
+                spheres.y.push_back(s->center.y());
+                spheres.z.push_back(s->center.z());
+                spheres.radius.push_back(s->radius);
+                auto found = known.find(s->mat_ptr.get());
+                if (found == known.end()) {
+                    found = known.emplace(s->mat_ptr.get(), static_cast<uint32_t>(spheres.materials.size())).first;
+                    spheres.materials.push_back(s->mat_ptr);
+                }
+                spheres.material_index.push_back(found->second);
+            }
+            batched.push_back(make_shared<sphere_batch_tree>(std::move(spheres), pool));
+            batched_any = true;
+        } else if (node.count > 0) {
+            for (auto k = first[i]; k < end[i]; ++k)
+                batched.push_back(objects[k]);
+        } else {
+            stack[top++] = node.offset;
+            ++i;
+            continue;
+        }
+
+        if (top == 0)
+            break;
+        i = stack[--top];
+    }
+
+    if (batched_any)
+        objects = std::move(batched);
+    return batched_any;
+}
+
+#endif // SPHERE_BATCH_H
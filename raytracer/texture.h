@@ -62,12 +62,20 @@ class noise_texture : public texture {
             // return colour(1, 1, 1) * 0.5 * (1.0 + noise.noise(scale*p));
             // return colour(1, 1, 1) * noise.turb(scale*p);
             // the “hello world” of procedural solid textures - marble
-            return colour(1,1,1) * 0.5 * (1 + sin(scale*p.z() + 10*noise.turb(p)));
+            auto turbulence = baked ? baked->turb(p) : noise.turb(p);
+            return colour(1,1,1) * 0.5 * (1 + sin(scale*p.z() + 10*turbulence));
+        }
+
+        // reads the turbulence inside region from a grid baked now (see turbulence_grid), which holds at most
+        // turbulence_grid::max_points values
+        void bake(const aabb& region, double cells_per_unit, thread_pool* pool = nullptr) {
+            baked = make_shared<turbulence_grid>(noise, region, cells_per_unit, pool);
         }
 
     public:
         perlin noise;
         double scale;
+        shared_ptr<const turbulence_grid> baked;
 };
 
 class image_texture : public texture {
@@ -0,0 +1,201 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// work-stealing thread pool
+// every worker owns a deque of tasks: it pops its own work from the back (most recently pushed, still warm
+// in cache) and, when it runs dry, steals from the front of the other workers' deques
+// the thread that waits on a task group helps by running queued tasks, so a pool of n threads starts n-1
+// workers and a pool of one thread runs everything on the caller
+
+class thread_pool {
+    public:
+        // a set of tasks that can be waited on together
+        // groups may be nested: a task can submit more tasks and wait on them without blocking a worker
+        class task_group {
+            public:
+                task_group() : pending(0) {}
+
+            private:
+                std::atomic<size_t> pending;
+                friend class thread_pool;
+        };
+
+        explicit thread_pool(unsigned int thread_count = std::thread::hardware_concurrency());
+        ~thread_pool();
+
+        thread_pool(const thread_pool&) = delete;
+        thread_pool& operator=(const thread_pool&) = delete;
+
+        size_t size() const { return queues.size(); }
+
+        void submit(task_group& group, std::function<void()> task);
+        void wait(task_group& group);
+
+        // call f(i) for every i in [0,count), grain indices per task
+        template <typename F>
+        void parallel_for(size_t count, F f, size_t grain = 1);
+
+    private:
+        struct task {
+            std::function<void()> run;
+            task_group* group;
+        };
+
+        struct task_queue {
+            std::mutex lock;
+            std::deque<task> tasks;
+        };
+
+        void worker_loop(size_t index);
+        bool run_one(size_t index);
+        bool pop(size_t index, task& out);
+        bool steal(size_t thief, task& out);
+        size_t current_index() const;
+
+        std::vector<std::unique_ptr<task_queue>> queues;
+        std::vector<std::thread> workers;
+        std::atomic<size_t> queued;
+        std::atomic<size_t> next_queue;
+        std::mutex sleep_lock;
+        std::condition_variable wake;
+        bool stopping;
+
+        // the pool and queue index of the worker running on this thread
+        static thread_local const thread_pool* worker_pool;
+        static thread_local size_t worker_index;
+};
+
+thread_local const thread_pool* thread_pool::worker_pool = nullptr;
+thread_local size_t thread_pool::worker_index = 0;
+
+thread_pool::thread_pool(unsigned int thread_count) : queued(0), next_queue(0), stopping(false) {
+    if (thread_count == 0)
+        thread_count = 1;
+
+    for (unsigned int i = 0; i < thread_count; ++i)
+        queues.push_back(std::unique_ptr<task_queue>(new task_queue));
+
+    // queue 0 belongs to the calling thread(s), queues 1..n-1 to the workers
+    for (unsigned int i = 1; i < thread_count; ++i)
+        workers.emplace_back(&thread_pool::worker_loop, this, i);
+}
+
+thread_pool::~thread_pool() {
+    {
+        std::lock_guard<std::mutex> guard(sleep_lock);
+        stopping = true;
+    }
+    wake.notify_all();
+
+    for (auto& worker : workers)
+        worker.join();
+}
+
+size_t thread_pool::current_index() const {
+    return worker_pool == this ? worker_index : 0;
+}
+
+void thread_pool::submit(task_group& group, std::function<void()> run) {
+    group.pending.fetch_add(1, std::memory_order_relaxed);
+
+    // workers push onto their own deque, outside threads spread their tasks over all deques
+    auto index = worker_pool == this ? worker_index : next_queue.fetch_add(1) % queues.size();
+    {
+        std::lock_guard<std::mutex> guard(queues[index]->lock);
+        queues[index]->tasks.push_back(task{std::move(run), &group});
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(sleep_lock);
+        queued.fetch_add(1);
+    }
+    wake.notify_one();
+}
+
+void thread_pool::wait(task_group& group) {
+    auto index = current_index();
+
+    while (group.pending.load() > 0) {
+        if (!run_one(index))
+            std::this_thread::yield();
+    }
+}
+
+template <typename F>
+void thread_pool::parallel_for(size_t count, F f, size_t grain) {
+    if (grain == 0)
+        grain = 1;
+
+    task_group group;
+    for (size_t begin = 0; begin < count; begin += grain) {
+        auto end = begin + grain < count ? begin + grain : count;
+        submit(group, [begin, end, &f] {
+            for (size_t i = begin; i < end; ++i)
+                f(i);
+        });
+    }
+    wait(group);
+}
+
+void thread_pool::worker_loop(size_t index) {
+    worker_pool = this;
+    worker_index = index;
+
+    while (true) {
+        if (run_one(index))
+            continue;
+
+        std::unique_lock<std::mutex> guard(sleep_lock);
+        wake.wait(guard, [this] { return stopping || queued.load() > 0; });
+        if (stopping)
+            return;
+    }
+}
+
+bool thread_pool::run_one(size_t index) {
+    task t;
+    if (!pop(index, t) && !steal(index, t))
+        return false;
+
+    queued.fetch_sub(1);
+    t.run();
+    t.group->pending.fetch_sub(1, std::memory_order_release);
+    return true;
+}
+
+bool thread_pool::pop(size_t index, task& out) {
+    auto& queue = *queues[index];
+    std::lock_guard<std::mutex> guard(queue.lock);
+    if (queue.tasks.empty())
+        return false;
+
+    out = std::move(queue.tasks.back());
+    queue.tasks.pop_back();
+    return true;
+}
+
+bool thread_pool::steal(size_t thief, task& out) {
+    for (size_t offset = 1; offset < queues.size(); ++offset) {
+        auto& queue = *queues[(thief + offset) % queues.size()];
+        std::lock_guard<std::mutex> guard(queue.lock);
+        if (queue.tasks.empty())
+            continue;
+
+        out = std::move(queue.tasks.front());
+        queue.tasks.pop_front();
+        return true;
+    }
+    return false;
+}
+
+#endif // THREAD_POOL_H
@@ -0,0 +1,144 @@
+#ifndef TRANSFORM_H
+#define TRANSFORM_H
+
+#include "raytracer.h"
+#include "aabb.h"
+
+#include <algorithm>
+
+// affine transform: a 3x3 linear part followed by a translation, stored as the top three rows of a 4x4
+// matrix (the bottom row of an affine matrix is always 0 0 0 1)
+// transforms compose right to left like matrices: (a * b).point(p) == a.point(b.point(p))
+
+struct affine {
+    double m[3][4];
+
+    static affine identity() {
+        return scaling(vec3(1, 1, 1));
+    }
+
+    static affine translation(const vec3& offset) {
+        affine t = identity();
+        for (int r = 0; r < 3; r++)
+            t.m[r][3] = offset[r];
+        return t;
+    }
+
+    static affine scaling(const vec3& factors) {
+        affine t{};
+        for (int r = 0; r < 3; r++)
+            t.m[r][r] = factors[r];
+        return t;
+    }
+
+    // counterclockwise rotation by angle degrees about axis (seen with the axis pointing at the viewer)
+    static affine rotation(const vec3& axis, double angle) {
+        auto a = unit_vector(axis);
+        auto radians = degrees_to_radians(angle);
+        auto s = sin(radians);
+        auto c = cos(radians);
+        auto k = 1 - c;
+
+        // Rodrigues' rotation formula
+        affine t{};
+        t.m[0][0] = c + a.x()*a.x()*k;
+        t.m[0][1] = a.x()*a.y()*k - a.z()*s;
+        t.m[0][2] = a.x()*a.z()*k + a.y()*s;
+        t.m[1][0] = a.y()*a.x()*k + a.z()*s;
+        t.m[1][1] = c + a.y()*a.y()*k;
+        t.m[1][2] = a.y()*a.z()*k - a.x()*s;
+        t.m[2][0] = a.z()*a.x()*k - a.y()*s;
+        t.m[2][1] = a.z()*a.y()*k + a.x()*s;
+        t.m[2][2] = c + a.z()*a.z()*k;
+        return t;
+    }
+
+    point3 point(const point3& p) const {
+        return vector(p) + vec3(m[0][3], m[1][3], m[2][3]);
+    }
+
+    vec3 vector(const vec3& v) const {
+        return vec3(m[0][0]*v.x() + m[0][1]*v.y() + m[0][2]*v.z(),
+                    m[1][0]*v.x() + m[1][1]*v.y() + m[1][2]*v.z(),
+                    m[2][0]*v.x() + m[2][1]*v.y() + m[2][2]*v.z());
+    }
+
+    // the linear part transposed, applied to v: called on the inverse transform, this carries surface
+    // normals over (they stay perpendicular to the surface under non-uniform scaling)
+    vec3 transposed_vector(const vec3& v) const {
+        return vec3(m[0][0]*v.x() + m[1][0]*v.y() + m[2][0]*v.z(),
+                    m[0][1]*v.x() + m[1][1]*v.y() + m[2][1]*v.z(),
+                    m[0][2]*v.x() + m[1][2]*v.y() + m[2][2]*v.z());
+    }
+
+    // the most the linear part stretches a vector, measured by its largest coordinate (the largest row sum)
+    double norm() const {
+        double largest = 0;
+        for (int r = 0; r < 3; r++)
+            largest = std::max(largest, fabs(m[r][0]) + fabs(m[r][1]) + fabs(m[r][2]));
+        return largest;
+    }
+
+    // the transform that undoes this one, the linear part must not be singular
+    affine inverse() const;
+    // the box (axis aligned again) around box after the transform
+    aabb bounds(const aabb& box) const;
+};
+
+inline affine operator*(const affine& a, const affine& b) {
+    affine t;
+    for (int r = 0; r < 3; r++) {
+        for (int c = 0; c < 4; c++) {
+            t.m[r][c] = a.m[r][0]*b.m[0][c] + a.m[r][1]*b.m[1][c] + a.m[r][2]*b.m[2][c];
+        }
+        t.m[r][3] += a.m[r][3];
+    }
+    return t;
+}
+
+affine affine::inverse() const {
+    // the inverse of the linear part from its cofactors
+    affine t;
+    t.m[0][0] = m[1][1]*m[2][2] - m[1][2]*m[2][1];
+    t.m[0][1] = m[0][2]*m[2][1] - m[0][1]*m[2][2];
+    t.m[0][2] = m[0][1]*m[1][2] - m[0][2]*m[1][1];
+    t.m[1][0] = m[1][2]*m[2][0] - m[1][0]*m[2][2];
+    t.m[1][1] = m[0][0]*m[2][2] - m[0][2]*m[2][0];
+    t.m[1][2] = m[0][2]*m[1][0] - m[0][0]*m[1][2];
+    t.m[2][0] = m[1][0]*m[2][1] - m[1][1]*m[2][0];
+    t.m[2][1] = m[0][1]*m[2][0] - m[0][0]*m[2][1];
+    t.m[2][2] = m[0][0]*m[1][1] - m[0][1]*m[1][0];
+
+    auto inv_det = 1 / (m[0][0]*t.m[0][0] + m[0][1]*t.m[1][0] + m[0][2]*t.m[2][0]);
+    for (int r = 0; r < 3; r++) {
+        for (int c = 0; c < 3; c++)
+            t.m[r][c] *= inv_det;
+        t.m[r][3] = 0;
+    }
+
+    // then the translation is undone first: inverse(p) = L^-1 (p - offset)
+    auto offset = t.vector(vec3(m[0][3], m[1][3], m[2][3]));
+    for (int r = 0; r < 3; r++)
+        t.m[r][3] = -offset[r];
+    return t;
+}
+
+aabb affine::bounds(const aabb& box) const {
+    point3 min(infinity, infinity, infinity);
+    point3 max(-infinity, -infinity, -infinity);
+
+    for (int i = 0; i < 8; i++) {
+        point3 corner((i & 1) ? box.max().x() : box.min().x(),
+                      (i & 2) ? box.max().y() : box.min().y(),
+                      (i & 4) ? box.max().z() : box.min().z());
+        auto p = point(corner);
+        for (int c = 0; c < 3; c++) {
+            min[c] = fmin(min[c], p[c]);
+            max[c] = fmax(max[c], p[c]);
+        }
+    }
+
+    return aabb(min, max);
+}
+
+#endif // TRANSFORM_H
@@ -0,0 +1,259 @@
+#ifndef TRIANGLE_MESH_H
+#define TRIANGLE_MESH_H
+
+#include "raytracer.h"
+#include "hittable.h"
+#include "material.h"
+#include "bvh.h"
+#include "buffer.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+// triangle meshes
+// the vertices are stored once, attribute by attribute in separate arrays (structure of arrays), and the
+// triangles refer to them through an index buffer of three vertex indices per triangle, so a mesh costs a
+// few numbers per triangle instead of one heap object each
+// the mesh is a bvh over its own triangles: the build reorders the index buffer so every leaf is a range of
+// adjacent triangles, and a leaf is intersected by walking its range
+// a mesh has one material; place copies of it in a scene with instances (see instance.h)
+
+// the vertex attributes of a mesh; normals and texture coordinates are optional (empty) and are indexed like
+// the positions when present
+// they are stored in the precision of the geometry, so a single precision build holds half the bytes
+struct mesh_vertices {
+    size_t size() const { return x.size(); }
+
+    point3 position(uint32_t i) const { return point3(x[i], y[i], z[i]); }
+    vec3 normal(uint32_t i) const { return vec3(nx[i], ny[i], nz[i]); }
+
+    buffer<real> x, y, z;
+    buffer<real> nx, ny, nz;
+    buffer<real> u, v;
+};
+
+// watertight ray/triangle intersection (Woop, Benthin and Wald, "Watertight Ray/Triangle Intersection", 2013)
+// the vertices are moved into a space where the ray starts at the origin and points along +z, by a translation
+// and a shear that are computed once per ray; there the test is a 2D edge test against the origin, and
+// neighbouring triangles compute exactly the same value for their shared edge, so a ray can never slip
+// through the crack between them
+// edges are inclusive and both faces are hit
+struct watertight_ray {
+    explicit watertight_ray(const ray& r) : origin(r.origin()) {
+        auto d = r.direction();
+
+        // the axis along which the direction is largest becomes z, the winding is kept by swapping x and y
+        kz = fabs(d.x()) > fabs(d.y()) ? (fabs(d.x()) > fabs(d.z()) ? 0 : 2) : (fabs(d.y()) > fabs(d.z()) ? 1 : 2);
+        kx = kz == 2 ? 0 : kz + 1;
+        ky = kx == 2 ? 0 : kx + 1;
+        if (d[kz] < 0)
+            std::swap(kx, ky);
+
+        sz = 1 / d[kz];
+        sx = d[kx] * sz;
+        sy = d[ky] * sz;
+    }
+
+    point3 origin;
+    int kx, ky, kz;
+    real sx, sy, sz;
+};
+
+// the distance to triangle (p0, p1, p2) between t_min and t_max with its barycentric coordinates
+inline bool hit_triangle(const watertight_ray& wr, const point3& p0, const point3& p1, const point3& p2,
+                         real t_min, real t_max, real& t, real& b0, real& b1, real& b2) {
+    auto a = p0 - wr.origin;
+    auto b = p1 - wr.origin;
+    auto c = p2 - wr.origin;
+
+    auto ax = a[wr.kx] - wr.sx * a[wr.kz];
+    auto ay = a[wr.ky] - wr.sy * a[wr.kz];
+    auto bx = b[wr.kx] - wr.sx * b[wr.kz];
+    auto by = b[wr.ky] - wr.sy * b[wr.kz];
+    auto cx = c[wr.kx] - wr.sx * c[wr.kz];
+    auto cy = c[wr.ky] - wr.sy * c[wr.kz];
+
+    // scaled barycentric coordinates: the ray passes inside when all three have the same sign
+    auto u = cx * by - cy * bx;
+    auto v = ax * cy - ay * cx;
+    auto w = bx * ay - by * ax;
+
+    // in single precision a ray through an edge or vertex can round to zero on one side and not on the
+    // other, so such rays are decided again in double precision, as the paper does
+    if (sizeof(real) < sizeof(double) && (u == 0 || v == 0 || w == 0)) {
+        u = static_cast<real>(static_cast<double>(cx) * by - static_cast<double>(cy) * bx);
+        v = static_cast<real>(static_cast<double>(ax) * cy - static_cast<double>(ay) * cx);
+        w = static_cast<real>(static_cast<double>(bx) * ay - static_cast<double>(by) * ax);
+    }
+    if ((u < 0 || v < 0 || w < 0) && (u > 0 || v > 0 || w > 0))
+        return false;
+
+    auto det = u + v + w;
+    if (det == 0)
+        return false;
+
+    // the scaled distance, compared against the range before the division
+    auto scaled_t = u * (wr.sz * a[wr.kz]) + v * (wr.sz * b[wr.kz]) + w * (wr.sz * c[wr.kz]);
+    if (det < 0 ? (scaled_t > t_min * det || scaled_t < t_max * det)
+                : (scaled_t < t_min * det || scaled_t > t_max * det))
+        return false;
+
+    auto inv_det = 1 / det;
+    t = scaled_t * inv_det;
+    b0 = u * inv_det;
+    b1 = v * inv_det;
+    b2 = w * inv_det;
+    return true;
+}
+
+// the primitives of a mesh's bvh
+struct mesh_triangles {
+    size_t size() const { return indices.size() / 3; }
+
+    aabb bounds(size_t i, double time0, double time1) const {
+        auto p0 = vertices->position(indices[3*i]);
+        auto p1 = vertices->position(indices[3*i + 1]);
+        auto p2 = vertices->position(indices[3*i + 2]);
+        return aabb(point3(fmin(p0.x(), fmin(p1.x(), p2.x())), fmin(p0.y(), fmin(p1.y(), p2.y())),
+                           fmin(p0.z(), fmin(p1.z(), p2.z()))),
+                    point3(fmax(p0.x(), fmax(p1.x(), p2.x())), fmax(p0.y(), fmax(p1.y(), p2.y())),
+                           fmax(p0.z(), fmax(p1.z(), p2.z()))));
+    }
+
+    void reorder(const std::vector<bvh_primitive_info>& order, thread_pool* pool);
+
+    bool hit(uint32_t first, uint32_t count, const ray& r, real t_min, real& t_max, hit_record& rec) const;
+    int hit_packet(uint32_t first, uint32_t count, const ray_packet& packet, int mask, real t_min,
+                   real* t_max, hit_record* recs) const;
+
+    void collect_lights(std::vector<const hittable*>& lights) const {}
+
+    // fills in the hit on triangle i
+    void set_hit_record(const ray& r, uint32_t i, real t, real b0, real b1, real b2,
+                        hit_record& rec) const;
+
+    shared_ptr<const mesh_vertices> vertices;
+    buffer<uint32_t> indices;
+    shared_ptr<material> mp;
+};
+
+void mesh_triangles::reorder(const std::vector<bvh_primitive_info>& order, thread_pool* pool) {
+    std::vector<uint32_t> sorted(indices.size());
+    bvh_for_chunks(pool, 0, size(), [&](size_t, size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            for (int k = 0; k < 3; k++)
+                sorted[3*i + k] = indices[3*order[i].index + k];
+        }
+    });
+    indices = std::move(sorted);
+}
+
+bool mesh_triangles::hit(
+    uint32_t first, uint32_t count, const ray& r, real t_min, real& t_max, hit_record& rec
+) const {
+    watertight_ray wr(r);
+    const auto& vs = *vertices;
+
+    uint32_t closest = 0;
+    real closest_b[3] = {0, 0, 0};
+    bool hit_anything = false;
+    for (uint32_t i = first; i < first + count; ++i) {
+        real t, b0, b1, b2;
+        if (hit_triangle(wr, vs.position(indices[3*i]), vs.position(indices[3*i + 1]), vs.position(indices[3*i + 2]),
+                         t_min, t_max, t, b0, b1, b2)) {
+            hit_anything = true;
+            t_max = t;
+            closest = i;
+            closest_b[0] = b0;
+            closest_b[1] = b1;
+            closest_b[2] = b2;
+        }
+    }
+
+    // only the closest triangle of the leaf fills in the record
+    if (hit_anything)
+        set_hit_record(r, closest, t_max, closest_b[0], closest_b[1], closest_b[2], rec);
+    return hit_anything;
+}
+
+int mesh_triangles::hit_packet(
+    uint32_t first, uint32_t count, const ray_packet& packet, int mask, real t_min, real* t_max,
+    hit_record* recs
+) const {
+    int hits = 0;
+    for (int i = 0; i < packet_size; i++) {
+        if ((mask & (1 << i)) && hit(first, count, packet.lane(i), t_min, t_max[i], recs[i]))
+            hits |= 1 << i;
+    }
+    return hits;
+}
+
+void mesh_triangles::set_hit_record(
+    const ray& r, uint32_t i, real t, real b0, real b1, real b2, hit_record& rec
+) const {
+    const auto& vs = *vertices;
+    auto i0 = indices[3*i];
+    auto i1 = indices[3*i + 1];
+    auto i2 = indices[3*i + 2];
+    auto p0 = vs.position(i0);
+    auto p1 = vs.position(i1);
+    auto p2 = vs.position(i2);
+
+    // the point from the barycentric coordinates rather than along the ray, which is off by the rounding of
+    // t times the length of the ray
+    rec.t = t;
+    rec.p = b0 * p0 + b1 * p1 + b2 * p2;
+    rec.error = hit_error(std::max(max_magnitude(p0), std::max(max_magnitude(p1), max_magnitude(p2))));
+    rec.mat_ptr = mp.get();
+
+    // the sides of the triangle are told apart by its own (geometric) normal, the shading normal interpolated
+    // from the vertex normals is then turned to the same side: exported files often have vertex normals that
+    // point against the winding, which would otherwise shade the surface from inside; rays leave along the
+    // geometric normal (see hit_record::spawn_origin)
+    auto geometric_normal = unit_vector(cross(p1 - p0, p2 - p0));
+    auto normal = geometric_normal;
+    if (!vs.nx.empty()) {
+        normal = b0 * vs.normal(i0) + b1 * vs.normal(i1) + b2 * vs.normal(i2);
+        if (dot(normal, geometric_normal) < 0)
+            normal = -normal;
+        normal = unit_vector(normal);
+    }
+    rec.set_face_normal(r, normal, geometric_normal);
+
+    // without texture coordinates the barycentric coordinates of the second and third vertex are used
+    if (vs.u.empty()) {
+        rec.u = b1;
+        rec.v = b2;
+    } else {
+        rec.u = b0 * vs.u[i0] + b1 * vs.u[i1] + b2 * vs.u[i2];
+        rec.v = b0 * vs.v[i0] + b1 * vs.v[i1] + b2 * vs.v[i2];
+    }
+}
+
+class triangle_mesh : public bvh_tree<mesh_triangles> {
+    public:
+        // indices holds three vertex indices per triangle, counterclockwise seen from the front
+        // pass a thread pool to build the bvh of large meshes in parallel
+        triangle_mesh(shared_ptr<const mesh_vertices> vertices, buffer<uint32_t> indices,
+                      shared_ptr<material> mat, thread_pool* pool = nullptr) {
+            primitives.vertices = std::move(vertices);
+            primitives.indices = std::move(indices);
+            primitives.mp = std::move(mat);
+            build_tree(0, 1, pool);
+        }
+
+        // a mesh whose triangles are already in the order of a tree built before (see scene_file.h)
+        triangle_mesh(shared_ptr<const mesh_vertices> vertices, buffer<uint32_t> indices, shared_ptr<material> mat,
+                      buffer<linear_bvh_node> binary, buffer<wide_bvh_node<4>> wide4, buffer<wide_bvh_node<8>> wide8) {
+            primitives.vertices = std::move(vertices);
+            primitives.indices = std::move(indices);
+            primitives.mp = std::move(mat);
+            use_tree(std::move(binary), std::move(wide4), std::move(wide8));
+        }
+
+        size_t triangle_count() const { return primitives.size(); }
+};
+
+#endif // TRIANGLE_MESH_H
@@ -7,51 +7,66 @@
 
 using std::sqrt;
 
-class vec3 {
+// the vector type is a template over its scalar type, so the geometry can be built in single or double
+// precision (see real in raytracer.h); the rest of the code uses vec3, the vector of the precision chosen
+// the scalar of the operators below is not deduced from their arguments, so a vector of either precision can
+// be scaled by a double or an integer
+
+template <typename T>
+class vec3_t {
     public:
-        vec3() : e{0,0,0} {}
-        vec3(double e0, double e1, double e2) : e{e0, e1, e2} {}
+        using scalar = T;
+
+        vec3_t() : e{0,0,0} {}
+        vec3_t(T e0, T e1, T e2) : e{e0, e1, e2} {}
+        // between precisions
+        template <typename U>
+        explicit vec3_t(const vec3_t<U>& v) : e{static_cast<T>(v.e[0]), static_cast<T>(v.e[1]), static_cast<T>(v.e[2])} {}
 
-        double x() const { return e[0]; }
-        double y() const { return e[1]; }
-        double z() const { return e[2]; }
+        T x() const { return e[0]; }
+        T y() const { return e[1]; }
+        T z() const { return e[2]; }
 
-        vec3 operator-() const { return {-e[0], -e[1], -e[2]}; }
-        double operator[](int i) const { return e[i]; }
-        double& operator[](int i) { return e[i]; }
+        vec3_t operator-() const { return {-e[0], -e[1], -e[2]}; }
+        T operator[](int i) const { return e[i]; }
+        T& operator[](int i) { return e[i]; }
 
-        vec3& operator+=(const vec3 &v) {
+        vec3_t& operator+=(const vec3_t &v) {
             e[0] += v.e[0];
             e[1] += v.e[1];
             e[2] += v.e[2];
             return *this;
         }
 
-        vec3& operator*=(const double t) {
+        vec3_t& operator*=(const T t) {
             e[0] *= t;
             e[1] *= t;
             e[2] *= t;
             return *this;
         }
 
-        vec3& operator/=(const double t) {
+        vec3_t& operator/=(const T t) {
             return *this *= 1/t;
         }
 
-        double length() const {
+        T length() const {
             return sqrt(length_squared());
         }
 
-        double length_squared() const {
+        T length_squared() const {
             return e[0]*e[0] + e[1]*e[1] + e[2]*e[2];
         }
 
-        inline static vec3 random() {
-            return {random_double(), random_double(), random_double()};
+        inline static vec3_t random() {
+            return vec3_t(random_double(), random_double(), random_double());
+        }
+
+        inline static vec3_t random(double min, double max) {
+            return vec3_t(random_double(min, max), random_double(min, max), random_double(min, max));
         }
 
-        inline static vec3 random(double min, double max) {
-            return {random_double(min, max), random_double(min, max), random_double(min, max)};
+        inline static vec3_t random(pcg32& rng, double min, double max) {
+            return vec3_t(random_double(rng, min, max), random_double(rng, min, max), random_double(rng, min, max));
         }
 
         bool near_zero() const{
@@ -61,52 +76,63 @@ class vec3 {
         }
 
     public:
-        double e[3];
+        T e[3];
 };
 
 // type aliases for vec3
+using vec3 = vec3_t<real>;
 using point3 = vec3; // 3D point
-using colour = vec3; // RGB colour
+using colour = vec3_t<double>; // RGB colour, always in double precision
 
-inline std::ostream& operator<<(std::ostream &out, const vec3 &v) {
+template <typename T>
+inline std::ostream& operator<<(std::ostream &out, const vec3_t<T> &v) {
     return out << v.e[0] << " " << v.e[1] << " " << v.e[2];
 }
 
-inline vec3 operator+(const vec3 &u, const vec3 &v) {
+template <typename T>
+inline vec3_t<T> operator+(const vec3_t<T> &u, const vec3_t<T> &v) {
     return {u.e[0] + v.e[0] , u.e[1] + v.e[1], u.e[2] + v.e[2]};
 }
 
-inline vec3 operator-(const vec3 &u, const vec3 &v) {
+template <typename T>
+inline vec3_t<T> operator-(const vec3_t<T> &u, const vec3_t<T> &v) {
     return {u.e[0] - v.e[0] , u.e[1] - v.e[1], u.e[2] - v.e[2]};
 }
 
-inline vec3 operator*(const vec3 &u, const vec3 &v) {
+template <typename T>
+inline vec3_t<T> operator*(const vec3_t<T> &u, const vec3_t<T> &v) {
     return {u.e[0] * v.e[0] , u.e[1] * v.e[1], u.e[2] * v.e[2]};
 }
 
-inline vec3 operator*(double t, const vec3 &v) {
+template <typename T>
+inline vec3_t<T> operator*(typename vec3_t<T>::scalar t, const vec3_t<T> &v) {
     return {t*v.e[0], t*v.e[1], t*v.e[2]};
 }
 
-inline vec3 operator*(const vec3 &v, double t) {
+template <typename T>
+inline vec3_t<T> operator*(const vec3_t<T> &v, typename vec3_t<T>::scalar t) {
     return t * v;
 }
 
-inline vec3 operator/(vec3 v, double t) {
+template <typename T>
+inline vec3_t<T> operator/(vec3_t<T> v, typename vec3_t<T>::scalar t) {
     return (1/t) * v;
 }
 
-inline double dot(const vec3 &u, const vec3 &v) {
+template <typename T>
+inline T dot(const vec3_t<T> &u, const vec3_t<T> &v) {
     return u.e[0] * v.e[0] + u.e[1] * v.e[1] + u.e[2] * v.e[2];
 }
 
-inline vec3 cross(const vec3 &u, const vec3 &v) {
+template <typename T>
+inline vec3_t<T> cross(const vec3_t<T> &u, const vec3_t<T> &v) {
     return {u.e[1] * v.e[2] - u.e[2] * v.e[1],
                 u.e[2] * v.e[0] - u.e[0] * v.e[2],
                 u.e[0] * v.e[1] - u.e[1] * v.e[0]};
 }
 
-inline vec3 unit_vector(vec3 v) {
+template <typename T>
+inline vec3_t<T> unit_vector(vec3_t<T> v) {
     return v/v.length();
 }
 
@@ -114,32 +140,79 @@ inline vec3 unit_vector(vec3 v) {
 // a rejection method (usually the easiest algorithm)
 // 1. pick a random point in a cube
 // 2. reject the point if it is not in the sphere
-inline vec3 random_in_unit_sphere() {
+inline vec3 random_in_unit_sphere(pcg32& rng) {
     while (true) {
-        auto p = vec3::random(-1, 1);
+        auto p = vec3::random(rng, -1, 1);
         if (p.length_squared() >= 1) continue;
         return p;
     }
 }
 
-// lambertian distribution - picking random points on the unit sphere, offset along the surface normal
-// picking random points on the unit sphere - picking random points in the unit sphere then normalizing them
-vec3 random_unit_vector() {
-    return unit_vector(random_in_unit_sphere());
+// the directions below are sampled without rejection loops: two random numbers each
+
+// a uniformly random point (x, y) on the unit circle
+// the circle is split into four quarters centred on the axes; the angle within a quarter, |a| <= pi/4, is
+// small enough for short Taylor series of sin and cos (error below 2e-9), which are much cheaper than the
+// library functions, and the point is then rotated into its quarter
+inline void random_on_unit_circle(pcg32& rng, double& x, double& y) {
+    auto u = 4*random_double(rng);
+    auto quarter = static_cast<int>(u);
+    auto a = (u - quarter - 0.5) * (pi/2);
+    auto a2 = a*a;
+    auto s = a * (1 - a2/6 * (1 - a2/20 * (1 - a2/42 * (1 - a2/72 * (1 - a2/110)))));
+    auto c = 1 - a2/2 * (1 - a2/12 * (1 - a2/30 * (1 - a2/56 * (1 - a2/90))));
+    switch (quarter) {
+        case 0: x = c; y = s; break;
+        case 1: x = -s; y = c; break;
+        case 2: x = -c; y = -s; break;
+        default: x = s; y = -c; break;
+    }
+}
+
+// a uniformly random point on the unit sphere: z is uniform in [-1, 1] (Archimedes' hat-box theorem) and
+// the angle around the z axis uniform
+vec3 random_unit_vector(pcg32& rng) {
+    auto z = 1 - 2*random_double(rng);
+    auto r = sqrt(fmax(0.0, 1 - z*z));
+    double x, y;
+    random_on_unit_circle(rng, x, y);
+    return vec3(r*x, r*y, z);
+}
+
+// a direction about the z axis with density cos(theta) / pi (lambertian distribution), from a uniform point
+// on the unit disk projected up onto the hemisphere (Malley's method)
+vec3 random_cosine_direction(pcg32& rng) {
+    auto r2 = random_double(rng);
+    auto r = sqrt(r2);
+    double x, y;
+    random_on_unit_circle(rng, x, y);
+    return vec3(r*x, r*y, sqrt(1 - r2));
+}
+
+// a direction about the z axis with density (n + 1) / (2 pi) cos^n(theta) (Phong lobe), by inverting the
+// distribution of cos(theta)
+vec3 random_phong_direction(double exponent, pcg32& rng) {
+    auto z = pow(random_double(rng), 1 / (exponent + 1));
+    auto r = sqrt(fmax(0.0, 1 - z*z));
+    double x, y;
+    random_on_unit_circle(rng, x, y);
+    return vec3(r*x, r*y, z);
 }
 
 // picking random points in the unit disk
-vec3 random_in_unit_disk() {
+vec3 random_in_unit_disk(pcg32& rng) {
     while (true) {
-        auto p = vec3(random_double(-1,1), random_double(-1,1), 0);
+        auto x = random_double(rng, -1, 1);
+        auto y = random_double(rng, -1, 1);
+        auto p = vec3(x, y, 0);
         if (p.length_squared() >= 1) continue;
         return p;
     }
 }
 
 // having a uniform scatter direction for all angles away from the hit point, with no dependence on the angle from the normal
-vec3 random_in_hemisphere(const vec3& normal) {
-    vec3 in_unit_sphere = random_in_unit_sphere();
+vec3 random_in_hemisphere(const vec3& normal, pcg32& rng) {
+    vec3 in_unit_sphere = random_in_unit_sphere(rng);
     if (dot(in_unit_sphere, normal) > 0.0) // in the same hemisphere as the normal
         return in_unit_sphere;
     else
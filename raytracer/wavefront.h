@@ -0,0 +1,227 @@
+#ifndef WAVEFRONT_H
+#define WAVEFRONT_H
+
+#include "raytracer.h"
+#include "hittable.h"
+#include "material.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+// wavefront (stream) path tracing
+// instead of following one path from the camera to its end, a whole batch of paths advances one bounce at
+// a time through a sequence of stages, each run over every live path before the next starts:
+// 1. extend: intersect the rays with the scene, paths that escape gather the background
+// 2. sort: bucket the hits by material kind
+// 3. emit: add the light emitted by surfaces that glow
+// 4. shade: scatter each bucket with its material's own scatter function, paths that are absorbed end
+// so traversal code and each material's code run back to back over many paths instead of interleaving
+
+// the state of every path in a batch, in structure-of-arrays layout
+struct path_states {
+    void resize(size_t n) {
+        for (int a = 0; a < 3; a++) {
+            origin[a].resize(n);
+            direction[a].resize(n);
+            throughput[a].resize(n);
+            radiance[a].resize(n);
+        }
+        time.resize(n);
+        rng.resize(n);
+    }
+
+    size_t size() const { return rng.size(); }
+
+    ray get_ray(size_t i) const {
+        return ray(point3(origin[0][i], origin[1][i], origin[2][i]),
+                   vec3(direction[0][i], direction[1][i], direction[2][i]), time[i]);
+    }
+
+    void set_ray(size_t i, const ray& r) {
+        for (int a = 0; a < 3; a++) {
+            origin[a][i] = r.orig.e[a];
+            direction[a][i] = r.dir.e[a];
+        }
+        time[i] = r.tm;
+    }
+
+    // the ray the path follows next
+    std::vector<real> origin[3];
+    std::vector<real> direction[3];
+    std::vector<real> time;
+    // product of the attenuations along the path, and the light gathered so far
+    std::vector<double> throughput[3];
+    std::vector<double> radiance[3];
+    // every path draws from its own generator, in the same order as ray_colour
+    std::vector<pcg32> rng;
+};
+
+class wavefront_integrator {
+    public:
+        wavefront_integrator(const hittable& w, const colour& b, int d) : world(w), background(b), max_depth(d) {}
+
+        // trace every path of the batch to its end, leaving its colour in paths.radiance
+        // returns the number of segments traced
+        uint64_t trace(path_states& paths);
+
+    private:
+        void extend(path_states& paths);
+        void sort_by_material();
+        void emit(path_states& paths, const std::vector<uint32_t>& queue);
+        void shade(path_states& paths, material_kind kind, const std::vector<uint32_t>& queue);
+
+        template <typename M>
+        void shade_queue(path_states& paths, const std::vector<uint32_t>& queue);
+
+    private:
+        const hittable& world;
+        colour background;
+        int max_depth;
+
+        std::vector<uint32_t> active;   // paths still being traced
+        std::vector<uint32_t> hit_paths; // live paths whose ray hit a surface this bounce
+        std::vector<hit_record> hits;   // indexed by path
+        std::vector<uint32_t> queues[material_kind_count];
+};
+
+uint64_t wavefront_integrator::trace(path_states& paths) {
+    const auto n = paths.size();
+    hits.resize(n);
+
+    active.resize(n);
+    for (size_t i = 0; i < n; i++) {
+        active[i] = static_cast<uint32_t>(i);
+        for (int a = 0; a < 3; a++) {
+            paths.throughput[a][i] = 1;
+            paths.radiance[a][i] = 0;
+        }
+    }
+
+    uint64_t segments = 0;
+    for (int depth = 0; depth < max_depth && !active.empty(); depth++) {
+        segments += active.size();
+        extend(paths);
+        sort_by_material();
+
+        emit(paths, queues[static_cast<int>(material_kind::diffuse_light)]);
+        emit(paths, queues[static_cast<int>(material_kind::other)]);
+
+        active.clear();
+        for (int k = 0; k < material_kind_count; k++)
+            shade(paths, static_cast<material_kind>(k), queues[k]);
+    }
+    return segments;
+}
+
+void wavefront_integrator::extend(path_states& paths) {
+    hit_paths.clear();
+
+    // neighbouring paths are traced as packets while their rays stay coherent (camera rays, mostly)
+    for (size_t first = 0; first < active.size(); first += packet_size) {
+        auto lanes = static_cast<int>(std::min<size_t>(packet_size, active.size() - first));
+        const uint32_t* index = active.data() + first;
+
+        ray_packet packet{};
+        for (int k = 0; k < lanes; k++) {
+            for (int a = 0; a < 3; a++) {
+                packet.origin[a][k] = paths.origin[a][index[k]];
+                packet.direction[a][k] = paths.direction[a][index[k]];
+            }
+            packet.time[k] = paths.time[index[k]];
+        }
+
+        int mask = (1 << lanes) - 1;
+        int hit_mask = 0;
+        if (lanes > 1 && packet_is_coherent(packet, mask)) {
+            hit_record recs[packet_size];
+            real t_max[packet_size];
+            for (int k = 0; k < packet_size; k++)
+                t_max[k] = infinity;
+
+            hit_mask = world.hit_packet(packet, mask, 0, t_max, recs);
+            for (int k = 0; k < lanes; k++) {
+                if (hit_mask & (1 << k))
+                    hits[index[k]] = recs[k];
+            }
+        } else {
+            for (int k = 0; k < lanes; k++) {
+                if (world.hit(packet.lane(k), 0, infinity, hits[index[k]]))
+                    hit_mask |= 1 << k;
+            }
+        }
+
+        for (int k = 0; k < lanes; k++) {
+            auto i = index[k];
+            if (hit_mask & (1 << k)) {
+                hit_paths.push_back(i);
+                continue;
+            }
+            // the path escapes the scene
+            for (int a = 0; a < 3; a++)
+                paths.radiance[a][i] += paths.throughput[a][i] * background.e[a];
+        }
+    }
+}
+
+void wavefront_integrator::sort_by_material() {
+    for (auto& queue : queues)
+        queue.clear();
+    for (auto i : hit_paths)
+        queues[static_cast<int>(hits[i].mat_ptr->kind())].push_back(i);
+}
+
+void wavefront_integrator::emit(path_states& paths, const std::vector<uint32_t>& queue) {
+    for (auto i : queue) {
+        const auto& rec = hits[i];
+        auto emitted = rec.mat_ptr->emitted(rec.u, rec.v, rec.p);
+        for (int a = 0; a < 3; a++)
+            paths.radiance[a][i] += paths.throughput[a][i] * emitted.e[a];
+    }
+}
+
+void wavefront_integrator::shade(path_states& paths, material_kind kind, const std::vector<uint32_t>& queue) {
+    switch (kind) {
+        case material_kind::lambertian: shade_queue<lambertian>(paths, queue); break;
+        case material_kind::metal: shade_queue<metal>(paths, queue); break;
+        case material_kind::dielectric: shade_queue<dielectric>(paths, queue); break;
+        case material_kind::diffuse_light: shade_queue<diffuse_light>(paths, queue); break;
+        case material_kind::isotropic: shade_queue<isotropic>(paths, queue); break;
+        default: shade_queue<material>(paths, queue); break;
+    }
+}
+
+// naming the function M::scatter binds the call statically, so it can be inlined into the shading loop
+template <typename M>
+inline bool scatter_as(
+    const material& mat, const ray& r_in, const hit_record& rec, colour& attenuation, ray& scattered, pcg32& rng
+) {
+    return static_cast<const M&>(mat).M::scatter(r_in, rec, attenuation, scattered, rng);
+}
+
+// the catch-all queue keeps the virtual call
+template <>
+inline bool scatter_as<material>(
+    const material& mat, const ray& r_in, const hit_record& rec, colour& attenuation, ray& scattered, pcg32& rng
+) {
+    return mat.scatter(r_in, rec, attenuation, scattered, rng);
+}
+
+// scatter every path of a queue off a material of type M
+template <typename M>
+void wavefront_integrator::shade_queue(path_states& paths, const std::vector<uint32_t>& queue) {
+    for (auto i : queue) {
+        const auto& rec = hits[i];
+        ray scattered;
+        colour attenuation;
+        if (!scatter_as<M>(*rec.mat_ptr, paths.get_ray(i), rec, attenuation, scattered, paths.rng[i]))
+            continue;
+
+        for (int a = 0; a < 3; a++)
+            paths.throughput[a][i] *= attenuation.e[a];
+        paths.set_ray(i, scattered);
+        active.push_back(i);
+    }
+}
+
+#endif // WAVEFRONT_H